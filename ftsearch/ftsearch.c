@@ -14,46 +14,366 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include <err.h>
-#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "db.h"
 #include "fts.h"
+#include "proto.h"
+#include "segments.h"
 #include "tokenize.h"
 
-const char *dbpath;
+/* queries read at a time by -b */
+#define BATCH	1024
+
+/* memory for the results cached by -b */
+#define BATCH_CACHE	(64 * 1024 * 1024)
+
+struct batch_query {
+	size_t		 line;
+	char		*query;
+	const char	*errstr;	/* why the query can't run */
+	char		*out;
+	size_t		 outlen;
+	int		 ret;
+};
+
+struct batch {
+	struct fts_shard	*shards;
+	size_t			 topk;
+	struct batch_query	*qs;
+	size_t			 len;
+	size_t			 next;
+	pthread_mutex_t		 mtx;
+};
+
+struct batch_out {
+	FILE	*fp;
+	size_t	 line;
+};
+
+/* the databases given with -d */
+const char	**dbpaths;
+size_t		  ndbs;
 
 static void __dead
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-d db] -l | -s | query",
-	    getprogname());
+	fprintf(stderr,
+	    "usage: %s [-d db ...] [-k num] [-S socket] -l | -s | query\n"
+	    "       %s [-d db ...] [-j jobs] [-k num] -b\n",
+	    getprogname(), getprogname());
 	exit(1);
 }
 
+/* data is the path of the database, to be printed first, or NULL */
 static int
 print_entry(struct db *db, struct db_entry *entry, void *data)
 {
+	const char *path = data;
+
+	if (path != NULL)
+		printf("%s: ", path);
 	printf("%-18s %s\n", entry->name, entry->descr);
 	return 0;
 }
 
+/* with more than one database every hit says where it comes from */
+static int
+print_hit(size_t i, struct db *db, struct db_entry *entry, double score,
+    void *data)
+{
+	return print_entry(db, entry, ndbs > 1 ? (void *)dbpaths[i] : NULL);
+}
+
+static int
+batch_hit(size_t i, struct db *db, struct db_entry *entry, double score,
+    void *data)
+{
+	struct batch_out *bo = data;
+	int r;
+
+	if (ndbs > 1)
+		r = fprintf(bo->fp, "%zu %s: %-18s %s\n", bo->line,
+		    dbpaths[i], entry->name, entry->descr);
+	else
+		r = fprintf(bo->fp, "%zu %-18s %s\n", bo->line,
+		    entry->name, entry->descr);
+	return r < 0 ? -1 : 0;
+}
+
+static void *
+batch_run(void *arg)
+{
+	struct batch *b = arg;
+	struct batch_query *q;
+	struct batch_out bo;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&b->mtx);
+		i = b->next++;
+		pthread_mutex_unlock(&b->mtx);
+		if (i >= b->len)
+			break;
+
+		q = &b->qs[i];
+		if (q->errstr != NULL)
+			continue;
+		if ((bo.fp = open_memstream(&q->out, &q->outlen)) == NULL) {
+			q->ret = -1;
+			continue;
+		}
+		bo.line = q->line;
+		q->ret = fts_shards(b->shards, ndbs, q->query, b->topk,
+		    batch_hit, &bo);
+		if (fclose(bo.fp) == EOF)
+			q->ret = -1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Run the queries read from stdin, one per line, on jobs threads.  The
+ * queries are read BATCH at a time and the results of every batch are
+ * printed in input order, prefixed by the line number of the query.
+ */
+static int
+batch(struct fts_shard *shards, int jobs, size_t topk)
+{
+	struct batch b;
+	struct batch_query *q;
+	struct segments *segs;
+	pthread_t *tids;
+	char *line = NULL;
+	size_t i, j, nsegs = 0, linesize = 0, lineno = 0;
+	ssize_t linelen;
+	int n, r, ret = 0, eof = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.shards = shards;
+	b.topk = topk;
+	if ((b.qs = calloc(BATCH, sizeof(*b.qs))) == NULL)
+		err(1, "calloc");
+	if ((tids = calloc(jobs, sizeof(*tids))) == NULL)
+		err(1, "calloc");
+	if ((r = pthread_mutex_init(&b.mtx, NULL)) != 0)
+		errc(1, r, "pthread_mutex_init");
+	/* the queries that repeat are searched only once */
+	for (i = 0; topk == 0 && i < ndbs; ++i)
+		nsegs += shards[i].segs->len;
+	for (i = 0; topk == 0 && i < ndbs; ++i) {
+		segs = shards[i].segs;
+		shards[i].ctxs = calloc(segs->len, sizeof(*shards[i].ctxs));
+		if (shards[i].ctxs == NULL)
+			err(1, "calloc");
+		for (j = 0; j < segs->len; ++j) {
+			shards[i].ctxs[j] = fts_ctx_new(&segs->dbs[j],
+			    BATCH_CACHE / nsegs);
+			if (shards[i].ctxs[j] == NULL)
+				err(1, "fts_ctx_new");
+		}
+	}
+
+	while (!eof) {
+		for (b.len = 0; b.len < BATCH; ) {
+			linelen = getline(&line, &linesize, stdin);
+			if (linelen == -1) {
+				if (ferror(stdin))
+					err(1, "getline");
+				eof = 1;
+				break;
+			}
+			lineno++;
+			if (linelen > 0 && line[linelen - 1] == '\n')
+				line[--linelen] = '\0';
+			if (linelen == 0)
+				continue;
+
+			q = &b.qs[b.len++];
+			memset(q, 0, sizeof(*q));
+			q->line = lineno;
+			if ((q->query = strdup(line)) == NULL)
+				err(1, "strdup");
+			fts_check(q->query, &q->errstr);
+		}
+
+		b.next = 0;
+		n = jobs;
+		if ((size_t)n > b.len)
+			n = b.len;
+		for (i = 0; i < (size_t)n; ++i) {
+			r = pthread_create(&tids[i], NULL, batch_run, &b);
+			if (r != 0)
+				errc(1, r, "pthread_create");
+		}
+		for (i = 0; i < (size_t)n; ++i)
+			if ((r = pthread_join(tids[i], NULL)) != 0)
+				errc(1, r, "pthread_join");
+
+		for (i = 0; i < b.len; ++i) {
+			q = &b.qs[i];
+			if (q->errstr != NULL) {
+				warnx("query at line %zu: %s", q->line,
+				    q->errstr);
+				ret = -1;
+			} else if (q->ret == -1) {
+				warnx("query at line %zu failed", q->line);
+				ret = -1;
+			} else
+				fwrite(q->out, 1, q->outlen, stdout);
+			free(q->query);
+			free(q->out);
+		}
+		if (fflush(stdout) == EOF)
+			err(1, "write");
+	}
+
+	pthread_mutex_destroy(&b.mtx);
+	for (i = 0; i < ndbs; ++i) {
+		for (j = 0; shards[i].ctxs != NULL &&
+		    j < shards[i].segs->len; ++j)
+			fts_ctx_free(shards[i].ctxs[j]);
+		free(shards[i].ctxs);
+		shards[i].ctxs = NULL;
+	}
+	free(line);
+	free(tids);
+	free(b.qs);
+	return ret;
+}
+
+/* run the query on the ftsearchd(8) listening on path */
+static void
+remote_query(const char *path, const char *query)
+{
+	struct sockaddr_un sun;
+	struct proto p;
+	struct db_entry e;
+	const char *errstr;
+	size_t len;
+	uint32_t l;
+	char *data;
+	int fd, r;
+
+	if (fts_check(query, &errstr) == -1)
+		errx(1, "%s", errstr);
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errx(1, "socket path too long: %s", path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "connect %s", path);
+
+	if (pledge("stdio", NULL) == -1)
+		err(1, "pledge");
+
+	proto_init(&p, fd);
+	len = strlen(query);
+	if (len > PROTO_MAXLEN)
+		errx(1, "query too long");
+	if (proto_begin(&p, len) == -1 || proto_add(&p, query, len) == -1 ||
+	    proto_flush(&p) == -1)
+		err(1, "write");
+
+	while ((r = proto_read(&p, &data, &l)) == 1) {
+		if (l == 0)
+			break;
+		if (l == PROTO_ERR)
+			errx(1, "fts failed");
+
+		e.name = data;
+		len = strlen(data);
+		e.descr = len < l ? data + len + 1 : data + len;
+		print_entry(NULL, &e, NULL);
+	}
+	if (r != 1)
+		errx(1, "connection lost");
+
+	proto_free(&p);
+	close(fd);
+}
+
+/* whether all the segments store the positions of the words */
+static int
+has_positions(struct segments *segs)
+{
+	size_t i;
+
+	for (i = 0; i < segs->len; ++i)
+		if (!(segs->dbs[i].flags & DB_POSITIONS))
+			return 0;
+	return 1;
+}
+
+static void
+print_stats(struct db *db)
+{
+	struct db_stats st;
+
+	if (db_stats(db, &st) == -1)
+		err(1, "db_stats");
+	printf("unique words = %zu\n", st.nwords);
+	printf("documents    = %zu\n", st.ndocs);
+	if (db->ndeleted != 0)
+		printf("deleted      = %u\n", db->ndeleted);
+	printf("longest word = %s\n", st.longest_word);
+	printf("most popular = %s (%zu)\n", st.most_popular,
+	    st.most_popular_ndocs);
+	free(st.longest_word);
+	free(st.most_popular);
+}
+
 int
 main(int argc, char **argv)
 {
-	struct db db;
-	const char *errstr;
-	int fd, ch;
-	int list = 0, stats = 0, docid = -1;
+	struct segments *segs;
+	struct fts_shard *shards;
+	size_t i, j;
+	const char *errstr, *sock = NULL;
+	void *t;
+	long ncpu;
+	size_t topk = 0;
+	int ch, ret = 0;
+	int list = 0, stats = 0, docid = -1, batchmode = 0, jobs = 0;
 
-	while ((ch = getopt(argc, argv, "d:lp:s")) != -1) {
+	while ((ch = getopt(argc, argv, "bd:j:k:lp:S:s")) != -1) {
 		switch (ch) {
+		case 'b':
+			batchmode = 1;
+			break;
 		case 'd':
-			dbpath = optarg;
+			t = reallocarray(dbpaths, ndbs + 1, sizeof(*dbpaths));
+			if (t == NULL)
+				err(1, "reallocarray");
+			dbpaths = t;
+			dbpaths[ndbs++] = optarg;
+			break;
+		case 'j':
+			jobs = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of jobs is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'k':
+			topk = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of results is %s: %s", errstr,
+				    optarg);
 			break;
 		case 'l':
 			list = 1;
@@ -64,6 +384,9 @@ main(int argc, char **argv)
 				errx(1, "document id is %s: %s", errstr,
 				    optarg);
 			break;
+		case 'S':
+			sock = optarg;
+			break;
 		case 's':
 			stats = 1;
 			break;
@@ -74,47 +397,101 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (dbpath == NULL)
-		dbpath = "db";
+	if (ndbs == 0) {
+		if ((dbpaths = calloc(1, sizeof(*dbpaths))) == NULL)
+			err(1, "calloc");
+		dbpaths[ndbs++] = "db";
+	}
 
 	if (list && stats)
 		usage();
 
-	if ((fd = open(dbpath, O_RDONLY)) == -1)
-		err(1, "can't open %s", dbpath);
+	if (batchmode) {
+		if (list || stats || docid != -1 || sock != NULL || argc != 0)
+			usage();
+		if (jobs == 0) {
+			ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+			jobs = ncpu > 0 ? (ncpu > 256 ? 256 : ncpu) : 1;
+		}
+	} else if (jobs != 0)
+		usage();
+
+	if (topk != 0 && (list || stats || docid != -1))
+		usage();
+
+	/* the document ids are of a single database */
+	if (docid != -1 && ndbs > 1)
+		usage();
+
+	if (sock != NULL) {
+		if (list || stats || docid != -1 || topk != 0 || argc != 1 ||
+		    ndbs > 1)
+			usage();
+		remote_query(sock, *argv);
+		return 0;
+	}
+
+	segs = calloc(ndbs, sizeof(*segs));
+	shards = calloc(ndbs, sizeof(*shards));
+	if (segs == NULL || shards == NULL)
+		err(1, "calloc");
+	for (i = 0; i < ndbs; ++i) {
+		if (segments_open(&segs[i], dbpaths[i]) == -1)
+			err(1, "can't open %s", dbpaths[i]);
+		shards[i].segs = &segs[i];
+	}
 
 	if (pledge("stdio", NULL) == -1)
 		err(1, "pledge");
 
-	if (db_open(&db, fd) == -1)
-		err(1, "db_open");
-
-	if (list) {
-		if (db_listall(&db, print_entry, NULL) == -1)
-			err(1, "db_listall");
+	if (batchmode) {
+		if (batch(shards, jobs, topk) == -1)
+			ret = 1;
+	} else if (list) {
+		for (i = 0; i < ndbs; ++i)
+			if (segments_listall(&segs[i], print_entry,
+			    ndbs > 1 ? (void *)dbpaths[i] : NULL) == -1)
+				err(1, "db_listall");
 	} else if (stats) {
-		struct db_stats st;
-
-		if (db_stats(&db, &st) == -1)
-			err(1, "db_stats");
-		printf("unique words = %zu\n", st.nwords);
-		printf("documents    = %zu\n", st.ndocs);
-		printf("longest word = %s\n", st.longest_word);
-		printf("most popular = %s (%zu)\n", st.most_popular,
-		    st.most_popular_ndocs);
+		for (i = 0; i < ndbs; ++i) {
+			if (ndbs > 1)
+				printf("%sdatabase %s\n", i > 0 ? "\n" : "",
+				    dbpaths[i]);
+			for (j = 0; j < segs[i].len; ++j) {
+				if (segs[i].len > 1)
+					printf("%ssegment %s\n",
+					    j > 0 ? "\n" : "",
+					    segs[i].names[j]);
+				print_stats(&segs[i].dbs[j]);
+			}
+		}
 	} else if (docid != -1) {
 		struct db_entry e;
 
-		if (db_doc_by_id(&db, docid, &e) == -1)
+		if (segments_doc_by_id(&segs[0], docid, &e) == -1)
 			errx(1, "failed to fetch document #%d", docid);
-		print_entry(&db, &e, NULL);
+		print_entry(NULL, &e, NULL);
 	} else {
 		if (argc != 1)
 			usage();
-		if (fts(&db, *argv, print_entry, NULL) == -1)
+		if (fts_check(*argv, &errstr) == -1)
+			errx(1, "%s", errstr);
+		if (fts_shards(shards, ndbs, *argv, topk, print_hit,
+		    NULL) == -1) {
+			for (i = 0; strchr(*argv, '"') != NULL && i < ndbs;
+			    ++i)
+				if (!has_positions(&segs[i]))
+					errx(1, "%s has no positions for the "
+					    "phrases; rebuild it with "
+					    "mkftsidx -p", dbpaths[i]);
 			errx(1, "fts failed");
+		}
 	}
 
-	db_close(&db);
-	close(fd);
+	for (i = 0; i < ndbs; ++i)
+		segments_close(&segs[i]);
+	free(segs);
+	free(shards);
+	free(dbpaths);
+	return ret;
 }
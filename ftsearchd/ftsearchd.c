@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "db.h"
+#include "fts.h"
+#include "proto.h"
+#include "segments.h"
+
+/* default size of the cache */
+#define CACHESIZE	(64 * 1024 * 1024)
+
+/* seconds a client has to read a reply */
+#define IO_TIMEOUT	10
+
+struct client {
+	TAILQ_ENTRY(client)	 entry;
+	int			 fd;
+	struct proto		 p;
+};
+
+TAILQ_HEAD(clientq, client);
+
+struct segments	  segs;
+struct fts_ctx	**ctxs;
+int		  sock;
+
+/*
+ * The main thread reads from the idle clients and queues in ready
+ * those that have sent a whole query.  A worker answers it and then
+ * puts the client in done and wakes up the main thread with wakefd.
+ */
+struct clientq	  ready = TAILQ_HEAD_INITIALIZER(ready);
+struct clientq	  done = TAILQ_HEAD_INITIALIZER(done);
+pthread_mutex_t	  mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t	  cond = PTHREAD_COND_INITIALIZER;
+int		  wakefd[2];
+
+static void __dead
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: %s [-d] [-c size] [-j jobs] [-s socket] [dbpath]\n",
+	    getprogname());
+	exit(1);
+}
+
+static int
+send_hit(struct db *db, struct db_entry *e, void *data)
+{
+	struct proto *p = data;
+	size_t namelen, descrlen;
+
+	namelen = strlen(e->name);
+	descrlen = strlen(e->descr);
+	if (proto_begin(p, namelen + 1 + descrlen) == -1 ||
+	    proto_add(p, e->name, namelen + 1) == -1 ||
+	    proto_add(p, e->descr, descrlen) == -1)
+		return -1;
+	return 0;
+}
+
+/* answer the next query of the client; -1 if it has to go */
+static int
+serve(struct client *c)
+{
+	char *query;
+	uint32_t len;
+	int r;
+
+	if (proto_read(&c->p, &query, &len) != 1 || len == PROTO_ERR)
+		return -1;
+
+	if (fts_segments(&segs, ctxs, query, send_hit, &c->p) == -1)
+		r = proto_begin(&c->p, PROTO_ERR);
+	else
+		r = proto_begin(&c->p, 0);
+	if (r == -1 || proto_flush(&c->p) == -1)
+		return -1;
+	return 0;
+}
+
+static void
+client_free(struct client *c)
+{
+	proto_free(&c->p);
+	close(c->fd);
+	free(c);
+}
+
+static void
+wakeup(void)
+{
+	char ch = 0;
+
+	/* if the pipe is full the main thread is already awake */
+	while (write(wakefd[1], &ch, 1) == -1 && errno == EINTR)
+		;
+}
+
+/*
+ * Serve the ready clients a query at a time.  The ones that already
+ * sent another query go back at the end of ready, the others to the
+ * main thread, so that no client can keep a worker for itself.
+ */
+static void *
+worker(void *arg)
+{
+	struct client *c;
+	int pending;
+
+	for (;;) {
+		pthread_mutex_lock(&mtx);
+		while ((c = TAILQ_FIRST(&ready)) == NULL)
+			pthread_cond_wait(&cond, &mtx);
+		TAILQ_REMOVE(&ready, c, entry);
+		pthread_mutex_unlock(&mtx);
+
+		if (serve(c) == -1) {
+			client_free(c);
+			/* the main thread may be waiting for a free fd */
+			wakeup();
+			continue;
+		}
+
+		pending = proto_pending(&c->p);
+		pthread_mutex_lock(&mtx);
+		if (pending) {
+			TAILQ_INSERT_TAIL(&ready, c, entry);
+			pthread_cond_signal(&cond);
+		} else
+			TAILQ_INSERT_TAIL(&done, c, entry);
+		pthread_mutex_unlock(&mtx);
+
+		if (!pending)
+			wakeup();
+	}
+
+	return NULL;
+}
+
+static void __dead
+fatal(const char *what)
+{
+	syslog(LOG_ERR, "%s: %m", what);
+	exit(1);
+}
+
+static struct client *
+client_new(int fd)
+{
+	struct client *c;
+	struct timeval tv;
+
+	tv.tv_sec = IO_TIMEOUT;
+	tv.tv_usec = 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1 ||
+	    (c = calloc(1, sizeof(*c))) == NULL) {
+		syslog(LOG_WARNING, "new client: %m");
+		close(fd);
+		return NULL;
+	}
+
+	c->fd = fd;
+	proto_init(&c->p, fd);
+	return c;
+}
+
+/*
+ * Accept the clients and read from them until they've sent a whole
+ * query, then hand them to the workers until they've been answered.
+ * A client that is idle, or slow to send, doesn't hold a worker.
+ */
+static void __dead
+dispatch(void)
+{
+	struct clientq idle = TAILQ_HEAD_INITIALIZER(idle);
+	struct clientq queries = TAILQ_HEAD_INITIALIZER(queries);
+	struct pollfd *pfds = NULL;
+	struct client **pcs = NULL, *c;
+	char buf[64];
+	size_t i, n, nidle = 0, cap = 0;
+	int r, fd, paused = 0;
+	void *t;
+
+	for (;;) {
+		/* the socket and wakefd first, then the idle clients */
+		n = nidle + 2;
+		if (n > cap) {
+			cap = n * 2;
+			t = reallocarray(pfds, cap, sizeof(*pfds));
+			if (t == NULL)
+				fatal("reallocarray");
+			pfds = t;
+			t = reallocarray(pcs, cap, sizeof(*pcs));
+			if (t == NULL)
+				fatal("reallocarray");
+			pcs = t;
+		}
+
+		pfds[0].fd = sock;
+		pfds[0].events = paused ? 0 : POLLIN;
+		pfds[1].fd = wakefd[0];
+		pfds[1].events = POLLIN;
+		i = 2;
+		TAILQ_FOREACH(c, &idle, entry) {
+			pfds[i].fd = c->fd;
+			pfds[i].events = POLLIN;
+			pcs[i++] = c;
+		}
+
+		/* out of fds, wait for a client to go or a second */
+		if (poll(pfds, n, paused ? 1000 : INFTIM) == -1) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll");
+		}
+		paused = 0;
+
+		for (i = 2; i < n; ++i) {
+			if (pfds[i].revents == 0)
+				continue;
+			if ((r = proto_poll(&pcs[i]->p)) == 0)
+				continue;
+			TAILQ_REMOVE(&idle, pcs[i], entry);
+			nidle--;
+			if (r == -1)
+				client_free(pcs[i]);
+			else
+				TAILQ_INSERT_TAIL(&queries, pcs[i], entry);
+		}
+
+		pthread_mutex_lock(&mtx);
+		if (!TAILQ_EMPTY(&queries)) {
+			TAILQ_CONCAT(&ready, &queries, entry);
+			pthread_cond_broadcast(&cond);
+		}
+		if (pfds[1].revents & POLLIN) {
+			while (read(wakefd[0], buf, sizeof(buf)) > 0)
+				;
+			while ((c = TAILQ_FIRST(&done)) != NULL) {
+				TAILQ_REMOVE(&done, c, entry);
+				TAILQ_INSERT_TAIL(&idle, c, entry);
+				nidle++;
+			}
+		}
+		pthread_mutex_unlock(&mtx);
+
+		if (!(pfds[0].revents & POLLIN))
+			continue;
+		if ((fd = accept(sock, NULL, NULL)) == -1) {
+			if (errno == EMFILE || errno == ENFILE)
+				paused = 1;
+			if (errno != EINTR && errno != ECONNABORTED &&
+			    errno != EAGAIN)
+				syslog(LOG_WARNING, "accept: %m");
+		} else if ((c = client_new(fd)) != NULL) {
+			TAILQ_INSERT_TAIL(&idle, c, entry);
+			nidle++;
+		}
+	}
+}
+
+/* log the statistics of the cache at every SIGUSR1 */
+static void *
+stats(void *arg)
+{
+	struct fts_stats st, t;
+	sigset_t *set = arg;
+	size_t i;
+	int sig;
+
+	for (;;) {
+		if (sigwait(set, &sig) != 0)
+			continue;
+		if (ctxs == NULL) {
+			syslog(LOG_INFO, "cache disabled");
+			continue;
+		}
+		memset(&st, 0, sizeof(st));
+		for (i = 0; i < segs.len; ++i) {
+			fts_ctx_stats(ctxs[i], &t);
+			st.hits += t.hits;
+			st.misses += t.misses;
+			st.term_hits += t.term_hits;
+			st.term_misses += t.term_misses;
+			st.mem += t.mem;
+		}
+		syslog(LOG_INFO, "cache: %zu hits, %zu misses; words: "
+		    "%zu hits, %zu misses; %zu bytes", st.hits, st.misses,
+		    st.term_hits, st.term_misses, st.mem);
+	}
+
+	return NULL;
+}
+
+static int
+listen_on(const char *path)
+{
+	struct sockaddr_un sun;
+	mode_t mask;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errx(1, "socket path too long: %s", path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+
+	if (unlink(path) == -1 && errno != ENOENT)
+		err(1, "unlink %s", path);
+
+	mask = umask(0111);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "bind %s", path);
+	umask(mask);
+
+	if (listen(fd, 128) == -1)
+		err(1, "listen");
+	return fd;
+}
+
+int
+main(int argc, char **argv)
+{
+	pthread_t tid;
+	sigset_t set;
+	const char *dbpath, *path = FTSEARCHD_SOCK, *errstr;
+	long long cachesize = CACHESIZE;
+	size_t n;
+	int ch, i, r, debug = 0, jobs = 4;
+
+	while ((ch = getopt(argc, argv, "c:dj:s:")) != -1) {
+		switch (ch) {
+		case 'c':
+			if (scan_scaled(optarg, &cachesize) == -1)
+				err(1, "invalid cache size: %s", optarg);
+			if (cachesize < 0)
+				errx(1, "invalid cache size: %s", optarg);
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'j':
+			jobs = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of jobs is %s: %s", errstr,
+				    optarg);
+			break;
+		case 's':
+			path = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1)
+		usage();
+	dbpath = argc == 1 ? *argv : "db";
+
+	if (segments_open(&segs, dbpath) == -1)
+		err(1, "can't open %s", dbpath);
+
+	/* every segment gets its share of the cache */
+	if (cachesize != 0) {
+		if ((ctxs = calloc(segs.len, sizeof(*ctxs))) == NULL)
+			err(1, "calloc");
+		for (n = 0; n < segs.len; ++n) {
+			ctxs[n] = fts_ctx_new(&segs.dbs[n],
+			    cachesize / segs.len);
+			if (ctxs[n] == NULL)
+				err(1, "fts_ctx_new");
+		}
+	}
+
+	sock = listen_on(path);
+	if (pipe2(wakefd, O_NONBLOCK) == -1)
+		err(1, "pipe2");
+
+	signal(SIGPIPE, SIG_IGN);
+
+	openlog(getprogname(), LOG_PID | (debug ? LOG_PERROR : 0),
+	    LOG_DAEMON);
+	if (!debug && daemon(0, 0) == -1)
+		err(1, "daemon");
+
+	if (pledge("stdio unix", NULL) == -1)
+		err(1, "pledge");
+
+	/* the workers inherit the mask, SIGUSR1 is for stats() only */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	if ((r = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0 ||
+	    (r = pthread_create(&tid, NULL, stats, &set)) != 0) {
+		syslog(LOG_ERR, "stats thread: %s", strerror(r));
+		exit(1);
+	}
+
+	for (i = 0; i < jobs; ++i) {
+		if ((r = pthread_create(&tid, NULL, worker, NULL)) != 0) {
+			syslog(LOG_ERR, "pthread_create: %s", strerror(r));
+			exit(1);
+		}
+	}
+
+	dispatch();
+}
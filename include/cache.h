@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A size-bounded cache of sorted lists of document ids, keyed by
+ * string and evicted in least recently used order.  It can be shared
+ * between threads: the entries are reference counted, so one that is
+ * evicted while in use is only freed once released.
+ */
+
+struct cache_entry {
+	TAILQ_ENTRY(cache_entry) lru;
+	struct cache_entry	*next;		/* in the hash chain */
+	uint32_t		 hash;
+	int			 refs;
+	int			 linked;
+	size_t			 size;
+	char			*key;
+	uint32_t		*ids;
+	size_t			 len;
+};
+
+TAILQ_HEAD(cache_lru, cache_entry);
+
+struct cache {
+	pthread_mutex_t		 mtx;
+	struct cache_entry	**tab;
+	size_t			 tabsize;
+	size_t			 nentries;
+	struct cache_lru	 lru;
+	size_t			 mem;
+	size_t			 maxmem;
+	size_t			 hits;
+	size_t			 misses;
+};
+
+int			 cache_init(struct cache *, size_t);
+struct cache_entry	*cache_get(struct cache *, const char *);
+struct cache_entry	*cache_put(struct cache *, const char *, uint32_t *,
+			    size_t);
+void			 cache_release(struct cache *, struct cache_entry *);
+void			 cache_free(struct cache *);
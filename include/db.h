@@ -14,44 +14,180 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#define DB_VERSION	 0
-#define DB_WORDLEN	32
+#define DB_VERSION	 10
+#define DB_BLOCKLEN	128
+#define DB_IDXBLOCK	16
+#define DB_TOPKEY	12
+#define DB_DEL_SUFFIX	".del"
+#define DB_DEL_HDRLEN	8
+#define DB_FIELDGAP	1024
+
+/* flags */
+#define DB_POSITIONS	0x1
+
+/*
+ * The file starts with a fixed header followed by a table with the
+ * start and end offset of every section:
+ *
+ *	version[4] nwords[4] ndocs[4] flags[4]
+ *	{ start[8] end[8] }[DB_NSECS]
+ *
+ * The words are sorted and front-coded in blocks of DB_IDXBLOCK.  Every
+ * word is stored as the length of the prefix shared with the previous
+ * one, the rest of the word and the distance of its posting list from
+ * the previous one, or from the start of the lists for the first word
+ * of a block:
+ *
+ *	prefix[vb] len[vb] suffix[len] offset[vb]
+ *
+ * The top level has an entry for every block, with the first
+ * DB_TOPKEY bytes of its first word padded with NULs and the offset
+ * of the block in the index: { key[DB_TOPKEY] offset[4] }[nblocks]
+ *
+ * Exact lookups go through a minimal perfect hash of the words instead:
+ *
+ *	seed[8] nbuckets[4] reserved[4] pilot[4][nbuckets]
+ *	{ fingerprint[4] word[4] }[nwords]
+ *
+ * where every slot has the number of its word in the index, to check
+ * the word there and find its posting list.  nbuckets is zero if the
+ * hash couldn't be built.
+ *
+ * The length in words of every document, for the ranking, is stored
+ * after the total: total[8] len[4][ndocs]
+ *
+ * If DB_POSITIONS is set the header of every posting list also has
+ * the offset of its positions in their section.  Those of a posting
+ * are tf variable-byte integers, each the distance from the previous
+ * one, and they follow the order of the postings.  For lists longer
+ * than one block the offset of every block from the first one comes
+ * first: { offset[4] }[nblocks]
+ * The positions of a field of a document, like the title, start
+ * DB_FIELDGAP after the last one of the previous field, so that no
+ * phrase, which has at most that many words, can match across them.
+ *
+ * The deleted documents are kept in a sidecar file, the path of the
+ * database followed by DB_DEL_SUFFIX, with a bit for every document:
+ *
+ *	ndocs[4] ndeleted[4] bits[(ndocs + 7) / 8]
+ */
+enum {
+	DB_SEC_IDX,		/* front-coded word index */
+	DB_SEC_LIST,		/* posting lists */
+	DB_SEC_DOCS,		/* documents */
+	DB_SEC_DOCTAB,		/* offset of every document */
+	DB_SEC_TOP,		/* top level of the index */
+	DB_SEC_MPH,		/* perfect hash of the words */
+	DB_SEC_DOCLEN,		/* length of every document */
+	DB_SEC_POS,		/* positions of the words */
+	DB_NSECS,
+};
 
 struct db {
 	uint8_t	*m;
 	off_t	 len;
 	uint32_t version;
 	uint32_t nwords;
+	uint32_t ndocs;
+	uint32_t flags;
 
 	uint8_t	*idx_start;
 	uint8_t	*idx_end;
+	uint8_t	*top_start;
+	uint8_t	*top_end;
+	uint64_t mph_seed;
+	uint32_t mph_nbuckets;
+	uint8_t	*mph_pilots;
+	uint8_t	*mph_slots;
 	uint8_t	*list_start;
 	uint8_t	*list_end;
 	uint8_t	*docs_start;
 	uint8_t	*docs_end;
+	uint8_t	*doctab_start;
+	uint8_t	*doctab_end;
+	uint8_t	*doclens;
+	uint64_t total;			/* length of the documents */
+	float	 avgdl;
+	uint8_t	*pos_start;
+	uint8_t	*pos_end;
+
+	uint8_t	*del_m;
+	off_t	 del_len;
+	uint8_t	*deleted;		/* bitmap, if any */
+	uint32_t ndeleted;
+	uint64_t deltotal;		/* length of the deleted ones */
 };
 
 struct db_stats {
 	size_t		 nwords;
 	size_t		 ndocs;
-	const char	*longest_word;
-	const char	*most_popular;
+	char		*longest_word;
+	char		*most_popular;
 	size_t		 most_popular_ndocs;
 };
 
+struct db_cursor {
+	struct db	*db;
+	const uint8_t	*skip;		/* skip table, if any */
+	const uint8_t	*data;		/* first block */
+	const uint8_t	*p;		/* next block */
+	const uint8_t	*pos;		/* positions, if any */
+	const uint8_t	*posp;		/* of the posting posi */
+	size_t		 posi;
+	uint32_t	 nblocks;
+	uint32_t	 blk;		/* index of the next block */
+	uint32_t	 sblk;		/* where db_cursor_blockmax() was */
+	uint32_t	 ndocs;		/* length of the list */
+	uint32_t	 left;		/* ids yet to decode */
+	uint32_t	 base;		/* last decoded id */
+	uint32_t	 docid;		/* current document */
+	float		 max;		/* highest db_bm25_tf() */
+	int		 withtf;	/* decode the tfs too */
+	size_t		 i;
+	size_t		 len;
+	uint32_t	 ids[DB_BLOCKLEN];
+	uint32_t	 tfs[DB_BLOCKLEN];
+};
+
 struct db_entry {
-	char	*name;
-	char	*descr;
+	char		*name;
+	char		*descr;
+	uint32_t	 len;		/* in words */
 };
 
 typedef int (*db_hit_cb)(struct db *, struct db_entry *, void *);
+typedef int (*db_word_cb)(struct db *, const char *, struct db_cursor *,
+    void *);
 
 struct dictionary;
 
-int		 db_create(FILE *, struct dictionary *, struct db_entry *, size_t);
+int		 db_create(int, struct dictionary *, struct db_entry *, size_t,
+		    int);
+int		 db_spill(FILE *, struct dictionary *);
+int		 db_create_merge(int, FILE *, const int64_t *, size_t,
+		    struct db_entry *, size_t, int);
+int		 db_dump(FILE *, struct db *, uint32_t);
 int		 db_open(struct db *, int);
-uint32_t	*db_word_docs(struct db *, const char *, size_t *);
+int		 db_open_deleted(struct db *, int);
+int		 db_write_deleted(int, const uint8_t *, uint32_t);
+int		 db_word_docs(struct db *, const char *, struct db_cursor *);
+int		 db_prefix_words(struct db *, const char *, db_word_cb, void *);
+int		 db_cursor_next(struct db_cursor *);
+int		 db_cursor_seek(struct db_cursor *, uint32_t);
+int		 db_cursor_readall(struct db_cursor *, uint32_t *);
+int		 db_cursor_bitmap(struct db_cursor *, uint32_t *);
+float		 db_cursor_blockmax(struct db_cursor *, uint32_t, uint32_t *);
+int		 db_cursor_positions(struct db_cursor *, uint32_t *);
+float		 db_bm25_tf(uint32_t, uint32_t, float);
+uint32_t	 db_doc_len(struct db *, uint32_t);
 int		 db_stats(struct db *, struct db_stats *);
 int		 db_listall(struct db *, db_hit_cb, void *);
 int		 db_doc_by_id(struct db *, int, struct db_entry *);
 void		 db_close(struct db *);
+
+static inline int
+db_is_deleted(struct db *db, uint32_t docid)
+{
+	return db->deleted != NULL &&
+	    (db->deleted[docid >> 3] & (1 << (docid & 7)));
+}
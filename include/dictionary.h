@@ -14,20 +14,70 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+struct dict_posting {
+	uint32_t	id;
+	uint32_t	tf;		/* occurrences in the document */
+};
+
+/* the postings are stored in a list of chunks of growing size */
+struct dict_chunk {
+	struct dict_chunk	*next;
+	uint32_t		 len;
+	uint32_t		 cap;
+	struct dict_posting	 ps[];
+};
+
+/* the positions, tf for every posting, in the same order */
+struct dict_poschunk {
+	struct dict_poschunk	*next;
+	uint32_t		 len;
+	uint32_t		 cap;
+	uint32_t		 pos[];
+};
+
 struct dict_entry {
-	char	*word;
-	int	*ids;
-	size_t	 len;
-	size_t	 cap;
+	char		  *word;
+	uint32_t	   hash;
+	size_t		   len;
+	struct dict_chunk *head;
+	struct dict_chunk *tail;
+	struct dict_poschunk *phead;
+	struct dict_poschunk *ptail;
 };
 
+/* words and postings are bump-allocated from a list of arenas */
+struct dict_arena {
+	struct dict_arena	*next;
+	size_t			 len;
+	size_t			 cap;
+	uint8_t			 data[];
+};
+
+/*
+ * The entries are kept in insertion order and indexed by an open
+ * addressing hash table until dictionary_sort() is called.
+ */
 struct dictionary {
 	size_t	len;
 	size_t	cap;
 	struct dict_entry *entries;
+
+	size_t	 tabsize;
+	uint32_t *table;		/* index+1 of the entry or 0 */
+
+	struct dict_arena *arena;
+	size_t	 mem;			/* bytes allocated */
+	uint64_t ntokens;		/* words added so far */
+
+	int	 positions;		/* record the positions too */
+	uint32_t curdoc;
+	uint32_t curpos;		/* of the next word in curdoc */
 };
 
 int	dictionary_init(struct dictionary *);
 int	dictionary_add(struct dictionary *, const char *, int);
-int	dictionary_add_words(struct dictionary *, char **, int);
+int	dictionary_add_words(struct dictionary *, const char *, size_t, int);
+void	dictionary_field(struct dictionary *, int);
+int	dictionary_append(struct dictionary *, struct dictionary *);
+void	dictionary_sort(struct dictionary *);
 void	dictionary_free(struct dictionary *);
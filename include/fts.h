@@ -14,4 +14,44 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-int	fts(struct db *, const char *, db_hit_cb, void *);
+typedef int (*fts_rank_cb)(struct db *, struct db_entry *, double, void *);
+
+struct fts_ctx;
+
+struct fts_stats {
+	size_t	 hits;		/* queries answered from the cache */
+	size_t	 misses;
+	size_t	 term_hits;	/* words and prefixes already decoded */
+	size_t	 term_misses;
+	size_t	 mem;		/* bytes used by the caches */
+};
+
+int		 fts_check(const char *, const char **);
+int		 fts(struct db *, const char *, db_hit_cb, void *);
+int		 fts_topk(struct db *, const char *, size_t, fts_rank_cb,
+		    void *);
+
+struct fts_ctx	*fts_ctx_new(struct db *, size_t);
+int		 fts_ctx_query(struct fts_ctx *, const char *, db_hit_cb,
+		    void *);
+void		 fts_ctx_stats(struct fts_ctx *, struct fts_stats *);
+void		 fts_ctx_free(struct fts_ctx *);
+
+struct segments;
+
+int		 fts_segments(struct segments *, struct fts_ctx **,
+		    const char *, db_hit_cb, void *);
+int		 fts_segments_topk(struct segments *, const char *, size_t,
+		    fts_rank_cb, void *);
+
+/* a database searched together with others by fts_shards() */
+struct fts_shard {
+	struct segments	 *segs;
+	struct fts_ctx	**ctxs;		/* one per segment, or NULL */
+};
+
+typedef int (*fts_shard_cb)(size_t, struct db *, struct db_entry *, double,
+    void *);
+
+int		 fts_shards(struct fts_shard *, size_t, const char *, size_t,
+		    fts_shard_cb, void *);
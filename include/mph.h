@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Minimal perfect hash over the words of the index, built with the
+ * hash and displace scheme: the keys are split in buckets and every
+ * bucket gets a pilot that moves all of its keys to free slots.
+ */
+
+#define MPH_LAMBDA	4		/* average keys per bucket */
+
+uint64_t	mph_hash(const char *);
+uint64_t	mph_seed(uint64_t, uint64_t);
+uint32_t	mph_bucket(uint64_t, uint32_t);
+uint32_t	mph_slot(uint64_t, uint32_t, uint32_t);
+uint32_t	mph_fingerprint(uint64_t);
+int		mph_build(const uint64_t *, uint32_t, uint32_t *, uint32_t,
+		    uint32_t *);
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Posting lists are split in blocks of DB_BLOCKLEN ids.  Every id is
+ * stored as the difference minus one from the previous one (the first
+ * of the list from -1.)
+ *
+ * Full blocks are bit-packed: bits[1] followed by 16*bits bytes.  The
+ * ids are spread over four 32-bit lanes (id i goes to lane i%4) so that
+ * the unpacking can be done four at a time.  The last block, if not
+ * full, is a sequence of variable-byte integers.
+ *
+ * Full blocks dense enough to be smaller as a bitmap are stored as
+ * POSTINGS_BITMAP + n followed by n 32-bit words, where bit i is set
+ * if the id that follows the previous block by i + 1 is in the list.
+ *
+ * The ids of every block are followed by their term frequencies,
+ * encoded the same way but without the deltas.
+ *
+ * A list is ndocs[4] max[4] followed by the blocks, where max is the
+ * highest db_bm25_tf() of the list as a float.  Lists longer than one
+ * block have a skip table between the two, with the last id of every
+ * block, its offset from the first one and its own maximum.  The range
+ * of ids from the one after the last of the previous block to the last
+ * of the block is split in 16 parts of (last - first) / 16 + 1 ids and
+ * the maximum of each follows, in 255ths of that of the block rounded
+ * up:
+ *
+ *	{ last[4] offset[4] max[4] sub[16] }[n]
+ */
+
+#define POSTINGS_MAXLEN	(DB_BLOCKLEN * 5)
+#define POSTINGS_BITMAP	64
+#define POSTINGS_MAXWORDS (DB_BLOCKLEN)
+
+size_t		 postings_encode(uint8_t *, uint32_t *, size_t, uint32_t);
+const uint8_t	*postings_decode(const uint8_t *, const uint8_t *,
+		    uint32_t *, size_t, uint32_t);
+const uint8_t	*postings_decode_bitmap(const uint8_t *, const uint8_t *,
+		    uint32_t *, size_t, size_t, uint32_t *);
+size_t		 postings_encode_tf(uint8_t *, uint32_t *, size_t);
+const uint8_t	*postings_decode_tf(const uint8_t *, const uint8_t *,
+		    uint32_t *, size_t);
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The ftsearchd(8) protocol.  Every message is a frame: the length of
+ * the payload, four bytes in network byte order, then the payload.
+ * The client sends a query per frame; the server replies with a frame
+ * for every matching document, holding the name and the description
+ * separated by a NUL, then an empty frame.  If the query fails the
+ * reply ends with a PROTO_ERR length instead.
+ */
+
+#define FTSEARCHD_SOCK	"/var/run/ftsearchd.sock"
+#define PROTO_MAXLEN	(1024 * 1024)
+#define PROTO_ERR	0xffffffffU
+
+struct proto {
+	int	 fd;
+
+	uint8_t	*in;
+	size_t	 inlen;
+	size_t	 inpos;
+	size_t	 incap;
+
+	uint8_t	*out;
+	size_t	 outlen;
+	size_t	 outcap;
+
+	char	*frame;
+	size_t	 framecap;
+};
+
+void	proto_init(struct proto *, int);
+int	proto_read(struct proto *, char **, uint32_t *);
+int	proto_pending(struct proto *);
+int	proto_poll(struct proto *);
+int	proto_begin(struct proto *, uint32_t);
+int	proto_add(struct proto *, const void *, size_t);
+int	proto_flush(struct proto *);
+void	proto_free(struct proto *);
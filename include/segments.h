@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A database can grow by segments.  Every segment is a database file
+ * of its own and its document ids follow the ones of the segments
+ * before it.  When there is more than one the names of the files, in
+ * the same directory of the database, are listed one per line in the
+ * manifest, the path of the database followed by SEGS_SUFFIX, which
+ * is always replaced as a whole.  The segments never change once
+ * written: new documents go in a new one and the small ones are
+ * merged into bigger ones, so that there are only O(log n) of them.
+ * The documents deleted from a segment are marked in its sidecar,
+ * see db.h, until it's rewritten.
+ */
+
+#define SEGS_SUFFIX	".segments"
+#define SEGS_LOCK	".segments.lock"
+#define SEGS_MERGE_LOCK	".segments.merge"
+
+struct segments {
+	struct db	*dbs;
+	char		**names;
+	uint32_t	*bases;		/* id of the first document */
+	size_t		 len;
+	uint32_t	 ndocs;
+};
+
+int	segments_open(struct segments *, const char *);
+int	segments_listall(struct segments *, db_hit_cb, void *);
+int	segments_doc_by_id(struct segments *, uint32_t, struct db_entry *);
+void	segments_close(struct segments *);
+
+int	segments_tmpfile(const char *, char *, size_t);
+int	segments_add(const char *, const char *);
+int	segments_merge(const char *, int);
+int	segments_replace(const char *, const char *);
+int	segments_delete(const char *, char **, size_t, size_t *);
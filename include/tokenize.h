@@ -14,5 +14,6 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-char	**tokenize(const char *);
-void	  freetoks(char **);
+typedef int (*tokenize_cb)(const char *, size_t, void *);
+
+int	tokenize(const char *, size_t, tokenize_cb, void *);
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+static inline uint32_t
+hash(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *s != '\0'; ++s) {
+		h ^= (unsigned char)*s;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+int
+cache_init(struct cache *c, size_t maxmem)
+{
+	memset(c, 0, sizeof(*c));
+	c->maxmem = maxmem;
+	TAILQ_INIT(&c->lru);
+	if (pthread_mutex_init(&c->mtx, NULL) != 0)
+		return -1;
+	return 0;
+}
+
+static void
+entry_free(struct cache_entry *e)
+{
+	free(e->key);
+	free(e->ids);
+	free(e);
+}
+
+static void
+unlink_entry(struct cache *c, struct cache_entry *e)
+{
+	struct cache_entry **p;
+
+	for (p = &c->tab[e->hash & (c->tabsize - 1)]; *p != e;
+	    p = &(*p)->next)
+		;
+	*p = e->next;
+	TAILQ_REMOVE(&c->lru, e, lru);
+	c->nentries--;
+	c->mem -= e->size;
+	e->linked = 0;
+
+	if (e->refs == 0)
+		entry_free(e);
+}
+
+static int
+grow(struct cache *c)
+{
+	struct cache_entry **tab, *e, *t;
+	size_t i, newsize;
+
+	newsize = c->tabsize == 0 ? 64 : c->tabsize * 2;
+	if ((tab = calloc(newsize, sizeof(*tab))) == NULL)
+		return -1;
+
+	for (i = 0; i < c->tabsize; ++i) {
+		for (e = c->tab[i]; e != NULL; e = t) {
+			t = e->next;
+			e->next = tab[e->hash & (newsize - 1)];
+			tab[e->hash & (newsize - 1)] = e;
+		}
+	}
+
+	free(c->tab);
+	c->tab = tab;
+	c->tabsize = newsize;
+	return 0;
+}
+
+static struct cache_entry *
+lookup(struct cache *c, const char *key, uint32_t h)
+{
+	struct cache_entry *e;
+
+	if (c->tabsize == 0)
+		return NULL;
+
+	for (e = c->tab[h & (c->tabsize - 1)]; e != NULL; e = e->next)
+		if (e->hash == h && !strcmp(e->key, key))
+			return e;
+	return NULL;
+}
+
+/*
+ * Return the entry for key, which has to be released afterwards, or
+ * NULL if it's not in the cache.
+ */
+struct cache_entry *
+cache_get(struct cache *c, const char *key)
+{
+	struct cache_entry *e;
+
+	pthread_mutex_lock(&c->mtx);
+	if ((e = lookup(c, key, hash(key))) != NULL) {
+		TAILQ_REMOVE(&c->lru, e, lru);
+		TAILQ_INSERT_HEAD(&c->lru, e, lru);
+		e->refs++;
+		c->hits++;
+	} else
+		c->misses++;
+	pthread_mutex_unlock(&c->mtx);
+
+	return e;
+}
+
+/*
+ * Add the len ids for key, evicting the least recently used entries
+ * to make room.  The cache takes the ownership of ids, which are
+ * freed on error.  Returns the entry, to be released afterwards: if
+ * another thread added key in the meantime that one is returned, and
+ * if the ids don't fit the entry is not added but still usable.
+ */
+struct cache_entry *
+cache_put(struct cache *c, const char *key, uint32_t *ids, size_t len)
+{
+	struct cache_entry *e, *t;
+	uint32_t h;
+
+	if ((e = calloc(1, sizeof(*e))) == NULL ||
+	    (e->key = strdup(key)) == NULL) {
+		free(e);
+		free(ids);
+		return NULL;
+	}
+	e->hash = h = hash(key);
+	e->refs = 1;
+	e->ids = ids;
+	e->len = len;
+	e->size = sizeof(*e) + strlen(key) + 1 + len * sizeof(*ids);
+
+	pthread_mutex_lock(&c->mtx);
+
+	if ((t = lookup(c, key, h)) != NULL) {
+		t->refs++;
+		pthread_mutex_unlock(&c->mtx);
+		entry_free(e);
+		return t;
+	}
+
+	if (e->size > c->maxmem ||
+	    ((c->nentries + 1) > c->tabsize && grow(c) == -1)) {
+		pthread_mutex_unlock(&c->mtx);
+		return e;
+	}
+
+	while (c->mem + e->size > c->maxmem)
+		unlink_entry(c, TAILQ_LAST(&c->lru, cache_lru));
+
+	e->next = c->tab[h & (c->tabsize - 1)];
+	c->tab[h & (c->tabsize - 1)] = e;
+	TAILQ_INSERT_HEAD(&c->lru, e, lru);
+	e->linked = 1;
+	c->nentries++;
+	c->mem += e->size;
+
+	pthread_mutex_unlock(&c->mtx);
+	return e;
+}
+
+void
+cache_release(struct cache *c, struct cache_entry *e)
+{
+	int dead;
+
+	pthread_mutex_lock(&c->mtx);
+	dead = --e->refs == 0 && !e->linked;
+	pthread_mutex_unlock(&c->mtx);
+
+	if (dead)
+		entry_free(e);
+}
+
+/* all the entries must have been released */
+void
+cache_free(struct cache *c)
+{
+	struct cache_entry *e;
+
+	while ((e = TAILQ_FIRST(&c->lru)) != NULL) {
+		TAILQ_REMOVE(&c->lru, e, lru);
+		entry_free(e);
+	}
+	free(c->tab);
+	pthread_mutex_destroy(&c->mtx);
+}
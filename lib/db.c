@@ -16,6 +16,7 @@
 
 #include <sys/mman.h>
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -24,267 +25,2533 @@
 
 #include "db.h"
 #include "dictionary.h"
+#include "mph.h"
+#include "postings.h"
+
+#define TOP_ENTRY_SIZE (DB_TOPKEY + sizeof(uint32_t))
+#define MPH_HDRLEN (sizeof(uint64_t) + 2 * sizeof(uint32_t))
+#define MPH_SLOT_SIZE (2 * sizeof(uint32_t))
+#define MPH_SEEDS 8
+#define DB_NSUB 16
+#define DB_SKIP_SIZE (3 * sizeof(uint32_t) + DB_NSUB)
+#define DB_LIST_HDRLEN (2 * sizeof(uint32_t))
+#define DB_LIST_POSLEN sizeof(uint64_t)
+#define DB_HDRLEN (4 * sizeof(uint32_t) + DB_NSECS * 2 * sizeof(int64_t))
+
+#define WBUF_SIZE	(1024 * 1024)
+
+#define BM25_K1	1.2f
+#define BM25_B	0.75f
+
+/* buffered writer: the data is stored with pwrite() starting at off */
+struct wbuf {
+	int		 fd;
+	off_t		 off;
+	size_t		 len;
+	uint8_t		*buf;
+};
 
-#define IDX_ENTRY_SIZE (DB_WORDLEN + sizeof(int64_t))
+static int
+wbuf_init(struct wbuf *w, int fd, off_t off)
+{
+	w->fd = fd;
+	w->off = off;
+	w->len = 0;
+	if ((w->buf = malloc(WBUF_SIZE)) == NULL)
+		return -1;
+	return 0;
+}
+
+static int
+wbuf_flush(struct wbuf *w)
+{
+	uint8_t *p = w->buf;
+	ssize_t r;
+
+	while (w->len > 0) {
+		if ((r = pwrite(w->fd, p, w->len, w->off)) == -1)
+			return -1;
+		p += r;
+		w->off += r;
+		w->len -= r;
+	}
+	return 0;
+}
+
+static int
+wbuf_write(struct wbuf *w, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n;
+
+	while (len > 0) {
+		if (w->len == WBUF_SIZE && wbuf_flush(w) == -1)
+			return -1;
+
+		n = WBUF_SIZE - w->len;
+		if (n > len)
+			n = len;
+		memcpy(w->buf + w->len, p, n);
+		w->len += n;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* flush the data and release the buffer */
+static int
+wbuf_close(struct wbuf *w)
+{
+	int r;
+
+	r = wbuf_flush(w);
+	free(w->buf);
+	w->buf = NULL;
+	return r;
+}
+
+static inline size_t
+vb64_encode(uint8_t *out, uint64_t x)
+{
+	size_t n = 0;
+
+	while (x >= 0x80) {
+		out[n++] = (x & 0x7f) | 0x80;
+		x >>= 7;
+	}
+	out[n++] = x;
+	return n;
+}
+
+static inline const uint8_t *
+vb64_decode(const uint8_t *p, const uint8_t *end, uint64_t *x)
+{
+	int sh;
+
+	*x = 0;
+	for (sh = 0; sh < 64 && p < end; sh += 7) {
+		*x |= (uint64_t)(*p & 0x7f) << sh;
+		if ((*p++ & 0x80) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+#define RUN_BUFSIZE	(64 * 1024)
+
+/* buffered reader of a part of the spill file */
+struct run {
+	int		 fd;
+	size_t		 idx;
+	off_t		 off;		/* next byte to read */
+	off_t		 end;
+	uint8_t		*buf;
+	size_t		 pos;
+	size_t		 len;
+	char		*word;
+	size_t		 wordcap;
+	uint32_t	 ndocs;
+};
+
+/* read exactly len bytes from the run */
+static int
+run_read(struct run *r, void *data, size_t len)
+{
+	uint8_t *p = data;
+	size_t n;
+	ssize_t l;
+
+	while (len > 0) {
+		if (r->pos == r->len) {
+			n = RUN_BUFSIZE;
+			if ((off_t)n > r->end - r->off)
+				n = r->end - r->off;
+			if (n == 0)
+				return -1;
+			if ((l = pread(r->fd, r->buf, n, r->off)) <= 0)
+				return -1;
+			r->off += l;
+			r->pos = 0;
+			r->len = l;
+		}
+
+		n = r->len - r->pos;
+		if (n > len)
+			n = len;
+		memcpy(p, r->buf + r->pos, n);
+		r->pos += n;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* offset of the next byte run_read() returns */
+static inline off_t
+run_tell(struct run *r)
+{
+	return r->off - (r->len - r->pos);
+}
+
+/* move to off, keeping what's already buffered if it's there */
+static void
+run_seek(struct run *r, off_t off)
+{
+	if (off > r->end)
+		off = r->end;
+	if (off >= r->off - (off_t)r->len && off <= r->off) {
+		r->pos = r->len - (r->off - off);
+		return;
+	}
+	r->off = off;
+	r->pos = r->len = 0;
+}
+
+/* the postings of a word in a run, and their positions */
+struct list_part {
+	off_t		 off;
+	off_t		 posoff;
+	uint32_t	 ndocs;
+	uint64_t	 ntf;
+};
+
+/*
+ * A posting list to write: the entry of a dictionary or, if e is NULL,
+ * the parts of the runs, read back a block at a time with rd and prd.
+ */
+struct list_src {
+	struct dict_entry	*e;
+	size_t			 len;
+	struct list_part	*parts;
+	size_t			 nparts;
+	struct run		*rd;
+	struct run		*prd;
+};
+
+struct list_iter {
+	struct list_src		*src;
+	struct dict_chunk	*c;
+	size_t			 part;
+	size_t			 i;
+	int			 err;
+};
+
+struct pos_iter {
+	struct list_src		*src;
+	struct dict_poschunk	*c;
+	size_t			 part;
+	uint64_t		 i;
+	int			 err;
+};
+
+static void
+src_entry(struct list_src *src, struct dict_entry *e)
+{
+	memset(src, 0, sizeof(*src));
+	src->e = e;
+	src->len = e->len;
+}
+
+static void
+list_iter_init(struct list_iter *it, struct list_src *src)
+{
+	memset(it, 0, sizeof(*it));
+	it->src = src;
+	if (src->e != NULL)
+		it->c = src->e->head;
+	else if (src->nparts > 0)
+		run_seek(src->rd, src->parts[0].off);
+}
+
+static void
+pos_iter_init(struct pos_iter *it, struct list_src *src)
+{
+	memset(it, 0, sizeof(*it));
+	it->src = src;
+	if (src->e != NULL)
+		it->c = src->e->phead;
+	else if (src->nparts > 0)
+		run_seek(src->prd, src->parts[0].posoff);
+}
+
+/* like list_block() for the lists in the runs */
+static size_t
+list_block_runs(struct list_iter *it, uint32_t *ids, uint32_t *tfs)
+{
+	struct list_src *src = it->src;
+	struct dict_posting ps[DB_BLOCKLEN];
+	size_t i, m, n = 0;
+
+	while (it->part < src->nparts && n < DB_BLOCKLEN) {
+		if (it->i == src->parts[it->part].ndocs) {
+			if (++it->part < src->nparts)
+				run_seek(src->rd, src->parts[it->part].off);
+			it->i = 0;
+			continue;
+		}
+
+		m = src->parts[it->part].ndocs - it->i;
+		if (m > DB_BLOCKLEN - n)
+			m = DB_BLOCKLEN - n;
+		if (run_read(src->rd, ps, m * sizeof(*ps)) == -1) {
+			it->err = 1;
+			return 0;
+		}
+		for (i = 0; i < m; ++i) {
+			ids[n] = ps[i].id;
+			tfs[n++] = ps[i].tf;
+		}
+		it->i += m;
+	}
+
+	return n;
+}
+
+/*
+ * Copy the next block of the list in ids and tfs.  Returns the number
+ * of postings, zero at the end or if it->err is set.
+ */
+static size_t
+list_block(struct list_iter *it, uint32_t *ids, uint32_t *tfs)
+{
+	size_t n = 0;
+
+	if (it->src->e == NULL)
+		return list_block_runs(it, ids, tfs);
+
+	while (it->c != NULL && n < DB_BLOCKLEN) {
+		if (it->i == it->c->len) {
+			it->c = it->c->next;
+			it->i = 0;
+			continue;
+		}
+		ids[n] = it->c->ps[it->i].id;
+		tfs[n++] = it->c->ps[it->i++].tf;
+	}
+
+	return n;
+}
+
+/* encode the block in buf; ids and tfs are overwritten */
+static size_t
+list_encode(uint8_t *buf, uint32_t *ids, uint32_t *tfs, size_t n,
+    uint32_t base)
+{
+	size_t l;
+
+	l = postings_encode(buf, ids, n, base);
+	return l + postings_encode_tf(buf + l, tfs, n);
+}
+
+static float
+avgdl(uint64_t total, size_t n)
+{
+	if (n == 0 || total == 0)
+		return 1;
+	return (double)total / n;
+}
+
+static float
+entries_avgdl(struct db_entry *entries, size_t n)
+{
+	uint64_t total = 0;
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		total += entries[i].len;
+	return avgdl(total, n);
+}
+
+/*
+ * The part of the BM25 score of a term that depends on the document,
+ * to be multiplied by the idf of the term.
+ */
+float
+db_bm25_tf(uint32_t tf, uint32_t dl, float avgdl)
+{
+	float t = tf;
+
+	return t * (BM25_K1 + 1) /
+	    (t + BM25_K1 * (1 - BM25_B + BM25_B * dl / avgdl));
+}
+
+/* size of the list once encoded */
+static size_t
+list_size(struct dict_entry *e, int positions)
+{
+	struct list_src src;
+	struct list_iter it;
+	uint32_t ids[DB_BLOCKLEN], tfs[DB_BLOCKLEN], base, last;
+	uint8_t buf[2 * POSTINGS_MAXLEN];
+	size_t n, size, nblocks;
+
+	size = DB_LIST_HDRLEN;
+	if (positions)
+		size += DB_LIST_POSLEN;
+	nblocks = (e->len + DB_BLOCKLEN - 1) / DB_BLOCKLEN;
+	if (nblocks > 1)
+		size += nblocks * DB_SKIP_SIZE;
+
+	src_entry(&src, e);
+	list_iter_init(&it, &src);
+	base = UINT32_MAX;
+	while ((n = list_block(&it, ids, tfs)) > 0) {
+		last = ids[n - 1];
+		size += list_encode(buf, ids, tfs, n, base);
+		base = last;
+	}
+
+	return size;
+}
+
+/* the next position; on error it->err is set */
+static inline uint32_t
+pos_next(struct pos_iter *it)
+{
+	struct list_src *src = it->src;
+	uint32_t p;
+
+	if (src->e == NULL) {
+		while (it->part < src->nparts &&
+		    it->i == src->parts[it->part].ntf) {
+			if (++it->part < src->nparts)
+				run_seek(src->prd, src->parts[it->part].posoff);
+			it->i = 0;
+		}
+		if (it->part == src->nparts ||
+		    run_read(src->prd, &p, sizeof(p)) == -1) {
+			it->err = 1;
+			return 0;
+		}
+		it->i++;
+		return p;
+	}
+
+	while (it->i == it->c->len) {
+		it->c = it->c->next;
+		it->i = 0;
+	}
+	return it->c->pos[it->i++];
+}
+
+static inline size_t
+vb_len(uint32_t x)
+{
+	size_t n = 1;
+
+	while (x >= 0x80) {
+		n++;
+		x >>= 7;
+	}
+	return n;
+}
+
+/*
+ * Encode the positions of the n postings whose tfs are given.  They
+ * are appended to w unless it's NULL.  Returns the number of bytes or
+ * -1 on error.
+ */
+static int64_t
+pos_block(struct wbuf *w, struct pos_iter *it, const uint32_t *tfs,
+    size_t n)
+{
+	uint8_t buf[5];
+	uint32_t j, p, prev;
+	int64_t size = 0;
+	size_t i, l;
+
+	for (i = 0; i < n; ++i) {
+		for (prev = 0, j = 0; j < tfs[i]; ++j) {
+			p = pos_next(it);
+			if (it->err)
+				return -1;
+			if (w == NULL)
+				l = vb_len(p - prev);
+			else {
+				l = vb64_encode(buf, p - prev);
+				if (wbuf_write(w, buf, l) == -1)
+					return -1;
+			}
+			size += l;
+			prev = p;
+		}
+	}
+
+	return size;
+}
+
+/* size of the positions of the list once encoded */
+static size_t
+pos_size(struct dict_entry *e)
+{
+	struct list_src src;
+	struct list_iter it;
+	struct pos_iter pt;
+	uint32_t ids[DB_BLOCKLEN], tfs[DB_BLOCKLEN];
+	size_t n, size = 0, nblocks;
+
+	nblocks = (e->len + DB_BLOCKLEN - 1) / DB_BLOCKLEN;
+	if (nblocks > 1)
+		size += nblocks * sizeof(uint32_t);
+
+	src_entry(&src, e);
+	list_iter_init(&it, &src);
+	pos_iter_init(&pt, &src);
+	while ((n = list_block(&it, ids, tfs)) > 0)
+		size += pos_block(NULL, &pt, tfs, n);
+	return size;
+}
+
+static int
+write_pos(struct wbuf *w, struct list_src *src)
+{
+	struct list_iter it;
+	struct pos_iter pt;
+	uint32_t ids[DB_BLOCKLEN], tfs[DB_BLOCKLEN], x;
+	int64_t l, off = 0;
+	size_t n, nblocks;
+
+	/* the offset of every block first, if there's more than one */
+	nblocks = (src->len + DB_BLOCKLEN - 1) / DB_BLOCKLEN;
+	if (nblocks > 1) {
+		list_iter_init(&it, src);
+		pos_iter_init(&pt, src);
+		while ((n = list_block(&it, ids, tfs)) > 0) {
+			if (off > UINT32_MAX)
+				return -1;
+			x = off;
+			if (wbuf_write(w, &x, sizeof(x)) == -1)
+				return -1;
+			if ((l = pos_block(NULL, &pt, tfs, n)) == -1)
+				return -1;
+			off += l;
+		}
+		if (it.err)
+			return -1;
+	}
+
+	list_iter_init(&it, src);
+	pos_iter_init(&pt, src);
+	while ((n = list_block(&it, ids, tfs)) > 0) {
+		if ((l = pos_block(w, &pt, tfs, n)) == -1)
+			return -1;
+	}
+
+	return it.err ? -1 : 0;
+}
+
+/* the bound of a part of a block out of the maximum of the block */
+static inline float
+sub_max(float max, uint8_t q)
+{
+	return q == UINT8_MAX ? max : max * q / UINT8_MAX;
+}
+
+/* the span of the ids of each of the DB_NSUB parts of a block */
+static inline uint64_t
+sub_span(uint32_t first, uint32_t last)
+{
+	return (last - first) / DB_NSUB + 1;
+}
+
+/*
+ * The highest db_bm25_tf() of the block.  If sub is not NULL the ids
+ * from first to the last of the block are split in DB_NSUB parts and
+ * it's set to the maximum of each, in 255ths of that of the block
+ * rounded up.
+ */
+static float
+block_max(const uint32_t *ids, const uint32_t *tfs, size_t n,
+    struct db_entry *entries, float avg, uint32_t first, uint8_t *sub)
+{
+	float ms[DB_NSUB] = { 0 }, m, max = 0;
+	uint64_t span;
+	size_t i, j;
+	uint8_t q;
+
+	if (sub != NULL)
+		span = sub_span(first, ids[n - 1]);
+
+	for (i = 0; i < n; ++i) {
+		m = db_bm25_tf(tfs[i], entries[ids[i]].len, avg);
+		if (m > max)
+			max = m;
+		if (sub != NULL) {
+			j = (ids[i] - first) / span;
+			if (m > ms[j])
+				ms[j] = m;
+		}
+	}
+
+	for (j = 0; sub != NULL && j < DB_NSUB; ++j) {
+		q = max > 0 ? ms[j] / max * UINT8_MAX : 0;
+		while (q < UINT8_MAX && sub_max(max, q) < ms[j])
+			q++;
+		sub[j] = q;
+	}
+	return max;
+}
+
+/*
+ * Write the list; the length of the documents are needed for the
+ * maximum score of every block.  posoff is the offset of the
+ * positions in their section or -1 if they're not stored.  The list
+ * is gone through once for its maximum, once more for the skip table,
+ * if it's longer than a block, and once for the blocks, so that
+ * nothing but a block at a time is held in memory.
+ */
+static int
+write_list(struct wbuf *w, struct list_src *src, struct db_entry *entries,
+    float avg, int64_t posoff)
+{
+	struct list_iter it;
+	uint32_t ids[DB_BLOCKLEN], tfs[DB_BLOCKLEN], base, last, x;
+	uint8_t buf[2 * POSTINGS_MAXLEN], skip[DB_SKIP_SIZE];
+	size_t n, l = 0, nblocks;
+	uint64_t off;
+	float max = 0, blkmax;
+
+	nblocks = (src->len + DB_BLOCKLEN - 1) / DB_BLOCKLEN;
+
+	list_iter_init(&it, src);
+	while ((n = list_block(&it, ids, tfs)) > 0) {
+		blkmax = block_max(ids, tfs, n, entries, avg, 0, NULL);
+		if (blkmax > max)
+			max = blkmax;
+
+		/* a single block is kept in buf */
+		if (nblocks == 1)
+			l = list_encode(buf, ids, tfs, n, UINT32_MAX);
+	}
+	if (it.err)
+		return -1;
+
+	x = src->len;
+	if (wbuf_write(w, &x, sizeof(x)) == -1 ||
+	    wbuf_write(w, &max, sizeof(max)) == -1)
+		return -1;
+	if (posoff != -1 && wbuf_write(w, &posoff, sizeof(posoff)) == -1)
+		return -1;
+
+	if (nblocks <= 1) {
+		if (nblocks == 1 && wbuf_write(w, buf, l) == -1)
+			return -1;
+		return 0;
+	}
+
+	/* the last id, the offset and the maxima of every block */
+	list_iter_init(&it, src);
+	base = UINT32_MAX;
+	for (off = 0; (n = list_block(&it, ids, tfs)) > 0; off += l) {
+		if (off > UINT32_MAX)
+			return -1;
+		blkmax = block_max(ids, tfs, n, entries, avg, base + 1,
+		    skip + 3 * sizeof(uint32_t));
+		last = ids[n - 1];
+		x = off;
+		l = list_encode(buf, ids, tfs, n, base);
+		base = last;
+
+		memcpy(skip, &last, sizeof(last));
+		memcpy(skip + sizeof(last), &x, sizeof(x));
+		memcpy(skip + 2 * sizeof(uint32_t), &blkmax, sizeof(blkmax));
+		if (wbuf_write(w, skip, DB_SKIP_SIZE) == -1)
+			return -1;
+	}
+	if (it.err)
+		return -1;
+
+	list_iter_init(&it, src);
+	base = UINT32_MAX;
+	while ((n = list_block(&it, ids, tfs)) > 0) {
+		last = ids[n - 1];
+		l = list_encode(buf, ids, tfs, n, base);
+		base = last;
+
+		if (wbuf_write(w, buf, l) == -1)
+			return -1;
+	}
+
+	return it.err ? -1 : 0;
+}
+
+/* front-codes the words in idx and fills the top level in top */
+struct idx_writer {
+	struct wbuf	*idx;
+	struct wbuf	*top;
+	int64_t		 start;		/* offset of the index */
+	int64_t		 lists;		/* offset of the posting lists */
+	size_t		 n;
+	char		*prev;
+	size_t		 prevcap;
+	int64_t		 prevoff;
+};
+
+static void
+idx_writer_init(struct idx_writer *iw, struct wbuf *idx, struct wbuf *top,
+    int64_t lists)
+{
+	memset(iw, 0, sizeof(*iw));
+	iw->idx = idx;
+	iw->top = top;
+	iw->start = idx->off + idx->len;
+	iw->lists = lists;
+}
+
+/* add the word whose posting list is at off */
+static int
+idx_add(struct idx_writer *iw, const char *word, int64_t off)
+{
+	uint8_t buf[30], key[DB_TOPKEY];
+	uint32_t boff;
+	size_t len, pre = 0, l;
+	int64_t pos;
+	void *t;
+
+	len = strlen(word);
+
+	if (iw->n % DB_IDXBLOCK == 0) {
+		pos = iw->idx->off + iw->idx->len - iw->start;
+		if (pos > UINT32_MAX)
+			return -1;
+		boff = pos;
+
+		memset(key, 0, sizeof(key));
+		memcpy(key, word, len < sizeof(key) ? len : sizeof(key));
+		if (wbuf_write(iw->top, key, sizeof(key)) == -1 ||
+		    wbuf_write(iw->top, &boff, sizeof(boff)) == -1)
+			return -1;
+
+		iw->prevoff = iw->lists;
+	} else {
+		while (word[pre] != '\0' && word[pre] == iw->prev[pre])
+			pre++;
+	}
+
+	l = vb64_encode(buf, pre);
+	l += vb64_encode(buf + l, len - pre);
+	if (wbuf_write(iw->idx, buf, l) == -1 ||
+	    wbuf_write(iw->idx, word + pre, len - pre) == -1)
+		return -1;
+
+	l = vb64_encode(buf, off - iw->prevoff);
+	if (wbuf_write(iw->idx, buf, l) == -1)
+		return -1;
+
+	if (len >= iw->prevcap) {
+		if ((t = realloc(iw->prev, len + 1)) == NULL)
+			return -1;
+		iw->prev = t;
+		iw->prevcap = len + 1;
+	}
+	memcpy(iw->prev, word, len + 1);
+	iw->prevoff = off;
+	iw->n++;
+	return 0;
+}
+
+static inline size_t
+doc_size(struct db_entry *e)
+{
+	uint16_t namelen, descrlen = 0;
+
+	namelen = strlen(e->name);
+	if (e->descr != NULL)
+		descrlen = strlen(e->descr);
+	return sizeof(namelen) + namelen + 1 + sizeof(descrlen) + descrlen + 1;
+}
+
+/*
+ * Write the documents, their offsets table and their lengths at the
+ * given sections.
+ */
+static int
+write_docs(int fd, struct db_entry *entries, size_t n, int64_t secs[][2])
+{
+	struct wbuf w;
+	int64_t off;
+	uint64_t total;
+	size_t i;
+
+	if (wbuf_init(&w, fd, secs[DB_SEC_DOCS][0]) == -1)
+		return -1;
+
+	for (i = 0; i < n; ++i) {
+		uint16_t namelen, descrlen = 0;
+
+		namelen = strlen(entries[i].name);
+		if (entries[i].descr != NULL)
+			descrlen = strlen(entries[i].descr);
+
+		if (wbuf_write(&w, &namelen, sizeof(namelen)) == -1 ||
+		    wbuf_write(&w, entries[i].name, namelen + 1) == -1 ||
+		    wbuf_write(&w, &descrlen, sizeof(descrlen)) == -1 ||
+		    wbuf_write(&w, entries[i].descr, descrlen) == -1 ||
+		    wbuf_write(&w, "", 1) == -1)
+			goto err;
+	}
+
+	/*
+	 * The offsets table: the size of every document is known, so
+	 * there's no need to remember where they were written.
+	 */
+	off = secs[DB_SEC_DOCS][0];
+	for (i = 0; i < n; ++i) {
+		if (wbuf_write(&w, &off, sizeof(off)) == -1)
+			goto err;
+		off += doc_size(&entries[i]);
+	}
+
+	total = 0;
+	for (i = 0; i < n; ++i)
+		total += entries[i].len;
+	if (wbuf_write(&w, &total, sizeof(total)) == -1)
+		goto err;
+	for (i = 0; i < n; ++i)
+		if (wbuf_write(&w, &entries[i].len, sizeof(uint32_t)) == -1)
+			goto err;
+
+	return wbuf_close(&w);
+
+err:
+	wbuf_close(&w);
+	return -1;
+}
+
+/* compute the position of the documents sections starting at off */
+static void
+docs_sections(struct db_entry *entries, size_t n, int64_t off,
+    int64_t secs[][2])
+{
+	size_t i;
+
+	secs[DB_SEC_DOCS][0] = off;
+	for (i = 0; i < n; ++i)
+		off += doc_size(&entries[i]);
+	secs[DB_SEC_DOCS][1] = off;
+
+	secs[DB_SEC_DOCTAB][0] = off;
+	secs[DB_SEC_DOCTAB][1] = off + n * sizeof(int64_t);
+
+	secs[DB_SEC_DOCLEN][0] = secs[DB_SEC_DOCTAB][1];
+	secs[DB_SEC_DOCLEN][1] = secs[DB_SEC_DOCLEN][0] + sizeof(uint64_t) +
+	    n * sizeof(uint32_t);
+}
+
+/*
+ * Place the hash and the top level after the documents; the index
+ * follows.
+ */
+static void
+idx_sections(size_t nwords, int64_t secs[][2])
+{
+	size_t nblocks;
+
+	secs[DB_SEC_MPH][0] = secs[DB_SEC_DOCLEN][1];
+	secs[DB_SEC_MPH][1] = secs[DB_SEC_MPH][0] + MPH_HDRLEN +
+	    (nwords / MPH_LAMBDA + 1) * sizeof(uint32_t) +
+	    nwords * MPH_SLOT_SIZE;
+
+	nblocks = (nwords + DB_IDXBLOCK - 1) / DB_IDXBLOCK;
+	secs[DB_SEC_TOP][0] = secs[DB_SEC_MPH][1];
+	secs[DB_SEC_TOP][1] = secs[DB_SEC_TOP][0] + nblocks * TOP_ENTRY_SIZE;
+	secs[DB_SEC_IDX][0] = secs[DB_SEC_TOP][1];
+}
+
+/*
+ * Build the perfect hash of the n words given their FNV hash and the
+ * offset of their posting list, trying a few seeds.  If it fails the
+ * section is left empty and the lookups will use the index.
+ */
+static int
+write_mph(int fd, int64_t secs[][2], const uint64_t *h0, size_t n)
+{
+	struct wbuf w;
+	uint64_t seed, *hs;
+	uint32_t nb, *pilots, *slots, fp, reserved = 0;
+	size_t i;
+	int ret = -1;
+
+	nb = n / MPH_LAMBDA + 1;
+	hs = calloc(n + 1, sizeof(*hs));
+	pilots = calloc(nb, sizeof(*pilots));
+	slots = calloc(n + 1, sizeof(*slots));
+	if (hs == NULL || pilots == NULL || slots == NULL)
+		goto done;
+
+	for (seed = 0; seed < MPH_SEEDS; ++seed) {
+		for (i = 0; i < n; ++i)
+			hs[i] = mph_seed(h0[i], seed);
+		if (n > 0 && mph_build(hs, n, pilots, nb, slots) == 0)
+			break;
+	}
+	if (seed == MPH_SEEDS)
+		nb = 0;
+
+	if (wbuf_init(&w, fd, secs[DB_SEC_MPH][0]) == -1)
+		goto done;
+
+	if (wbuf_write(&w, &seed, sizeof(seed)) == -1 ||
+	    wbuf_write(&w, &nb, sizeof(nb)) == -1 ||
+	    wbuf_write(&w, &reserved, sizeof(reserved)) == -1 ||
+	    wbuf_write(&w, pilots, nb * sizeof(*pilots)) == -1)
+		goto err;
+
+	for (i = 0; nb != 0 && i < n; ++i) {
+		fp = mph_fingerprint(hs[slots[i]]);
+		if (wbuf_write(&w, &fp, sizeof(fp)) == -1 ||
+		    wbuf_write(&w, &slots[i], sizeof(slots[i])) == -1)
+			goto err;
+	}
+
+	/* fill the rest of the section if the hash wasn't built */
+	fp = 0;
+	while (w.off + (int64_t)w.len < secs[DB_SEC_MPH][1])
+		if (wbuf_write(&w, &fp, 1) == -1)
+			goto err;
+
+	ret = wbuf_close(&w);
+	goto done;
+
+err:
+	wbuf_close(&w);
+done:
+	free(hs);
+	free(pilots);
+	free(slots);
+	return ret;
+}
+
+static int
+write_header(int fd, uint32_t nwords, uint32_t ndocs, uint32_t flags,
+    int64_t secs[][2])
+{
+	uint8_t hdr[DB_HDRLEN], *p = hdr;
+	uint32_t version = DB_VERSION;
+
+	memcpy(p, &version, sizeof(version));
+	p += sizeof(version);
+	memcpy(p, &nwords, sizeof(nwords));
+	p += sizeof(nwords);
+	memcpy(p, &ndocs, sizeof(ndocs));
+	p += sizeof(ndocs);
+	memcpy(p, &flags, sizeof(flags));
+	p += sizeof(flags);
+	memcpy(p, secs, DB_NSECS * 2 * sizeof(int64_t));
+
+	if (pwrite(fd, hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return -1;
+	return 0;
+}
+
+struct writer {
+	pthread_t		 tid;
+	int			 fd;
+	struct dictionary	*dict;
+	struct db_entry		*entries;
+	size_t			 n;
+	size_t			 start;
+	size_t			 end;
+	int64_t			*offs;
+	int64_t			*poffs;		/* of the positions */
+	int64_t			(*secs)[2];
+	float			 avgdl;
+	int			 running;
+	int			 ret;
+};
+
+static void *
+sizes_run(void *data)
+{
+	struct writer *w = data;
+	size_t i;
+
+	for (i = w->start; i < w->end; ++i) {
+		w->offs[i + 1] = list_size(&w->dict->entries[i],
+		    w->poffs != NULL);
+		if (w->poffs != NULL)
+			w->poffs[i + 1] = pos_size(&w->dict->entries[i]);
+	}
+	return NULL;
+}
+
+static void *
+lists_run(void *data)
+{
+	struct writer *w = data;
+	struct list_src src;
+	struct wbuf b, pb;
+	int64_t posoff = -1;
+	size_t i;
+
+	pb.buf = NULL;
+	if (wbuf_init(&b, w->fd, w->offs[w->start]) == -1 ||
+	    (w->poffs != NULL &&
+	    wbuf_init(&pb, w->fd, w->poffs[w->start]) == -1)) {
+		free(b.buf);
+		w->ret = -1;
+		return NULL;
+	}
+
+	for (i = w->start; i < w->end; ++i) {
+		if (w->poffs != NULL)
+			posoff = w->poffs[i] - w->secs[DB_SEC_POS][0];
+		src_entry(&src, &w->dict->entries[i]);
+		if (write_list(&b, &src, w->entries, w->avgdl, posoff) == -1 ||
+		    (w->poffs != NULL && write_pos(&pb, &src) == -1)) {
+			w->ret = -1;
+			break;
+		}
+	}
+
+	if (wbuf_close(&b) == -1)
+		w->ret = -1;
+	if (pb.buf != NULL && wbuf_close(&pb) == -1)
+		w->ret = -1;
+	return NULL;
+}
+
+static void *
+index_run(void *data)
+{
+	struct writer *w = data;
+	struct idx_writer iw;
+	struct wbuf idx, top;
+	size_t i;
+
+	idx.buf = top.buf = NULL;
+	if (wbuf_init(&idx, w->fd, w->secs[DB_SEC_IDX][0]) == -1 ||
+	    wbuf_init(&top, w->fd, w->secs[DB_SEC_TOP][0]) == -1) {
+		free(idx.buf);
+		w->ret = -1;
+		return NULL;
+	}
+
+	idx_writer_init(&iw, &idx, &top, w->secs[DB_SEC_LIST][0]);
+	for (i = 0; i < w->dict->len; ++i) {
+		if (idx_add(&iw, w->dict->entries[i].word, w->offs[i]) == -1) {
+			w->ret = -1;
+			break;
+		}
+	}
+	free(iw.prev);
+
+	w->secs[DB_SEC_IDX][1] = idx.off + idx.len;
+	if (wbuf_close(&idx) == -1)
+		w->ret = -1;
+	if (wbuf_close(&top) == -1)
+		w->ret = -1;
+	return NULL;
+}
+
+static void *
+docs_run(void *data)
+{
+	struct writer *w = data;
+
+	w->ret = write_docs(w->fd, w->entries, w->n, w->secs);
+	return NULL;
+}
+
+static void *
+mph_run(void *data)
+{
+	struct writer *w = data;
+	uint64_t *h0;
+	size_t i;
+
+	if ((h0 = calloc(w->dict->len + 1, sizeof(*h0))) == NULL) {
+		w->ret = -1;
+		return NULL;
+	}
+
+	for (i = 0; i < w->dict->len; ++i)
+		h0[i] = mph_hash(w->dict->entries[i].word);
+	w->ret = write_mph(w->fd, w->secs, h0, w->dict->len);
+	free(h0);
+	return NULL;
+}
+
+/* start fn on w; if the thread can't be created run it directly */
+static void
+writer_start(struct writer *w, void *(*fn)(void *))
+{
+	w->running = pthread_create(&w->tid, NULL, fn, w) == 0;
+	if (!w->running)
+		fn(w);
+}
+
+static int
+writer_wait(struct writer *ws, size_t n)
+{
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < n; ++i) {
+		if (ws[i].running && pthread_join(ws[i].tid, NULL) != 0)
+			ret = -1;
+		ws[i].running = 0;
+		if (ws[i].ret == -1)
+			ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Write the database in fd.  The size of every posting list, and of
+ * its positions if the dictionary has them, is computed first, so the
+ * position of every section is known before writing anything.  Then
+ * the lists are written by njobs threads while three more write the
+ * index, the documents and the hash.  The index comes last since its
+ * size is known only at the end.
+ */
+int
+db_create(int fd, struct dictionary *dict, struct db_entry *entries,
+    size_t n, int njobs)
+{
+	struct writer *ws = NULL;
+	int64_t secs[DB_NSECS][2], *offs, *poffs = NULL, total, size;
+	size_t i, nws, start, per;
+	float avg;
+	int ret = -1;
+
+	if (n > INT32_MAX)
+		return -1;
+
+	if ((uint64_t)dict->len > UINT32_MAX)
+		return -1;
+
+	if (njobs < 1)
+		njobs = 1;
+
+	if ((offs = calloc(dict->len + 1, sizeof(*offs))) == NULL)
+		return -1;
+	if (dict->positions &&
+	    (poffs = calloc(dict->len + 1, sizeof(*poffs))) == NULL)
+		goto done;
+	if ((ws = calloc(njobs + 3, sizeof(*ws))) == NULL)
+		goto done;
+
+	avg = entries_avgdl(entries, n);
+	for (i = 0; i < (size_t)njobs + 3; ++i) {
+		ws[i].fd = fd;
+		ws[i].dict = dict;
+		ws[i].entries = entries;
+		ws[i].n = n;
+		ws[i].offs = offs;
+		ws[i].poffs = poffs;
+		ws[i].secs = secs;
+		ws[i].avgdl = avg;
+	}
+
+	/* the size of every list, split evenly by number of words */
+	per = (dict->len + njobs - 1) / njobs;
+	for (i = 0; i < (size_t)njobs; ++i) {
+		ws[i].start = i * per;
+		ws[i].end = ws[i].start + per;
+		if (ws[i].start > dict->len)
+			ws[i].start = dict->len;
+		if (ws[i].end > dict->len)
+			ws[i].end = dict->len;
+		writer_start(&ws[i], sizes_run);
+	}
+	if (writer_wait(ws, njobs) == -1)
+		goto done;
+
+	offs[0] = DB_HDRLEN;
+	for (i = 0; i < dict->len; ++i)
+		offs[i + 1] += offs[i];
+
+	secs[DB_SEC_LIST][0] = offs[0];
+	secs[DB_SEC_LIST][1] = offs[dict->len];
+
+	/* the positions follow the lists */
+	secs[DB_SEC_POS][0] = secs[DB_SEC_POS][1] = secs[DB_SEC_LIST][1];
+	if (poffs != NULL) {
+		poffs[0] = secs[DB_SEC_POS][0];
+		for (i = 0; i < dict->len; ++i)
+			poffs[i + 1] += poffs[i];
+		secs[DB_SEC_POS][1] = poffs[dict->len];
+	}
+
+	docs_sections(entries, n, secs[DB_SEC_POS][1], secs);
+	idx_sections(dict->len, secs);
+
+	/* now split the lists evenly by size */
+	total = secs[DB_SEC_POS][1] - secs[DB_SEC_LIST][0];
+	for (nws = 0, start = 0; nws < (size_t)njobs; ++nws) {
+		ws[nws].start = start;
+		for (; start < dict->len; ++start) {
+			size = offs[start] - offs[0];
+			if (poffs != NULL)
+				size += poffs[start] - poffs[0];
+			if (size >= (int64_t)((nws + 1) * (total / njobs + 1)))
+				break;
+		}
+		ws[nws].end = start;
+		writer_start(&ws[nws], lists_run);
+	}
+	writer_start(&ws[nws++], index_run);
+	writer_start(&ws[nws++], docs_run);
+	writer_start(&ws[nws++], mph_run);
+	if (writer_wait(ws, nws) == -1)
+		goto done;
+
+	ret = write_header(fd, dict->len, n,
+	    dict->positions ? DB_POSITIONS : 0, secs);
+
+done:
+	free(ws);
+	free(offs);
+	free(poffs);
+	return ret;
+}
+
+/*
+ * Write the sorted dictionary to fp as a run to be merged later by
+ * db_create_merge().  A run is a sequence of
+ *
+ *	wordlen[4] word[wordlen] ndocs[4] { id[4] tf[4] }[ndocs]
+ *
+ * followed by the positions, if the dictionary has them.
+ */
+int
+db_spill(FILE *fp, struct dictionary *dict)
+{
+	struct dict_entry *e;
+	struct dict_chunk *c;
+	struct dict_poschunk *pc;
+	uint32_t l;
+	size_t i;
+
+	for (i = 0; i < dict->len; ++i) {
+		e = &dict->entries[i];
+
+		l = strlen(e->word);
+		if (fwrite(&l, sizeof(l), 1, fp) != 1 ||
+		    (l > 0 && fwrite(e->word, l, 1, fp) != 1))
+			return -1;
+
+		l = e->len;
+		if (fwrite(&l, sizeof(l), 1, fp) != 1)
+			return -1;
+
+		for (c = e->head; c != NULL; c = c->next) {
+			if (fwrite(c->ps, sizeof(*c->ps), c->len, fp)
+			    != c->len)
+				return -1;
+		}
+
+		for (pc = e->phead; pc != NULL; pc = pc->next) {
+			if (fwrite(pc->pos, sizeof(*pc->pos), pc->len, fp)
+			    != pc->len)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* read the next word of the run: returns 1 on success, 0 at the end */
+static int
+run_next(struct run *r)
+{
+	uint32_t l;
+	void *t;
+
+	if (r->pos == r->len && r->off == r->end)
+		return 0;
+
+	if (run_read(r, &l, sizeof(l)) == -1)
+		return -1;
+
+	if (l >= r->wordcap) {
+		if ((t = realloc(r->word, l + 1)) == NULL)
+			return -1;
+		r->word = t;
+		r->wordcap = l + 1;
+	}
+
+	if (run_read(r, r->word, l) == -1)
+		return -1;
+	r->word[l] = '\0';
+
+	if (run_read(r, &r->ndocs, sizeof(r->ndocs)) == -1)
+		return -1;
+	return 1;
+}
+
+/* runs with the same word are sorted by age */
+static inline int
+run_cmp(struct run *a, struct run *b)
+{
+	int r;
+
+	if ((r = strcmp(a->word, b->word)) != 0)
+		return r;
+	return a->idx < b->idx ? -1 : 1;
+}
+
+static void
+heap_down(struct run **heap, size_t n, size_t i)
+{
+	struct run *t;
+	size_t c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && run_cmp(heap[c + 1], heap[c]) < 0)
+			c++;
+		if (run_cmp(heap[i], heap[c]) < 0)
+			break;
+		t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+		i = c;
+	}
+}
+
+/* append the first len bytes of fd to w */
+static int
+copy_fd(struct wbuf *w, int fd, off_t len)
+{
+	char buf[BUFSIZ];
+	off_t off;
+	ssize_t n;
+
+	for (off = 0; off < len; off += n) {
+		n = sizeof(buf);
+		if (n > len - off)
+			n = len - off;
+		if ((n = pread(fd, buf, n, off)) <= 0)
+			return -1;
+		if (wbuf_write(w, buf, n) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* the lists up to these sizes are merged in memory */
+#define MERGE_MAXDOCS	(64 * 1024)
+#define MERGE_MAXPOS	(256 * 1024)
+
+/*
+ * Like db_create(), but the postings come from the runs written by
+ * db_spill() one after the other in spill, oldest first: the i-th run
+ * spans from offs[i] to offs[i + 1].  The runs are merged word by
+ * word.  The lists up to MERGE_MAXDOCS postings and MERGE_MAXPOS
+ * positions are put together in memory; for the longer ones only
+ * where they are in every run is kept, and they're read back from
+ * there a block at a time, so the memory used doesn't depend on the
+ * length of the lists.  The index and the positions, if the runs
+ * have them, are stored in temporary files until all the lists are
+ * written.
+ */
+int
+db_create_merge(int fd, FILE *spill, const int64_t *offs, size_t nruns,
+    struct db_entry *entries, size_t n, int positions)
+{
+	struct dict_entry e;
+	struct dict_chunk *c = NULL;
+	struct dict_poschunk *pc = NULL;
+	struct dict_posting ps[DB_BLOCKLEN], *dst;
+	struct list_part *parts, *lp;
+	struct list_src ms, ls, *src;
+	struct run *rs, **heap, *r, rd, prd;
+	struct idx_writer ix;
+	struct wbuf w, iw, tw, pw;
+	int64_t secs[DB_NSECS][2], idxsize, topsize, possize;
+	uint64_t *h0 = NULL;
+	FILE *idx = NULL, *top = NULL, *pos = NULL;
+	char *word = NULL;
+	size_t i, j, m, h, nparts, wordcap = 0, nwords = 0, hcap = 0;
+	float avg;
+	int inmem, ret = -1;
+	void *t;
+
+	if (n > INT32_MAX)
+		return -1;
+
+	avg = entries_avgdl(entries, n);
+	w.buf = iw.buf = tw.buf = pw.buf = NULL;
+	ix.prev = NULL;
+	memset(&rd, 0, sizeof(rd));
+	memset(&prd, 0, sizeof(prd));
+	rs = calloc(nruns, sizeof(*rs));
+	heap = calloc(nruns, sizeof(*heap));
+	parts = calloc(nruns, sizeof(*parts));
+	if (rs == NULL || heap == NULL || parts == NULL)
+		goto done;
+
+	if (fflush(spill) == EOF)
+		goto done;
+
+	for (h = 0, i = 0; i < nruns; ++i) {
+		rs[i].fd = fileno(spill);
+		rs[i].idx = i;
+		rs[i].off = offs[i];
+		rs[i].end = offs[i + 1];
+		if ((rs[i].buf = malloc(RUN_BUFSIZE)) == NULL)
+			goto done;
+		switch (run_next(&rs[i])) {
+		case -1:
+			goto done;
+		case 1:
+			heap[h++] = &rs[i];
+		}
+	}
+	for (i = h / 2; i > 0; --i)
+		heap_down(heap, h, i - 1);
+
+	/* the readers of the lists and of their positions */
+	rd.fd = prd.fd = fileno(spill);
+	rd.end = prd.end = offs[nruns];
+	if ((rd.buf = malloc(RUN_BUFSIZE)) == NULL ||
+	    (prd.buf = malloc(RUN_BUFSIZE)) == NULL)
+		goto done;
+	memset(&ls, 0, sizeof(ls));
+	ls.parts = parts;
+	ls.rd = &rd;
+	ls.prd = &prd;
+
+	c = malloc(sizeof(*c) + MERGE_MAXDOCS * sizeof(*c->ps));
+	pc = malloc(sizeof(*pc) + MERGE_MAXPOS * sizeof(*pc->pos));
+	if (c == NULL || pc == NULL)
+		goto done;
+	c->cap = MERGE_MAXDOCS;
+	pc->cap = MERGE_MAXPOS;
+
+	if ((idx = tmpfile()) == NULL || (top = tmpfile()) == NULL ||
+	    (positions && (pos = tmpfile()) == NULL))
+		goto done;
+
+	if (wbuf_init(&w, fd, DB_HDRLEN) == -1 ||
+	    wbuf_init(&iw, fileno(idx), 0) == -1 ||
+	    wbuf_init(&tw, fileno(top), 0) == -1 ||
+	    (positions && wbuf_init(&pw, fileno(pos), 0) == -1))
+		goto done;
+	secs[DB_SEC_LIST][0] = DB_HDRLEN;
+	idx_writer_init(&ix, &iw, &tw, secs[DB_SEC_LIST][0]);
+
+	while (h > 0) {
+		if (strlen(heap[0]->word) >= wordcap) {
+			wordcap = strlen(heap[0]->word) + 1;
+			if ((t = realloc(word, wordcap)) == NULL)
+				goto done;
+			word = t;
+		}
+		strlcpy(word, heap[0]->word, wordcap);
+
+		ls.len = 0;
+		nparts = 0;
+		c->len = 0;
+		pc->len = 0;
+		inmem = 1;
+		while (h > 0 && !strcmp(heap[0]->word, word)) {
+			r = heap[0];
+
+			if (ls.len + r->ndocs > n || nparts == nruns)
+				goto done;
+			ls.len += r->ndocs;
+			if (ls.len > MERGE_MAXDOCS)
+				inmem = 0;
+
+			lp = &parts[nparts++];
+			lp->off = run_tell(r);
+			lp->ndocs = r->ndocs;
+			lp->ntf = 0;
+
+			/*
+			 * The postings are read if they're kept or to know
+			 * how many positions follow: the sum of the tfs.
+			 */
+			for (j = 0; (inmem || positions) && j < r->ndocs;
+			    j += m) {
+				m = r->ndocs - j;
+				if (m > DB_BLOCKLEN)
+					m = DB_BLOCKLEN;
+				dst = inmem ? c->ps + c->len + j : ps;
+				if (run_read(r, dst, m * sizeof(*dst)) == -1)
+					goto done;
+				for (i = 0; positions && i < m; ++i)
+					lp->ntf += dst[i].tf;
+			}
+			c->len += r->ndocs;
+			lp->posoff = lp->off + r->ndocs * sizeof(*ps);
+
+			if (pc->len + lp->ntf > MERGE_MAXPOS)
+				inmem = 0;
+			if (inmem && positions) {
+				if (run_read(r, pc->pos + pc->len,
+				    lp->ntf * sizeof(*pc->pos)) == -1)
+					goto done;
+				pc->len += lp->ntf;
+			} else
+				run_seek(r, lp->posoff +
+				    lp->ntf * sizeof(uint32_t));
+
+			switch (run_next(r)) {
+			case -1:
+				goto done;
+			case 0:
+				heap[0] = heap[--h];
+				break;
+			}
+			heap_down(heap, h, 0);
+		}
+
+		if (inmem) {
+			memset(&e, 0, sizeof(e));
+			e.word = word;
+			e.len = c->len;
+			e.head = e.tail = c;
+			c->next = NULL;
+			if (positions) {
+				e.phead = e.ptail = pc;
+				pc->next = NULL;
+			}
+			src_entry(&ms, &e);
+			src = &ms;
+		} else {
+			ls.nparts = nparts;
+			src = &ls;
+		}
+
+		/* keep what's needed to build the hash at the end */
+		if (nwords == hcap) {
+			hcap = hcap == 0 ? 1024 : hcap * 2;
+			if ((t = reallocarray(h0, hcap, sizeof(*h0))) == NULL)
+				goto done;
+			h0 = t;
+		}
+		h0[nwords] = mph_hash(word);
+
+		if (idx_add(&ix, word, w.off + w.len) == -1 ||
+		    write_list(&w, src, entries, avg,
+		    positions ? pw.off + (int64_t)pw.len : -1) == -1 ||
+		    (positions && write_pos(&pw, src) == -1))
+			goto done;
+		nwords++;
+	}
+
+	if (nwords > UINT32_MAX)
+		goto done;
+
+	/* the positions follow the lists */
+	secs[DB_SEC_LIST][1] = w.off + w.len;
+	secs[DB_SEC_POS][0] = secs[DB_SEC_POS][1] = secs[DB_SEC_LIST][1];
+	if (positions) {
+		possize = pw.off + pw.len;
+		if (wbuf_close(&pw) == -1 ||
+		    copy_fd(&w, fileno(pos), possize) == -1)
+			goto done;
+		secs[DB_SEC_POS][1] += possize;
+	}
+
+	docs_sections(entries, n, secs[DB_SEC_POS][1], secs);
+	if (write_docs(fd, entries, n, secs) == -1)
+		goto done;
+
+	/* then the top level and the index */
+	idxsize = iw.off + iw.len;
+	topsize = tw.off + tw.len;
+	idx_sections(nwords, secs);
+	if (write_mph(fd, secs, h0, nwords) == -1)
+		goto done;
+	secs[DB_SEC_IDX][1] = secs[DB_SEC_IDX][0] + idxsize;
+	if (wbuf_flush(&w) == -1 ||
+	    wbuf_close(&iw) == -1 ||
+	    wbuf_close(&tw) == -1)
+		goto done;
+	w.off = secs[DB_SEC_TOP][0];
+	if (copy_fd(&w, fileno(top), topsize) == -1 ||
+	    copy_fd(&w, fileno(idx), idxsize) == -1 ||
+	    wbuf_close(&w) == -1)
+		goto done;
+
+	ret = write_header(fd, nwords, n, positions ? DB_POSITIONS : 0, secs);
+
+done:
+	free(w.buf);
+	free(iw.buf);
+	free(tw.buf);
+	free(pw.buf);
+	free(ix.prev);
+	if (idx != NULL)
+		fclose(idx);
+	if (top != NULL)
+		fclose(top);
+	if (pos != NULL)
+		fclose(pos);
+	for (i = 0; rs != NULL && i < nruns; ++i) {
+		free(rs[i].buf);
+		free(rs[i].word);
+	}
+	free(rs);
+	free(heap);
+	free(parts);
+	free(rd.buf);
+	free(prd.buf);
+	free(word);
+	free(c);
+	free(pc);
+	free(h0);
+	return ret;
+}
 
 static int
-write_dictionary(FILE *fp, struct dictionary *dict)
+initdb(struct db *db)
+{
+	int64_t secs[DB_NSECS][2];
+	uint8_t *p = db->m;
+	int i;
+
+	if (db->len < 0 || DB_HDRLEN > (size_t)db->len)
+		return -1;
+
+	memcpy(&db->version, p, sizeof(db->version));
+	p += sizeof(db->version);
+
+	if (db->version != DB_VERSION)
+		return -1;
+
+	memcpy(&db->nwords, p, sizeof(db->nwords));
+	p += sizeof(db->nwords);
+
+	memcpy(&db->ndocs, p, sizeof(db->ndocs));
+	p += sizeof(db->ndocs);
+
+	memcpy(&db->flags, p, sizeof(db->flags));
+	p += sizeof(db->flags);
+
+	memcpy(secs, p, sizeof(secs));
+	for (i = 0; i < DB_NSECS; ++i) {
+		if (secs[i][0] < (int64_t)DB_HDRLEN ||
+		    secs[i][0] > secs[i][1] ||
+		    secs[i][1] > db->len)
+			return -1;
+	}
+
+	db->idx_start = db->m + secs[DB_SEC_IDX][0];
+	db->idx_end = db->m + secs[DB_SEC_IDX][1];
+	db->top_start = db->m + secs[DB_SEC_TOP][0];
+	db->top_end = db->m + secs[DB_SEC_TOP][1];
+	db->list_start = db->m + secs[DB_SEC_LIST][0];
+	db->list_end = db->m + secs[DB_SEC_LIST][1];
+	db->docs_start = db->m + secs[DB_SEC_DOCS][0];
+	db->docs_end = db->m + secs[DB_SEC_DOCS][1];
+	db->doctab_start = db->m + secs[DB_SEC_DOCTAB][0];
+	db->doctab_end = db->m + secs[DB_SEC_DOCTAB][1];
+	db->pos_start = db->m + secs[DB_SEC_POS][0];
+	db->pos_end = db->m + secs[DB_SEC_POS][1];
+
+	if ((size_t)(db->top_end - db->top_start) != TOP_ENTRY_SIZE *
+	    ((db->nwords + DB_IDXBLOCK - 1) / DB_IDXBLOCK))
+		return -1;
+
+	p = db->m + secs[DB_SEC_MPH][0];
+	if (secs[DB_SEC_MPH][1] - secs[DB_SEC_MPH][0] < (int64_t)MPH_HDRLEN)
+		return -1;
+	memcpy(&db->mph_seed, p, sizeof(db->mph_seed));
+	p += sizeof(db->mph_seed);
+	memcpy(&db->mph_nbuckets, p, sizeof(db->mph_nbuckets));
+	p += 2 * sizeof(uint32_t);
+	db->mph_pilots = p;
+	db->mph_slots = p + db->mph_nbuckets * sizeof(uint32_t);
+	if (db->mph_nbuckets != 0 &&
+	    secs[DB_SEC_MPH][1] - secs[DB_SEC_MPH][0] != (int64_t)(MPH_HDRLEN +
+	    (uint64_t)db->mph_nbuckets * sizeof(uint32_t) +
+	    (uint64_t)db->nwords * MPH_SLOT_SIZE))
+		return -1;
+	if ((size_t)(db->doctab_end - db->doctab_start) !=
+	    db->ndocs * sizeof(int64_t))
+		return -1;
+
+	p = db->m + secs[DB_SEC_DOCLEN][0];
+	if (secs[DB_SEC_DOCLEN][1] - secs[DB_SEC_DOCLEN][0] !=
+	    (int64_t)(sizeof(db->total) + db->ndocs * sizeof(uint32_t)))
+		return -1;
+	memcpy(&db->total, p, sizeof(db->total));
+	db->doclens = p + sizeof(db->total);
+	db->avgdl = avgdl(db->total, db->ndocs);
+
+	return 0;
+}
+
+int
+db_open(struct db *db, int fd)
+{
+	memset(db, 0, sizeof(*db));
+
+	if ((db->len = lseek(fd, 0, SEEK_END)) == -1)
+		return -1;
+
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		return -1;
+
+	db->m = mmap(NULL, db->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (db->m == MAP_FAILED)
+		return -1;
+
+	if (initdb(db) == -1) {
+		db_close(db);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Map the sidecar with the deleted documents of db, opened at fd.  It
+ * has to be for as many documents as db.
+ */
+int
+db_open_deleted(struct db *db, int fd)
 {
-	off_t start;
-	uint64_t pos;
-	uint32_t n;
-	size_t i, len;
+	uint32_t i, ndocs;
+	uint8_t *m;
+	off_t len;
 
-	if ((uint64_t)dict->len > UINT32_MAX)
+	if ((len = lseek(fd, 0, SEEK_END)) == -1)
+		return -1;
+	if (len != (off_t)(DB_DEL_HDRLEN + (db->ndocs + 7) / 8))
 		return -1;
 
-	n = dict->len;
-	if (fwrite(&n, sizeof(n), 1, fp) != 1)
+	m = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED)
 		return -1;
 
-	if ((start = ftello(fp)) == -1)
+	memcpy(&ndocs, m, sizeof(ndocs));
+	if (ndocs != db->ndocs) {
+		munmap(m, len);
 		return -1;
+	}
 
-	len = DB_WORDLEN + sizeof(int64_t);
-	pos = start + (n * len);
-	for (i = 0; i < dict->len; ++i) {
-		char word[DB_WORDLEN];
+	if (db->del_m != NULL)
+		munmap(db->del_m, db->del_len);
+	db->del_m = m;
+	db->del_len = len;
+	memcpy(&db->ndeleted, m + sizeof(ndocs), sizeof(db->ndeleted));
+	db->deleted = m + DB_DEL_HDRLEN;
+
+	db->deltotal = 0;
+	for (i = 0; i < ndocs; ++i)
+		if (db_is_deleted(db, i))
+			db->deltotal += db_doc_len(db, i);
+	return 0;
+}
 
-		memset(word, 0, sizeof(word));
-		strlcpy(word, dict->entries[i].word, sizeof(word));
-		if (fwrite(word, sizeof(word), 1, fp) != 1)
-			return -1;
+/* write the sidecar for the bitmap of the deleted of ndocs documents */
+int
+db_write_deleted(int fd, const uint8_t *bits, uint32_t ndocs)
+{
+	struct wbuf w;
+	uint32_t i, n = 0;
+	int ret = -1;
 
-		if (fwrite(&pos, sizeof(pos), 1, fp) != 1)
-			return -1;
+	for (i = 0; i < ndocs; ++i)
+		if (bits[i >> 3] & (1 << (i & 7)))
+			n++;
 
-		/* one for the len */
-		pos += sizeof(uint32_t) * (dict->entries[i].len + 1);
-	}
+	if (wbuf_init(&w, fd, 0) == -1)
+		return -1;
+	if (wbuf_write(&w, &ndocs, sizeof(ndocs)) == 0 &&
+	    wbuf_write(&w, &n, sizeof(n)) == 0 &&
+	    wbuf_write(&w, bits, (ndocs + 7) / 8) == 0)
+		ret = wbuf_close(&w);
+	free(w.buf);
+	return ret;
+}
 
-	for (i = 0; i < dict->len; ++i) {
-		size_t j;
-		uint32_t t, x;
+/* read the next word of the index */
+struct idx_iter {
+	struct db	*db;
+	const uint8_t	*p;
+	uint32_t	 n;		/* words read so far */
+	uint64_t	 off;		/* of the posting list */
+	char		*word;
+	size_t		 len;
+	size_t		 cap;
+};
+
+/* returns 1 on success, 0 at the end of the index or -1 on error */
+static int
+idx_next(struct idx_iter *it)
+{
+	const uint8_t *end = it->db->idx_end;
+	uint64_t pre, len, off;
+	void *t;
+
+	if (it->n == it->db->nwords)
+		return 0;
 
-		x = dict->entries[i].len;
-		if (fwrite(&x, sizeof(x), 1, fp) != 1)
+	if ((it->p = vb64_decode(it->p, end, &pre)) == NULL ||
+	    (it->p = vb64_decode(it->p, end, &len)) == NULL)
+		return -1;
+	if (pre > it->len || len > (uint64_t)(end - it->p))
+		return -1;
+
+	if (it->n % DB_IDXBLOCK == 0) {
+		if (pre != 0)
 			return -1;
+		it->off = 0;
+	}
 
-		for (j = 0; j < x; ++j) {
-			t = dict->entries[i].ids[j];
-			if (fwrite(&t, sizeof(t), 1, fp) != 1)
-				return -1;
-		}
+	if (pre + len >= it->cap) {
+		if ((t = realloc(it->word, pre + len + 1)) == NULL)
+			return -1;
+		it->word = t;
+		it->cap = pre + len + 1;
 	}
+	memcpy(it->word + pre, it->p, len);
+	it->len = pre + len;
+	it->word[it->len] = '\0';
+	it->p += len;
 
-	return 0;
+	if ((it->p = vb64_decode(it->p, end, &off)) == NULL)
+		return -1;
+	it->off += off;
+	it->n++;
+	return 1;
 }
 
-int
-db_create(FILE *fp, struct dictionary *dict, struct db_entry *entries,
-    size_t n)
+static inline int
+db_getdocs(struct db *db, uint64_t off, struct db_cursor *c)
 {
-	int64_t endidx;
-	size_t i;
-	uint32_t version = DB_VERSION;
-
-	if (n > INT32_MAX)
-		return -1;
+	const uint8_t *entry;
+	uint64_t posoff;
+	uint32_t l;
+	size_t hdrlen;
 
-	if (fwrite(&version, sizeof(version), 1, fp) != 1)
-		return -1;
+	memset(c, 0, sizeof(*c));
 
-	/* reserve space for the start pointer -- filled later */
-	if (fseek(fp, sizeof(int64_t), SEEK_CUR) == -1)
-		return -1;
+	hdrlen = DB_LIST_HDRLEN;
+	if (db->flags & DB_POSITIONS)
+		hdrlen += DB_LIST_POSLEN;
 
-	if (write_dictionary(fp, dict) == -1)
+	if (off > (uint64_t)(db->list_end - db->list_start) ||
+	    db->list_end - db->list_start - off < hdrlen)
 		return -1;
+	entry = db->list_start + off;
 
-	if ((endidx = ftello(fp)) == -1)
-		return -1;
+	memcpy(&l, entry, sizeof(l));
+	entry += sizeof(l);
+	memcpy(&c->max, entry, sizeof(c->max));
+	entry += sizeof(c->max);
 
-	for (i = 0; i < n; ++i) {
-		uint16_t namelen, descrlen = 0;
+	if (db->flags & DB_POSITIONS) {
+		memcpy(&posoff, entry, sizeof(posoff));
+		entry += sizeof(posoff);
+		if (posoff > (uint64_t)(db->pos_end - db->pos_start))
+			return -1;
+		c->pos = db->pos_start + posoff;
+	}
 
-		namelen = strlen(entries[i].name);
-		if (entries[i].descr != NULL)
-			descrlen = strlen(entries[i].descr);
+	c->db = db;
+	c->ndocs = l;
+	c->left = l;
+	c->base = UINT32_MAX;
+	c->nblocks = (l + DB_BLOCKLEN - 1) / DB_BLOCKLEN;
 
-		if (fwrite(&namelen, sizeof(namelen), 1, fp) != 1)
-			return -1;
-		if (fwrite(entries[i].name, namelen+1, 1, fp) != 1)
+	if (c->nblocks > 1) {
+		if ((size_t)(db->list_end - entry) <
+		    c->nblocks * DB_SKIP_SIZE)
 			return -1;
+		c->skip = entry;
+		entry += c->nblocks * DB_SKIP_SIZE;
+	}
 
-		if (fwrite(&descrlen, sizeof(descrlen), 1, fp) != 1)
-			return -1;
-		if (descrlen > 0 &&
-		    fwrite(entries[i].descr, descrlen, 1, fp) != 1)
+	c->data = entry;
+	c->p = entry;
+	return 0;
+}
+
+/*
+ * Look for word in the given block of the index.  Only the bytes that
+ * differ from the previous word are compared: m is the length of the
+ * prefix shared by the current word and the one we're looking for.
+ * Returns 1 if found, 0 if the word is not in the index, 2 if all the
+ * words in the block are smaller or -1 on error.
+ */
+static int
+db_idx_block(struct db *db, size_t blk, const char *word, size_t wlen,
+    uint64_t *off)
+{
+	const uint8_t *p, *end = db->idx_end, *suffix;
+	uint64_t pre, len, delta;
+	uint32_t boff;
+	size_t i, j, n, m = 0;
+
+	memcpy(&boff, db->top_start + blk * TOP_ENTRY_SIZE + DB_TOPKEY,
+	    sizeof(boff));
+	if ((int64_t)boff >= end - db->idx_start)
+		return -1;
+	p = db->idx_start + boff;
+
+	n = db->nwords - blk * DB_IDXBLOCK;
+	if (n > DB_IDXBLOCK)
+		n = DB_IDXBLOCK;
+
+	*off = 0;
+	for (i = 0; i < n; ++i) {
+		if ((p = vb64_decode(p, end, &pre)) == NULL ||
+		    (p = vb64_decode(p, end, &len)) == NULL ||
+		    len > (uint64_t)(end - p))
 			return -1;
-		if (fwrite("", 1, 1, fp) != 1)
+		suffix = p;
+		p += len;
+		if ((p = vb64_decode(p, end, &delta)) == NULL)
 			return -1;
-	}
+		*off += delta;
 
-	if (fseek(fp, sizeof(version), SEEK_SET) == -1)
-		return -1;
+		/* bigger than the previous word where it matched */
+		if (pre < m)
+			return 0;
 
-	if (fwrite(&endidx, sizeof(endidx), 1, fp) != 1)
-		return -1;
+		/* same as the previous word up to where it differed */
+		if (pre > m)
+			continue;
 
-	return 0;
+		for (j = 0; j < len && m < wlen; ++j, ++m)
+			if (suffix[j] != (unsigned char)word[m])
+				break;
+
+		if (j == len && m == wlen)
+			return 1;
+		if (j == len)
+			continue;
+		if (m == wlen || suffix[j] > (unsigned char)word[m])
+			return 0;
+	}
+
+	return 2;
 }
 
+/*
+ * Find the last block whose key is smaller than the one of the word in
+ * the top level, then walk the blocks from there.  Words sharing the
+ * first DB_TOPKEY bytes may span more than one block.
+ */
 static int
-initdb(struct db *db)
+db_idx_lookup(struct db *db, const char *word, uint64_t *off)
 {
-	off_t hdrlen = sizeof(uint32_t) + sizeof(int64_t) + sizeof(uint32_t);
-	int64_t end_off;
-	uint8_t *p = db->m;
-
-	if (hdrlen > db->len)
-		return -1;
+	uint8_t key[DB_TOPKEY];
+	size_t lo, hi, mid, wlen, nblocks;
+	int r;
+
+	wlen = strlen(word);
+	memset(key, 0, sizeof(key));
+	memcpy(key, word, wlen < sizeof(key) ? wlen : sizeof(key));
+
+	nblocks = (db->nwords + DB_IDXBLOCK - 1) / DB_IDXBLOCK;
+	lo = 0;
+	hi = nblocks;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(db->top_start + mid * TOP_ENTRY_SIZE, key,
+		    sizeof(key)) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	memcpy(&db->version, p, sizeof(db->version));
-	p += sizeof(db->version);
+	for (lo = lo == 0 ? 0 : lo - 1; lo < nblocks; ++lo) {
+		if ((r = db_idx_block(db, lo, word, wlen, off)) == 2)
+			continue;
+		return r == 1 ? 0 : -1;
+	}
 
-	memcpy(&end_off, p, sizeof(end_off));
-	p += sizeof(end_off);
+	return -1;
+}
 
-	memcpy(&db->nwords, p, sizeof(db->nwords));
-	p += sizeof(db->nwords);
+/* a word not in the index may still match the fingerprint */
+static int
+db_mph_lookup(struct db *db, const char *word, uint64_t *off)
+{
+	const uint8_t *e;
+	uint64_t h;
+	uint32_t pilot, fp, n;
 
-	db->idx_start = p;
-	db->idx_end = p + db->nwords * IDX_ENTRY_SIZE;
-	db->list_start = db->idx_end;
-	db->list_end = db->m + end_off;
-	db->docs_start = db->list_end;
-	db->docs_end = db->m + db->len;
+	h = mph_seed(mph_hash(word), db->mph_seed);
+	memcpy(&pilot, db->mph_pilots +
+	    mph_bucket(h, db->mph_nbuckets) * sizeof(pilot), sizeof(pilot));
 
-	if (db->idx_end > db->docs_end)
-		return -1;
-	if (db->list_end > db->docs_end)
+	e = db->mph_slots + mph_slot(h, pilot, db->nwords) * MPH_SLOT_SIZE;
+	memcpy(&fp, e, sizeof(fp));
+	if (fp != mph_fingerprint(h))
 		return -1;
 
+	/* the fingerprints can collide: the word has to be in its block */
+	memcpy(&n, e + sizeof(fp), sizeof(n));
+	if (n >= db->nwords ||
+	    db_idx_block(db, n / DB_IDXBLOCK, word, strlen(word), off) != 1)
+		return -1;
 	return 0;
 }
 
 int
-db_open(struct db *db, int fd)
+db_word_docs(struct db *db, const char *word, struct db_cursor *c)
 {
-	memset(db, 0, sizeof(*db));
+	uint64_t off;
+	int r;
 
-	if ((db->len = lseek(fd, 0, SEEK_END)) == -1)
-		return -1;
+	memset(c, 0, sizeof(*c));
 
-	if (lseek(fd, 0, SEEK_SET) == -1)
+	if (db->mph_nbuckets != 0)
+		r = db_mph_lookup(db, word, &off);
+	else
+		r = db_idx_lookup(db, word, &off);
+	if (r == -1)
 		return -1;
+	return db_getdocs(db, off, c);
+}
 
-	db->m = mmap(NULL, db->len, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (db->m == MAP_FAILED)
+/*
+ * Call cb with the cursor of every word in the index that starts with
+ * prefix, in order.  The top level gives the first block that may hold
+ * one, then the words are read until the first one past the range.
+ */
+int
+db_prefix_words(struct db *db, const char *prefix, db_word_cb cb,
+    void *data)
+{
+	struct db_cursor c;
+	struct idx_iter it;
+	uint8_t key[DB_TOPKEY];
+	uint32_t boff;
+	size_t lo, hi, mid, plen, nblocks;
+	int r, cmp;
+
+	plen = strlen(prefix);
+	memset(key, 0, sizeof(key));
+	memcpy(key, prefix, plen < sizeof(key) ? plen : sizeof(key));
+
+	nblocks = (db->nwords + DB_IDXBLOCK - 1) / DB_IDXBLOCK;
+	lo = 0;
+	hi = nblocks;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (memcmp(db->top_start + mid * TOP_ENTRY_SIZE, key,
+		    sizeof(key)) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0)
+		lo--;
+	if (lo == nblocks)
+		return 0;
+
+	memcpy(&boff, db->top_start + lo * TOP_ENTRY_SIZE + DB_TOPKEY,
+	    sizeof(boff));
+	if ((int64_t)boff >= db->idx_end - db->idx_start)
 		return -1;
 
-	if (initdb(db) == -1) {
-		db_close(db);
-		return -1;
+	memset(&it, 0, sizeof(it));
+	it.db = db;
+	it.p = db->idx_start + boff;
+	it.n = lo * DB_IDXBLOCK;
+	while ((r = idx_next(&it)) == 1) {
+		if ((cmp = strncmp(it.word, prefix, plen)) < 0)
+			continue;
+		if (cmp > 0)
+			break;
+		if (db_getdocs(db, it.off, &c) == -1 ||
+		    cb(db, it.word, &c, data) == -1) {
+			r = -1;
+			break;
+		}
 	}
+	free(it.word);
 
-	return 0;
+	return r == -1 ? -1 : 0;
 }
 
 static int
-db_countdocs(struct db *db, struct db_entry *e, void *d)
+db_cursor_fill(struct db_cursor *c)
 {
-	struct db_stats *stats = d;
+	size_t n;
 
-	stats->ndocs++;
-	return 0;
+	if (c->left == 0)
+		return 0;
+
+	n = c->left;
+	if (n > DB_BLOCKLEN)
+		n = DB_BLOCKLEN;
+
+	c->p = postings_decode(c->p, c->db->list_end, c->ids, n, c->base);
+	if (c->p == NULL)
+		return -1;
+
+	/* the tfs of the last block don't need to be skipped */
+	if (c->withtf || c->left > n) {
+		c->p = postings_decode_tf(c->p, c->db->list_end,
+		    c->withtf ? c->tfs : NULL, n);
+		if (c->p == NULL)
+			return -1;
+	}
+
+	c->left -= n;
+	c->base = c->ids[n - 1];
+	c->len = n;
+	c->i = 0;
+	c->blk++;
+	c->posp = NULL;
+	return 1;
 }
 
-static int
-db_idx_compar(const void *key, const void *elem)
+static inline uint32_t
+db_cursor_skip(struct db_cursor *c, size_t blk, uint32_t *off)
 {
-	const char *word = key;
-	const char *idx_entry = elem;
+	const uint8_t *e = c->skip + blk * DB_SKIP_SIZE;
+	uint32_t last;
 
-	if (idx_entry[DB_WORDLEN-1] != '\0')
-		return -1;
-	return strcmp(word, idx_entry);
+	memcpy(&last, e, sizeof(last));
+	if (off != NULL)
+		memcpy(off, e + sizeof(last), sizeof(*off));
+	return last;
 }
 
-static inline uint32_t *
-db_getdocs(struct db *db, const uint8_t *entry, size_t *len)
+/*
+ * Return the highest db_bm25_tf() of the documents from target to
+ * last, which is set to the end of the part of the block that would
+ * hold target, without decoding it.  If the list has only one block
+ * last is set to UINT32_MAX.  The cursor doesn't move.
+ */
+float
+db_cursor_blockmax(struct db_cursor *c, uint32_t target, uint32_t *last)
 {
-	int64_t pos;
+	const uint8_t *e;
+	size_t lo, hi, mid, step;
+	uint64_t first, span, j, end;
 	uint32_t l;
+	float max;
+
+	*last = UINT32_MAX;
+	if (c->skip == NULL)
+		return c->max;
+
+	/* gallop from the block of the previous call, or the current one */
+	lo = c->blk == 0 ? 0 : c->blk - 1;
+	if (c->sblk > lo && db_cursor_skip(c, c->sblk - 1, NULL) < target)
+		lo = c->sblk;
+	hi = lo;
+	for (step = 1; hi < c->nblocks &&
+	    db_cursor_skip(c, hi, NULL) < target; step *= 2) {
+		lo = hi + 1;
+		hi += step;
+	}
+	if (hi > c->nblocks)
+		hi = c->nblocks;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (db_cursor_skip(c, mid, NULL) < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	c->sblk = lo;
+	if (lo == c->nblocks)
+		return 0;
+
+	e = c->skip + lo * DB_SKIP_SIZE;
+	memcpy(&l, e, sizeof(l));
+	memcpy(&max, e + 2 * sizeof(uint32_t), sizeof(max));
+	first = lo == 0 ? 0 : (uint64_t)db_cursor_skip(c, lo - 1, NULL) + 1;
+	span = sub_span(first, l);
+	j = (target - first) / span;
+	end = first + (j + 1) * span - 1;
+	*last = end < l ? end : l;
+	return sub_max(max, e[3 * sizeof(uint32_t) + j]);
+}
 
-	entry += DB_WORDLEN;
-	memcpy(&pos, entry, sizeof(pos));
+/* move to the first block whose last id is not less than target */
+static int
+db_cursor_jump(struct db_cursor *c, uint32_t target)
+{
+	size_t lo, hi, mid;
+	uint32_t off;
+
+	lo = c->blk;
+	hi = c->nblocks;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (db_cursor_skip(c, mid, NULL) < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	entry = db->m + pos;
-	if (entry < db->list_start || entry > db->list_end)
-		return NULL;
+	if (lo == c->nblocks) {
+		c->left = 0;
+		c->i = c->len;
+		return 0;
+	}
 
-	memcpy(&l, entry, sizeof(l));
-	entry += sizeof(l);
-	*len = l;
-	return (uint32_t *)entry;
+	db_cursor_skip(c, lo, &off);
+	if (off > c->db->list_end - c->data)
+		return -1;
+
+	c->p = c->data + off;
+	c->base = lo == 0 ? UINT32_MAX : db_cursor_skip(c, lo - 1, NULL);
+	c->left = c->ndocs - lo * DB_BLOCKLEN;
+	c->blk = lo;
+	return db_cursor_fill(c);
 }
 
-uint32_t *
-db_word_docs(struct db *db, const char *word, size_t *len)
+/*
+ * Decode the positions of the current document in pos, which must
+ * have room for its tf.  The cursor needs withtf.  The positions of
+ * the postings before it in the block are skipped, but the place is
+ * remembered so going through a block costs the same as a read.
+ * Returns the number of positions or -1 on error.
+ */
+int
+db_cursor_positions(struct db_cursor *c, uint32_t *pos)
 {
-	uint8_t *e;
+	const uint8_t *end = c->db->pos_end, *data;
+	uint64_t x;
+	uint32_t off, j, tf, p;
+	size_t i;
 
-	*len = 0;
+	if (c->pos == NULL || !c->withtf || c->i == 0)
+		return -1;
+	i = c->i - 1;
+
+	if (c->posp == NULL || c->posi > i) {
+		data = c->pos;
+		off = 0;
+		if (c->nblocks > 1) {
+			if ((size_t)(end - c->pos) <
+			    c->nblocks * sizeof(off))
+				return -1;
+			memcpy(&off, c->pos + (c->blk - 1) * sizeof(off),
+			    sizeof(off));
+			data += c->nblocks * sizeof(off);
+		}
+		if (off > end - data)
+			return -1;
+		c->posp = data + off;
+		c->posi = 0;
+	}
 
-	e = bsearch(word, db->idx_start, db->nwords, IDX_ENTRY_SIZE,
-	    db_idx_compar);
-	if (e == NULL)
-		return NULL;
-	return db_getdocs(db, e, len);
+	for (; c->posi < i; c->posi++) {
+		for (j = 0; j < c->tfs[c->posi]; ++j)
+			if ((c->posp = vb64_decode(c->posp, end, &x)) == NULL)
+				return -1;
+	}
+
+	tf = c->tfs[i];
+	for (p = 0, j = 0; j < tf; ++j) {
+		if ((c->posp = vb64_decode(c->posp, end, &x)) == NULL)
+			return -1;
+		p += x;
+		pos[j] = p;
+	}
+	c->posi++;
+	return tf;
 }
 
+/*
+ * Advance the cursor to the next document.  Returns 1 on success, 0
+ * at the end of the list or -1 if the list is corrupted.
+ */
 int
-db_stats(struct db *db, struct db_stats *stats)
+db_cursor_next(struct db_cursor *c)
 {
-	const uint8_t *p;
-	size_t l, maxl = 0, idlen;
+	int r;
 
-	memset(stats, 0, sizeof(*stats));
+	if (c->i == c->len && (r = db_cursor_fill(c)) != 1)
+		return r;
 
-	if (db_listall(db, db_countdocs, stats) == -1)
-		return -1;
+	c->docid = c->ids[c->i++];
+	return 1;
+}
 
-	stats->nwords = db->nwords;
+/*
+ * Decode the whole list in ids, which must have room for c->ndocs
+ * elements.  The cursor must not have been advanced yet.
+ */
+int
+db_cursor_readall(struct db_cursor *c, uint32_t *ids)
+{
+	size_t n;
+
+	while (c->left > 0) {
+		n = c->left;
+		if (n > DB_BLOCKLEN)
+			n = DB_BLOCKLEN;
 
-	p = db->idx_start;
-	while (p < db->idx_end) {
-		if (p + DB_WORDLEN > db->idx_end)
+		c->p = postings_decode(c->p, c->db->list_end, ids, n,
+		    c->base);
+		if (c->p == NULL)
 			return -1;
+		if (c->left > n) {
+			c->p = postings_decode_tf(c->p, c->db->list_end,
+			    NULL, n);
+			if (c->p == NULL)
+				return -1;
+		}
+
+		c->left -= n;
+		c->base = ids[n - 1];
+		ids += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Set the bit of every document of the list in bits, which must have
+ * room for db->ndocs bits.  The cursor must not have been advanced
+ * yet.
+ */
+int
+db_cursor_bitmap(struct db_cursor *c, uint32_t *bits)
+{
+	size_t n;
 
-		if (p[DB_WORDLEN-1] != '\0')
+	while (c->left > 0) {
+		n = c->left;
+		if (n > DB_BLOCKLEN)
+			n = DB_BLOCKLEN;
+
+		c->p = postings_decode_bitmap(c->p, c->db->list_end, bits,
+		    c->db->ndocs, n, &c->base);
+		if (c->p == NULL)
 			return -1;
+		if (c->left > n) {
+			c->p = postings_decode_tf(c->p, c->db->list_end,
+			    NULL, n);
+			if (c->p == NULL)
+				return -1;
+		}
+
+		c->left -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Advance the cursor to the first document not less than target.  The
+ * cursor must already point to a document.  Returns like
+ * db_cursor_next().
+ */
+int
+db_cursor_seek(struct db_cursor *c, uint32_t target)
+{
+	size_t lo, hi, mid, step;
+	int r;
+
+	if (c->docid >= target)
+		return 1;
+
+	if (c->ids[c->len - 1] < target && c->skip != NULL) {
+		if ((r = db_cursor_jump(c, target)) != 1)
+			return r;
+	}
 
-		l = strlen(p);
-		if (l > maxl) {
-			maxl = l;
-			stats->longest_word = p;
+	while (c->ids[c->len - 1] < target) {
+		if ((r = db_cursor_fill(c)) != 1)
+			return r;
+	}
+
+	/* gallop from the current position then bsearch */
+	lo = hi = c->i;
+	for (step = 1; c->ids[hi] < target; step *= 2) {
+		lo = hi + 1;
+		hi += step;
+		if (hi >= c->len) {
+			hi = c->len - 1;
+			break;
 		}
+	}
 
-		if (db_getdocs(db, p, &idlen) == NULL)
-			return -1;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (c->ids[mid] < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	c->docid = c->ids[lo];
+	c->i = lo + 1;
+	return 1;
+}
+
+/*
+ * The longest and the most popular words are allocated and must be
+ * freed by the caller.
+ */
+int
+db_stats(struct db *db, struct db_stats *stats)
+{
+	struct db_cursor c;
+	struct idx_iter it;
+	size_t maxl = 0;
+	int r;
+
+	memset(stats, 0, sizeof(*stats));
 
-		if (idlen > stats->most_popular_ndocs) {
-			stats->most_popular_ndocs = idlen;
-			stats->most_popular = p;
+	stats->nwords = db->nwords;
+	stats->ndocs = db->ndocs;
+
+	memset(&it, 0, sizeof(it));
+	it.db = db;
+	it.p = db->idx_start;
+	while ((r = idx_next(&it)) == 1) {
+		if (it.len > maxl || stats->longest_word == NULL) {
+			maxl = it.len;
+			free(stats->longest_word);
+			if ((stats->longest_word = strdup(it.word)) == NULL)
+				break;
 		}
 
-		p += IDX_ENTRY_SIZE;
+		if (db_getdocs(db, it.off, &c) == -1)
+			break;
+
+		if (c.ndocs > stats->most_popular_ndocs) {
+			stats->most_popular_ndocs = c.ndocs;
+			free(stats->most_popular);
+			if ((stats->most_popular = strdup(it.word)) == NULL)
+				break;
+		}
 	}
+	free(it.word);
 
+	if (r != 0) {
+		free(stats->longest_word);
+		free(stats->most_popular);
+		stats->longest_word = stats->most_popular = NULL;
+		return -1;
+	}
 	return 0;
 }
 
+struct dump {
+	FILE		*fp;
+	uint32_t	*ids;		/* new id of every document */
+	uint32_t	*ps;		/* id and tf of the postings */
+	size_t		 pscap;
+	uint32_t	*pos;
+	size_t		 poscap;
+};
+
+/*
+ * Write the list at c to the run, without the deleted documents.  The
+ * words left without documents are skipped.
+ */
+static int
+dump_list(struct dump *d, const char *word, size_t wlen,
+    struct db_cursor *c)
+{
+	struct db_cursor t = *c;
+	uint32_t l, n = 0;
+	void *tmp;
+	int r, np;
+
+	t.withtf = 1;
+	while ((r = db_cursor_next(&t)) == 1) {
+		if (t.docid >= c->db->ndocs)
+			return -1;
+		if (db_is_deleted(c->db, t.docid))
+			continue;
+		if (2 * (n + 1) > d->pscap) {
+			tmp = reallocarray(d->ps, 4 * (n + 1), sizeof(*d->ps));
+			if (tmp == NULL)
+				return -1;
+			d->ps = tmp;
+			d->pscap = 4 * (n + 1);
+		}
+		d->ps[2 * n] = d->ids[t.docid];
+		d->ps[2 * n + 1] = t.tfs[t.i - 1];
+		n++;
+	}
+	if (r == -1)
+		return -1;
+	if (n == 0)
+		return 0;
+
+	l = wlen;
+	if (fwrite(&l, sizeof(l), 1, d->fp) != 1 ||
+	    (l > 0 && fwrite(word, l, 1, d->fp) != 1) ||
+	    fwrite(&n, sizeof(n), 1, d->fp) != 1 ||
+	    fwrite(d->ps, 2 * sizeof(*d->ps), n, d->fp) != n)
+		return -1;
+	if (!(c->db->flags & DB_POSITIONS))
+		return 0;
+
+	/* then the positions, in a second pass */
+	t = *c;
+	t.withtf = 1;
+	while ((r = db_cursor_next(&t)) == 1) {
+		if (t.tfs[t.i - 1] > d->poscap) {
+			tmp = reallocarray(d->pos, t.tfs[t.i - 1],
+			    sizeof(*d->pos));
+			if (tmp == NULL)
+				return -1;
+			d->pos = tmp;
+			d->poscap = t.tfs[t.i - 1];
+		}
+		if ((np = db_cursor_positions(&t, d->pos)) == -1)
+			return -1;
+		if (db_is_deleted(c->db, t.docid))
+			continue;
+		if (fwrite(d->pos, sizeof(*d->pos), np, d->fp) != (size_t)np)
+			return -1;
+	}
+	return r;
+}
+
+/*
+ * Write all the postings of db to fp as a run for db_create_merge(),
+ * in the format of db_spill().  The deleted documents are dropped and
+ * the others numbered from base.
+ */
+int
+db_dump(FILE *fp, struct db *db, uint32_t base)
+{
+	struct db_cursor c;
+	struct idx_iter it;
+	struct dump d;
+	uint32_t i, id;
+	int r = -1;
+
+	memset(&d, 0, sizeof(d));
+	d.fp = fp;
+	if ((d.ids = calloc(db->ndocs + 1, sizeof(*d.ids))) == NULL)
+		return -1;
+	for (id = base, i = 0; i < db->ndocs; ++i) {
+		if (id == UINT32_MAX)
+			goto done;
+		d.ids[i] = id;
+		if (!db_is_deleted(db, i))
+			id++;
+	}
+
+	memset(&it, 0, sizeof(it));
+	it.db = db;
+	it.p = db->idx_start;
+	while ((r = idx_next(&it)) == 1) {
+		if (db_getdocs(db, it.off, &c) == -1 ||
+		    dump_list(&d, it.word, it.len, &c) == -1) {
+			r = -1;
+			break;
+		}
+	}
+	free(it.word);
+
+done:
+	free(d.ids);
+	free(d.ps);
+	free(d.pos);
+	return r;
+}
+
 static inline uint8_t *
 db_extract_doc(struct db *db, uint8_t *p, struct db_entry *e)
 {
@@ -318,16 +2585,31 @@ db_extract_doc(struct db *db, uint8_t *p, struct db_entry *e)
 	return p;
 }
 
+uint32_t
+db_doc_len(struct db *db, uint32_t docid)
+{
+	uint32_t l;
+
+	memcpy(&l, db->doclens + docid * sizeof(l), sizeof(l));
+	return l;
+}
+
 int
 db_listall(struct db *db, db_hit_cb cb, void *data)
 {
 	uint8_t *p = db->docs_start;
+	uint32_t i;
 
-	while (p < db->docs_end) {
+	for (i = 0; p < db->docs_end; ++i) {
 		struct db_entry e;
 
+		if (i == db->ndocs)
+			return -1;
 		if ((p = db_extract_doc(db, p, &e)) == NULL)
 			return -1;
+		if (db_is_deleted(db, i))
+			continue;
+		e.len = db_doc_len(db, i);
 
 		if (cb(db, &e, data) == -1)
 			return -1;
@@ -339,25 +2621,29 @@ db_listall(struct db *db, db_hit_cb cb, void *data)
 int
 db_doc_by_id(struct db *db, int docid, struct db_entry *e)
 {
-	uint8_t *p = db->docs_start;
-	int n = 0;
-
-	while (p < db->docs_end) {
-		if ((p = db_extract_doc(db, p, e)) == NULL)
-			return -1;
+	int64_t off;
+	uint8_t *p;
 
-		if (n == docid)
-			return 0;
+	if (docid < 0 || (uint32_t)docid >= db->ndocs ||
+	    db_is_deleted(db, docid))
+		return -1;
 
-		n++;
-	}
+	memcpy(&off, db->doctab_start + docid * sizeof(off), sizeof(off));
+	p = db->m + off;
+	if (p < db->docs_start || p >= db->docs_end)
+		return -1;
 
-	return -1;
+	if (db_extract_doc(db, p, e) == NULL)
+		return -1;
+	e->len = db_doc_len(db, docid);
+	return 0;
 }
 
 void
 db_close(struct db *db)
 {
 	munmap(db->m, db->len);
+	if (db->del_m != NULL)
+		munmap(db->del_m, db->del_len);
 	memset(db, 0, sizeof(*db));
 }
@@ -14,12 +14,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 
+#include "db.h"
 #include "dictionary.h"
+#include "tokenize.h"
 
 int
 dictionary_init(struct dictionary *dict)
@@ -28,52 +31,207 @@ dictionary_init(struct dictionary *dict)
 	return 1;
 }
 
+#define ARENA_SIZE	(1024 * 1024)
+#define CHUNK_MIN	4
+#define CHUNK_MAX	256
+
+static void *
+arena_alloc(struct dictionary *dict, size_t size)
+{
+	struct dict_arena *a;
+	void *p;
+
+	/* keep everything aligned to pointers */
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	a = dict->arena;
+	if (a == NULL || a->cap - a->len < size) {
+		if (size > ARENA_SIZE / 4) {
+			/* big allocations get their own arena */
+			if ((a = malloc(sizeof(*a) + size)) == NULL)
+				return NULL;
+			dict->mem += sizeof(*a) + size;
+			a->len = a->cap = size;
+			if (dict->arena == NULL) {
+				a->next = NULL;
+				dict->arena = a;
+			} else {
+				a->next = dict->arena->next;
+				dict->arena->next = a;
+			}
+			return a->data;
+		}
+
+		if ((a = malloc(sizeof(*a) + ARENA_SIZE)) == NULL)
+			return NULL;
+		dict->mem += sizeof(*a) + ARENA_SIZE;
+		a->len = 0;
+		a->cap = ARENA_SIZE;
+		a->next = dict->arena;
+		dict->arena = a;
+	}
+
+	p = a->data + a->len;
+	a->len += size;
+	return p;
+}
+
+static char *
+arena_strdup(struct dictionary *dict, const char *s)
+{
+	size_t len;
+	char *t;
+
+	len = strlen(s) + 1;
+	if ((t = arena_alloc(dict, len)) == NULL)
+		return NULL;
+	memcpy(t, s, len);
+	return t;
+}
+
 static inline int
-add_docid(struct dict_entry *e, int docid)
+add_pos(struct dictionary *dict, struct dict_entry *e, uint32_t pos)
 {
-	void *t;
-	size_t newcap;
+	struct dict_poschunk *c;
+	size_t cap;
 
-	if (e->len > 0 && e->ids[e->len-1] == docid)
+	c = e->ptail;
+	if (c == NULL || c->len == c->cap) {
+		cap = c == NULL ? CHUNK_MIN : c->cap * 2;
+		if (cap > CHUNK_MAX)
+			cap = CHUNK_MAX;
+		c = arena_alloc(dict, sizeof(*c) + cap * sizeof(*c->pos));
+		if (c == NULL)
+			return 0;
+		c->next = NULL;
+		c->len = 0;
+		c->cap = cap;
+
+		if (e->ptail != NULL)
+			e->ptail->next = c;
+		else
+			e->phead = c;
+		e->ptail = c;
+	}
+
+	c->pos[c->len++] = pos;
+	return 1;
+}
+
+static inline int
+add_docid(struct dictionary *dict, struct dict_entry *e, int docid)
+{
+	struct dict_chunk *c;
+	size_t cap;
+
+	c = e->tail;
+	if (c != NULL && c->ps[c->len - 1].id == (uint32_t)docid) {
+		/* there are as many positions as occurrences */
+		if (c->ps[c->len - 1].tf == UINT32_MAX)
+			return 1;
+		c->ps[c->len - 1].tf++;
+		if (dict->positions)
+			return add_pos(dict, e, dict->curpos);
 		return 1;
+	}
 
-	if (e->len == e->cap) {
-		newcap = e->cap * 1.5;
-		if (newcap == 0)
-			newcap = 8;
-		t = recallocarray(e->ids, e->cap, newcap, sizeof(*e->ids));
-		if (t == NULL)
+	if (c == NULL || c->len == c->cap) {
+		cap = c == NULL ? CHUNK_MIN : c->cap * 2;
+		if (cap > CHUNK_MAX)
+			cap = CHUNK_MAX;
+		c = arena_alloc(dict, sizeof(*c) + cap * sizeof(*c->ps));
+		if (c == NULL)
 			return 0;
-		e->ids = t;
-		e->cap = newcap;
+		c->next = NULL;
+		c->len = 0;
+		c->cap = cap;
+
+		if (e->tail != NULL)
+			e->tail->next = c;
+		else
+			e->head = c;
+		e->tail = c;
 	}
 
-	e->ids[e->len++] = docid;
+	c->ps[c->len].id = docid;
+	c->ps[c->len].tf = 1;
+	c->len++;
+	e->len++;
+	if (dict->positions)
+		return add_pos(dict, e, dict->curpos);
 	return 1;
 }
 
-int
-dictionary_add(struct dictionary *dict, const char *word, int docid)
+static inline uint32_t
+hash(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *s != '\0'; ++s) {
+		h ^= (unsigned char)*s;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static inline void
+table_insert(struct dictionary *dict, size_t i)
+{
+	size_t mask = dict->tabsize - 1, slot;
+
+	slot = dict->entries[i].hash & mask;
+	while (dict->table[slot] != 0)
+		slot = (slot + 1) & mask;
+	dict->table[slot] = i + 1;
+}
+
+static int
+table_grow(struct dictionary *dict)
 {
-	struct dict_entry *e = NULL;
+	size_t i, newsize;
+	void *t;
+
+	newsize = dict->tabsize * 2;
+	if (newsize == 0)
+		newsize = 1024;
+	if ((t = calloc(newsize, sizeof(*dict->table))) == NULL)
+		return 0;
+
+	free(dict->table);
+	dict->mem += (newsize - dict->tabsize) * sizeof(*dict->table);
+	dict->table = t;
+	dict->tabsize = newsize;
+
+	for (i = 0; i < dict->len; ++i)
+		table_insert(dict, i);
+	return 1;
+}
+
+/*
+ * Find the entry for word or add a new one.  New words are copied in
+ * the arena unless copy is zero.
+ */
+static struct dict_entry *
+lookup(struct dictionary *dict, const char *word, uint32_t h, int copy)
+{
+	struct dict_entry *e;
 	void *newentr;
-	size_t newcap, mid = 0, left = 0, right = dict->len;
-	int r = 0;
-
-	while (left < right) {
-		mid = (left + right) / 2;
-		e = &dict->entries[mid];
-		r = strcmp(word, e->word);
-		if (r < 0)
-			right = mid;
-		else if (r > 0)
-			left = mid + 1;
-		else
-			return add_docid(e, docid);
+	size_t newcap, mask, slot;
+
+	mask = dict->tabsize - 1;
+	for (slot = h & mask; dict->tabsize != 0 && dict->table[slot] != 0;
+	    slot = (slot + 1) & mask) {
+		e = &dict->entries[dict->table[slot] - 1];
+		if (e->hash == h && !strcmp(e->word, word))
+			return e;
 	}
 
-	if (r > 0)
-		mid++;
+	if (dict->len >= UINT32_MAX - 1)
+		return NULL;
+
+	/* keep the load factor under 1/2 */
+	if ((dict->len + 1) * 2 > dict->tabsize && !table_grow(dict))
+		return NULL;
 
 	if (dict->len == dict->cap) {
 		newcap = dict->cap * 1.5;
@@ -82,44 +240,174 @@ dictionary_add(struct dictionary *dict, const char *word, int docid)
 		newentr = recallocarray(dict->entries, dict->cap, newcap,
 		    sizeof(*dict->entries));
 		if (newentr == NULL)
-			return 0;
+			return NULL;
+		dict->mem += (newcap - dict->cap) * sizeof(*dict->entries);
 		dict->entries = newentr;
 		dict->cap = newcap;
 	}
 
-	e = &dict->entries[mid];
-	if (e != dict->entries + dict->len) {
-		size_t i = e - dict->entries;
-		memmove(e+1, e, sizeof(*e) * (dict->len - i));
-	}
-
-	dict->len++;
+	e = &dict->entries[dict->len];
 	memset(e, 0, sizeof(*e));
-	if ((e->word = strdup(word)) == NULL)
+	if (!copy)
+		e->word = (char *)word;
+	else if ((e->word = arena_strdup(dict, word)) == NULL)
+		return NULL;
+	e->hash = h;
+	table_insert(dict, dict->len++);
+	return e;
+}
+
+int
+dictionary_add(struct dictionary *dict, const char *word, int docid)
+{
+	struct dict_entry *e;
+	int r;
+
+	if ((e = lookup(dict, word, hash(word), 1)) == NULL)
 		return 0;
-	return add_docid(e, docid);
+
+	/* the words of a document are all added in a row */
+	if (dict->curdoc != (uint32_t)docid) {
+		dict->curdoc = docid;
+		dict->curpos = 0;
+	}
+
+	dict->ntokens++;
+	r = add_docid(dict, e, docid);
+	dict->curpos++;
+	return r;
 }
 
+/*
+ * Move the postings of src at the end of the ones in dst: all the
+ * documents in src must come after the ones in dst.  The lists are
+ * spliced, not copied, and dst takes the ownership of the arenas of
+ * src, which can only be freed afterwards.
+ */
 int
-dictionary_add_words(struct dictionary *dict, char **words, int docid)
+dictionary_append(struct dictionary *dst, struct dictionary *src)
 {
-	for (; *words != NULL; ++words) {
-		if (!dictionary_add(dict, *words, docid))
+	struct dict_entry *e, *s;
+	struct dict_arena *a;
+	size_t i;
+
+	for (i = 0; i < src->len; ++i) {
+		s = &src->entries[i];
+		if ((e = lookup(dst, s->word, s->hash, 0)) == NULL)
 			return 0;
+
+		if (e->tail == NULL)
+			e->head = s->head;
+		else
+			e->tail->next = s->head;
+		e->tail = s->tail;
+		e->len += s->len;
+
+		if (s->phead == NULL)
+			continue;
+		if (e->ptail == NULL)
+			e->phead = s->phead;
+		else
+			e->ptail->next = s->phead;
+		e->ptail = s->ptail;
 	}
 
+	if ((a = src->arena) != NULL) {
+		for (;;) {
+			dst->mem += sizeof(*a) + a->cap;
+			if (a->next == NULL)
+				break;
+			a = a->next;
+		}
+		if (dst->arena == NULL)
+			dst->arena = src->arena;
+		else {
+			/* keep allocating from the current arena of dst */
+			a->next = dst->arena->next;
+			dst->arena->next = src->arena;
+		}
+		src->arena = NULL;
+	}
+
+	src->len = 0;
 	return 1;
 }
 
+struct add_words {
+	struct dictionary	*dict;
+	int			 docid;
+};
+
+static int
+add_word(const char *word, size_t len, void *data)
+{
+	struct add_words *aw = data;
+
+	if (!dictionary_add(aw->dict, word, aw->docid))
+		return -1;
+	return 0;
+}
+
+/* add every word in the len bytes at s */
+int
+dictionary_add_words(struct dictionary *dict, const char *s, size_t len,
+    int docid)
+{
+	struct add_words aw;
+
+	aw.dict = dict;
+	aw.docid = docid;
+	return tokenize(s, len, add_word, &aw) == 0;
+}
+
+/*
+ * Start a new field of the document: the positions of the words added
+ * next don't follow the ones before.
+ */
 void
-dictionary_free(struct dictionary *dict)
+dictionary_field(struct dictionary *dict, int docid)
+{
+	if (dict->curdoc == (uint32_t)docid && dict->curpos != 0)
+		dict->curpos += DB_FIELDGAP;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct dict_entry *x = a, *y = b;
+
+	return strcmp(x->word, y->word);
+}
+
+/*
+ * Sort the entries by word, as db_create() expects them.  The hash
+ * table is rebuilt so the dictionary can still be used.
+ */
+void
+dictionary_sort(struct dictionary *dict)
 {
 	size_t i;
 
-	for (i = 0; i < dict->len; ++i) {
-		free(dict->entries[i].word);
-		free(dict->entries[i].ids);
+	if (dict->len == 0)
+		return;
+
+	qsort(dict->entries, dict->len, sizeof(*dict->entries), entry_cmp);
+
+	memset(dict->table, 0, dict->tabsize * sizeof(*dict->table));
+	for (i = 0; i < dict->len; ++i)
+		table_insert(dict, i);
+}
+
+void
+dictionary_free(struct dictionary *dict)
+{
+	struct dict_arena *a, *t;
+
+	for (a = dict->arena; a != NULL; a = t) {
+		t = a->next;
+		free(a);
 	}
 
 	free(dict->entries);
+	free(dict->table);
 }
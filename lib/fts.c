@@ -14,84 +14,2484 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/queue.h>
+
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
+#include "cache.h"
 #include "db.h"
 #include "fts.h"
+#include "intersect.h"
+#include "segments.h"
 #include "tokenize.h"
 
-struct doclist {
-	uint32_t	*ids;
-	size_t		 len;
+/*
+ * Lists up to this many times longer than the current result are
+ * decoded and merged with intersect(), longer ones are probed with
+ * db_cursor_seek().
+ */
+#define MERGE_RATIO	32
+
+/* prefixes matching up to this many words are merged with a heap */
+#define UNION_HEAP	16
+
+/*
+ * Words in at least one document every DENSE_RATIO are intersected as
+ * bitmaps: their blocks are likely stored as such.
+ */
+#define DENSE_RATIO	8
+
+/* how deep the parentheses of a query can nest */
+#define MAX_DEPTH	64
+
+/* keep only the ids that are also in c */
+static int
+gallop(struct db_cursor *c, uint32_t *ids, size_t *len)
+{
+	size_t i, n = 0;
+	int r;
+
+	if ((r = db_cursor_next(c)) != 1)
+		goto end;
+
+	for (i = 0; i < *len; ++i) {
+		if ((r = db_cursor_seek(c, ids[i])) != 1)
+			break;
+		if (c->docid == ids[i])
+			ids[n++] = ids[i];
+	}
+
+end:
+	*len = n;
+	return r == -1 ? -1 : 0;
+}
+
+/* same as gallop() for the ids of a union */
+static void
+gallop_ids(const uint32_t *b, size_t nb, uint32_t *ids, size_t *len)
+{
+	size_t i, j = 0, n = 0, lo, hi, mid, step;
+
+	for (i = 0; i < *len; ++i) {
+		/* the first id not smaller than ids[i] is in [lo, hi] */
+		lo = j;
+		hi = j + 1;
+		for (step = 2; hi < nb && b[hi] < ids[i]; step *= 2) {
+			lo = hi;
+			hi = lo + step;
+		}
+		if (hi > nb)
+			hi = nb;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (b[mid] < ids[i])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if ((j = lo) == nb)
+			break;
+		if (b[j] == ids[i])
+			ids[n++] = ids[i];
+	}
+
+	*len = n;
+}
+
+/* a word of a phrase and its positions in the current document */
+struct phrase_word {
+	struct db_cursor	 c;
+	uint32_t		*pos;
+	size_t			 npos;
+	size_t			 cap;
+	size_t			 j;
 };
 
-int
-fts(struct db *db, const char *query, db_hit_cb cb, void *data)
+struct phrase {
+	struct phrase_word	*ws;
+	size_t			 len;
+	size_t			 cap;
+};
+
+enum {
+	N_WORD,
+	N_IDS,			/* a prefix or a cached word */
+	N_PHRASE,
+	N_AND,
+	N_OR,
+	N_NOT,
+};
+
+/*
+ * A node of the query tree.  The leaves are the words, with their
+ * posting list, and the prefixes, with the union of the lists of all
+ * their words.  ndocs is the length of the result for the leaves and
+ * an upper bound for the other nodes.
+ */
+struct node {
+	int			 type;
+	struct node		**kids;
+	size_t			 nkids;
+	size_t			 cap;
+	size_t			 ndocs;
+
+	struct db_cursor	 c;		/* N_WORD */
+	uint32_t		*ids;		/* N_IDS */
+	struct cache		*cache;		/* where ids comes from */
+	struct cache_entry	*ce;
+	struct phrase		 ph;		/* N_PHRASE */
+};
+
+struct fts_ctx {
+	struct db		*db;
+	struct cache		 terms;
+	struct cache		 results;
+};
+
+enum {
+	T_END,
+	T_WORDS,
+	T_AND,
+	T_OR,
+	T_NOT,
+	T_LPAREN,
+	T_RPAREN,
+	T_QUOTE,
+};
+
+struct scorers;
+
+struct parser {
+	struct db		*db;
+	struct fts_ctx		*ctx;
+	struct scorers		*sc;		/* the words to rank by */
+	const char		*p;
+	struct node		*dst;		/* where the words go */
+	char			*word;		/* last word seen */
+	size_t			 wcap;
+	int			 pending;
+	int			 neg;		/* under an odd number of NOT */
+	int			 depth;		/* of the parentheses */
+};
+
+/* the NOTs go last, the other nodes from the shortest */
+static int
+node_cmp(const void *a, const void *b)
 {
-	struct doclist *xs = NULL;
-	size_t i, len;
-	char **toks, **t;
-	int ret = 0;
+	const struct node *x = *(struct node * const *)a;
+	const struct node *y = *(struct node * const *)b;
 
-	if ((toks = tokenize(query)) == NULL)
+	if ((x->type == N_NOT) != (y->type == N_NOT))
+		return x->type == N_NOT ? 1 : -1;
+	if (x->ndocs < y->ndocs)
 		return -1;
+	return x->ndocs > y->ndocs;
+}
+
+static uint32_t *
+ids_alloc(size_t n)
+{
+	return calloc(n != 0 ? n : 1, sizeof(uint32_t));
+}
 
-	len = 0;
-	for (t = toks; *t != NULL; ++t)
-		len++;
+struct lists {
+	struct db_cursor	*cs;
+	size_t			 len;
+	size_t			 cap;
+	size_t			 total;
+};
 
-	if (len == 0)
-		goto done;
+static int
+add_list(struct db *db, const char *word, struct db_cursor *c, void *data)
+{
+	struct lists *l = data;
+	size_t newcap;
+	void *t;
+
+	if (c->ndocs == 0)
+		return 0;
+
+	if (l->len == l->cap) {
+		newcap = l->cap * 1.5;
+		if (newcap == 0)
+			newcap = 8;
+		t = reallocarray(l->cs, newcap, sizeof(*l->cs));
+		if (t == NULL)
+			return -1;
+		l->cs = t;
+		l->cap = newcap;
+	}
+
+	l->cs[l->len++] = *c;
+	l->total += c->ndocs;
+	return 0;
+}
+
+static void
+heap_down(struct db_cursor **h, size_t n, size_t i)
+{
+	struct db_cursor *t;
+	size_t c;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && h[c + 1]->docid < h[c]->docid)
+			c++;
+		if (h[i]->docid <= h[c]->docid)
+			break;
+		t = h[i];
+		h[i] = h[c];
+		h[c] = t;
+	}
+}
+
+/* merge the lists with a min-heap of their current documents */
+static int
+union_heap(struct lists *l, uint32_t *out, size_t cap, size_t *len)
+{
+	struct db_cursor **h;
+	size_t i, n = 0;
+	uint32_t d;
+	int r, ret = -1;
 
-	if ((xs = calloc(len, sizeof(*xs))) == NULL) {
-		freetoks(toks);
+	if ((h = calloc(l->len, sizeof(*h))) == NULL)
 		return -1;
+
+	for (i = 0; i < l->len; ++i) {
+		if ((r = db_cursor_next(&l->cs[i])) == -1)
+			goto done;
+		if (r == 1)
+			h[n++] = &l->cs[i];
 	}
+	for (i = n / 2; i > 0; --i)
+		heap_down(h, n, i - 1);
 
-	for (i = 0; i < len; ++i) {
-		xs[i].ids = db_word_docs(db, toks[i], &xs[i].len);
-		if (xs[i].ids == NULL || xs[i].len == 0)
+	*len = 0;
+	while (n > 0) {
+		d = h[0]->docid;
+		if (*len == 0 || out[*len - 1] != d) {
+			if (*len == cap)
+				goto done;
+			out[(*len)++] = d;
+		}
+
+		if ((r = db_cursor_next(h[0])) == -1)
 			goto done;
+		if (r == 0)
+			h[0] = h[--n];
+		heap_down(h, n, 0);
 	}
+	ret = 0;
 
-	for (;;) {
-		struct db_entry e;
-		uint32_t mdoc;
-
-		mdoc = xs[0].ids[0];
-		for (i = 1; i < len; ++i) {
-			if (xs[i].ids[0] > mdoc)
-				goto next;
-			while (xs[i].ids[0] < mdoc) {
-				if (--xs[i].len == 0)
-					goto done;
-				xs[i].ids++;
+done:
+	free(h);
+	return ret;
+}
+
+/* decode every list and set its documents in a bitmap */
+static int
+union_bitmap(struct db *db, struct lists *l, uint32_t *out, size_t *len)
+{
+	uint32_t *bits, *ids, w;
+	size_t i, j, nbits, longest = 0;
+	int ret = -1;
+
+	for (i = 0; i < l->len; ++i)
+		if (l->cs[i].ndocs > longest)
+			longest = l->cs[i].ndocs;
+
+	nbits = (db->ndocs + 31) / 32;
+	if ((bits = calloc(nbits, sizeof(*bits))) == NULL)
+		return -1;
+	if ((ids = calloc(longest, sizeof(*ids))) == NULL)
+		goto done;
+
+	for (i = 0; i < l->len; ++i) {
+		if (db_cursor_readall(&l->cs[i], ids) == -1)
+			goto done;
+		for (j = 0; j < l->cs[i].ndocs; ++j) {
+			if (ids[j] >= db->ndocs)
+				goto done;
+			bits[ids[j] / 32] |= 1U << (ids[j] % 32);
+		}
+	}
+
+	*len = 0;
+	for (i = 0; i < nbits; ++i)
+		for (w = bits[i]; w != 0; w &= w - 1)
+			out[(*len)++] = i * 32 + ffs(w) - 1;
+	ret = 0;
+
+done:
+	free(ids);
+	free(bits);
+	return ret;
+}
+
+/*
+ * Collect the documents of all the words starting with prefix.  A few
+ * lists, or lists too short to make it worth to scan a bitmap of all
+ * the documents, are merged with a heap.
+ */
+static int
+prefix_union(struct db *db, const char *prefix, struct node *n)
+{
+	struct lists l;
+	size_t cap;
+	int r;
+
+	memset(&l, 0, sizeof(l));
+	if (db_prefix_words(db, prefix, add_list, &l) == -1) {
+		free(l.cs);
+		return -1;
+	}
+
+	if (l.len == 0) {
+		free(l.cs);
+		return 0;
+	}
+
+	cap = l.total < db->ndocs ? l.total : db->ndocs;
+	if ((n->ids = calloc(cap, sizeof(*n->ids))) == NULL) {
+		free(l.cs);
+		return -1;
+	}
+
+	if (l.len == 1) {
+		r = db_cursor_readall(&l.cs[0], n->ids);
+		n->ndocs = l.cs[0].ndocs;
+	} else if (l.len <= UNION_HEAP || l.total < db->ndocs / 32)
+		r = union_heap(&l, n->ids, cap, &n->ndocs);
+	else
+		r = union_bitmap(db, &l, n->ids, &n->ndocs);
+
+	free(l.cs);
+	return r;
+}
+
+static int
+add_phrase_word(struct db *db, struct phrase *ph, const char *word)
+{
+	struct phrase_word *w;
+	size_t newcap;
+	void *t;
+
+	if (ph->len == ph->cap) {
+		newcap = ph->cap * 1.5;
+		if (newcap == 0)
+			newcap = 4;
+		t = recallocarray(ph->ws, ph->cap, newcap, sizeof(*ph->ws));
+		if (t == NULL)
+			return -1;
+		ph->ws = t;
+		ph->cap = newcap;
+	}
+
+	w = &ph->ws[ph->len];
+	if (db_word_docs(db, word, &w->c) == -1)
+		return -1;
+	w->c.withtf = 1;
+	if (db_cursor_next(&w->c) != 1)
+		return -1;
+	ph->len++;
+	return 0;
+}
+
+static void
+node_free(struct node *n)
+{
+	size_t i;
+
+	if (n == NULL)
+		return;
+
+	for (i = 0; i < n->nkids; ++i)
+		node_free(n->kids[i]);
+	free(n->kids);
+	if (n->ce != NULL)
+		cache_release(n->cache, n->ce);
+	else
+		free(n->ids);
+
+	for (i = 0; i < n->ph.len; ++i)
+		free(n->ph.ws[i].pos);
+	free(n->ph.ws);
+	free(n);
+}
+
+static int
+node_add(struct node *n, struct node *kid)
+{
+	size_t newcap;
+	void *t;
+
+	if (n->nkids == n->cap) {
+		newcap = n->cap * 1.5;
+		if (newcap == 0)
+			newcap = 4;
+		t = reallocarray(n->kids, newcap, sizeof(*n->kids));
+		if (t == NULL)
+			return -1;
+		n->kids = t;
+		n->cap = newcap;
+	}
+
+	n->kids[n->nkids++] = kid;
+	return 0;
+}
+
+/*
+ * Drop the nodes left without children and replace those with only
+ * one by the child.
+ */
+static struct node *
+node_simplify(struct node *n)
+{
+	struct node *kid;
+
+	if (n->nkids > 1 || n->type == N_NOT)
+		return n;
+
+	kid = n->nkids == 1 ? n->kids[0] : NULL;
+	n->nkids = 0;
+	node_free(n);
+	return kid;
+}
+
+/*
+ * With a context, the lists of the words longer than a block are
+ * decoded once and kept in its cache, as are the unions of the
+ * prefixes.
+ */
+static int
+cached_leaf(struct parser *ps, struct node *n, const char *word, int prefix)
+{
+	struct cache *c = &ps->ctx->terms;
+	struct cache_entry *e;
+	uint32_t *ids;
+	size_t len;
+	char *key = NULL;
+
+	if (!prefix) {
+		if (db_word_docs(ps->db, word, &n->c) == -1)
+			return 0;
+		n->ndocs = n->c.ndocs;
+		if (n->ndocs < DB_BLOCKLEN)
+			return 0;
+	} else if (asprintf(&key, "%s*", word) == -1)
+		return -1;
+
+	if ((e = cache_get(c, key != NULL ? key : word)) == NULL) {
+		if (prefix) {
+			if (prefix_union(ps->db, word, n) == -1) {
+				free(key);
+				return -1;
 			}
+			ids = n->ids;
+			len = n->ndocs;
+			n->ids = NULL;
+		} else {
+			len = n->ndocs;
+			if ((ids = ids_alloc(len)) == NULL)
+				return -1;
+			if (db_cursor_readall(&n->c, ids) == -1) {
+				free(ids);
+				return -1;
+			}
+		}
 
-			if (xs[i].ids[0] != mdoc)
-				goto next;
+		e = cache_put(c, key != NULL ? key : word, ids, len);
+		if (e == NULL) {
+			free(key);
+			return -1;
 		}
+	}
+	free(key);
 
-		if (db_doc_by_id(db, mdoc, &e) == -1) {
-			ret = -1;
-			goto done;
+	n->type = N_IDS;
+	n->cache = c;
+	n->ce = e;
+	n->ids = e->ids;
+	n->ndocs = e->len;
+	return 0;
+}
+
+static int	add_scorer(const char *, size_t, void *);
+
+/* a word not in the index is a leaf without documents */
+static int
+add_word(struct parser *ps, const char *word, int prefix)
+{
+	struct node *n;
+
+	if (ps->sc != NULL && !prefix && !ps->neg &&
+	    add_scorer(word, strlen(word), ps->sc) == -1)
+		return -1;
+
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		return -1;
+	n->type = prefix ? N_IDS : N_WORD;
+
+	if (ps->ctx != NULL) {
+		if (cached_leaf(ps, n, word, prefix) == -1) {
+			node_free(n);
+			return -1;
+		}
+	} else if (prefix) {
+		if (prefix_union(ps->db, word, n) == -1) {
+			node_free(n);
+			return -1;
 		}
+	} else if (db_word_docs(ps->db, word, &n->c) == 0)
+		n->ndocs = n->c.ndocs;
 
-		if (cb(db, &e, data) == -1) {
-			ret = -1;
-			goto done;
+	if (node_add(ps->dst, n) == -1) {
+		node_free(n);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Every word is added only once the next one is found, so the last of
+ * a run can still turn out to be a prefix.
+ */
+static int
+push_word(const char *word, size_t len, void *data)
+{
+	struct parser *ps = data;
+	void *t;
+
+	if (ps->pending && add_word(ps, ps->word, 0) == -1)
+		return -1;
+
+	if (len >= ps->wcap) {
+		if ((t = realloc(ps->word, len + 1)) == NULL)
+			return -1;
+		ps->word = t;
+		ps->wcap = len + 1;
+	}
+	memcpy(ps->word, word, len + 1);
+	ps->pending = 1;
+	return 0;
+}
+
+static int
+is_word(const char *word, size_t len, void *data)
+{
+	*(int *)data = 1;
+	return 0;
+}
+
+/*
+ * Add to dst the words in the len bytes at s.  A word directly
+ * followed by a star stands for all the words starting with it.
+ */
+static int
+add_words(struct parser *ps, struct node *dst, const char *s, size_t len)
+{
+	const char *q;
+	size_t n;
+	int prefix;
+
+	ps->dst = dst;
+	while (len > 0) {
+		if ((q = memchr(s, '*', len)) != NULL)
+			n = q - s;
+		else
+			n = len;
+
+		if (tokenize(s, n, push_word, ps) == -1)
+			return -1;
+		if (ps->pending) {
+			prefix = 0;
+			if (q != NULL && n > 0)
+				tokenize(q - 1, 1, is_word, &prefix);
+			ps->pending = 0;
+			if (add_word(ps, ps->word, prefix) == -1)
+				return -1;
 		}
 
-	next:
-		if (--xs[0].len == 0)
-			goto done;
-		xs[0].ids++;
+		if (q == NULL)
+			break;
+		s = q + 1;
+		len -= n + 1;
 	}
 
-done:
-	free(xs);
-	freetoks(toks);
+	return 0;
+}
+
+static int
+add_phrase(const char *word, size_t len, void *data)
+{
+	struct parser *ps = data;
+	struct node *ph = ps->dst, *w;
+
+	/* longer phrases could match across the fields of a document */
+	if (ph->nkids == DB_FIELDGAP)
+		return -1;
+	if (add_word(ps, word, 0) == -1)
+		return -1;
+
+	/* without one of the words there's no need for the positions */
+	w = ph->kids[ph->nkids - 1];
+	if (w->ndocs == 0)
+		return 0;
+	return add_phrase_word(ps->db, &ph->ph, word);
+}
+
+/* the next token, which is consumed by moving ps->p past it */
+static int
+lex(struct parser *ps, const char **tok, size_t *len)
+{
+	const char *p;
+
+	p = ps->p + strspn(ps->p, " \t\n");
+	*tok = p;
+	*len = 1;
+
+	switch (*p) {
+	case '\0':
+		*len = 0;
+		return T_END;
+	case '(':
+		return T_LPAREN;
+	case ')':
+		return T_RPAREN;
+	case '"':
+		return T_QUOTE;
+	case '-':
+		return T_NOT;
+	}
+
+	*len = strcspn(p, " \t\n()\"");
+	if (*len == 3 && !strncmp(p, "AND", 3))
+		return T_AND;
+	if (*len == 2 && !strncmp(p, "OR", 2))
+		return T_OR;
+	if (*len == 3 && !strncmp(p, "NOT", 3))
+		return T_NOT;
+	return T_WORDS;
+}
+
+static int	parse_or(struct parser *, struct node **);
+
+static int
+parse_primary(struct parser *ps, struct node *dst)
+{
+	struct node *n;
+	const char *tok, *end;
+	size_t len;
+
+	switch (lex(ps, &tok, &len)) {
+	case T_LPAREN:
+		if (ps->depth == MAX_DEPTH)
+			return -1;
+		ps->p = tok + len;
+		ps->depth++;
+		if (parse_or(ps, &n) == -1)
+			return -1;
+		if (lex(ps, &tok, &len) != T_RPAREN) {
+			node_free(n);
+			return -1;
+		}
+		ps->p = tok + len;
+		ps->depth--;
+		if (n != NULL && node_add(dst, n) == -1) {
+			node_free(n);
+			return -1;
+		}
+		return 0;
+
+	case T_QUOTE:
+		/* the words between double quotes form a phrase */
+		ps->p = tok + len;
+		if ((end = strchr(ps->p, '"')) == NULL)
+			end = ps->p + strlen(ps->p);
+		if (memchr(ps->p, '*', end - ps->p) != NULL)
+			return -1;
+		if ((n = calloc(1, sizeof(*n))) == NULL)
+			return -1;
+		n->type = N_PHRASE;
+		ps->dst = n;
+		if (tokenize(ps->p, end - ps->p, add_phrase, ps) == -1) {
+			node_free(n);
+			return -1;
+		}
+		ps->p = *end == '"' ? end + 1 : end;
+		if ((n = node_simplify(n)) != NULL &&
+		    node_add(dst, n) == -1) {
+			node_free(n);
+			return -1;
+		}
+		return 0;
+
+	case T_WORDS:
+		ps->p = tok + len;
+		return add_words(ps, dst, tok, len);
+
+	default:
+		/* nothing here, let the caller deal with the token */
+		return 0;
+	}
+}
+
+/* a run of NOTs cancels out in pairs */
+static int
+parse_unary(struct parser *ps, struct node *dst)
+{
+	struct node *n, *and;
+	const char *tok;
+	size_t len;
+	int neg = 0;
+
+	while (lex(ps, &tok, &len) == T_NOT) {
+		ps->p = tok + len;
+		neg = !neg;
+	}
+	if (!neg)
+		return parse_primary(ps, dst);
+
+	if ((and = calloc(1, sizeof(*and))) == NULL)
+		return -1;
+	and->type = N_AND;
+	ps->neg = !ps->neg;
+	if (parse_primary(ps, and) == -1) {
+		node_free(and);
+		return -1;
+	}
+	ps->neg = !ps->neg;
+	if ((and = node_simplify(and)) == NULL)
+		return 0;
+
+	if ((n = calloc(1, sizeof(*n))) == NULL) {
+		node_free(and);
+		return -1;
+	}
+	n->type = N_NOT;
+	if (node_add(n, and) == -1) {
+		node_free(and);
+		node_free(n);
+		return -1;
+	}
+	if (node_add(dst, n) == -1) {
+		node_free(n);
+		return -1;
+	}
+	return 0;
+}
+
+/* the words next to each other are implicitly joined by AND */
+static int
+parse_and(struct parser *ps, struct node **np)
+{
+	struct node *n;
+	const char *tok;
+	size_t len;
+	int t;
+
+	*np = NULL;
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		return -1;
+	n->type = N_AND;
+
+	for (;;) {
+		t = lex(ps, &tok, &len);
+		if (t == T_END || t == T_OR || t == T_RPAREN)
+			break;
+		if (t == T_AND) {
+			ps->p = tok + len;
+			continue;
+		}
+		if (parse_unary(ps, n) == -1) {
+			node_free(n);
+			return -1;
+		}
+	}
+
+	*np = node_simplify(n);
+	return 0;
+}
+
+static int
+parse_or(struct parser *ps, struct node **np)
+{
+	struct node *n, *and;
+	const char *tok;
+	size_t len;
+
+	*np = NULL;
+	if ((n = calloc(1, sizeof(*n))) == NULL)
+		return -1;
+	n->type = N_OR;
+
+	for (;;) {
+		if (parse_and(ps, &and) == -1) {
+			node_free(n);
+			return -1;
+		}
+		if (and != NULL && node_add(n, and) == -1) {
+			node_free(and);
+			node_free(n);
+			return -1;
+		}
+
+		if (lex(ps, &tok, &len) != T_OR)
+			break;
+		ps->p = tok + len;
+	}
+
+	*np = node_simplify(n);
+	return 0;
+}
+
+/* compute the bounds of the nodes from those of the leaves */
+static void
+node_cost(struct db *db, struct node *n)
+{
+	size_t i;
+
+	for (i = 0; i < n->nkids; ++i)
+		node_cost(db, n->kids[i]);
+
+	switch (n->type) {
+	case N_PHRASE:
+	case N_AND:
+		n->ndocs = db->ndocs;
+		for (i = 0; i < n->nkids; ++i)
+			if (n->kids[i]->ndocs < n->ndocs)
+				n->ndocs = n->kids[i]->ndocs;
+		break;
+	case N_OR:
+		n->ndocs = 0;
+		for (i = 0; i < n->nkids; ++i)
+			n->ndocs += n->kids[i]->ndocs;
+		if (n->ndocs > db->ndocs)
+			n->ndocs = db->ndocs;
+		break;
+	case N_NOT:
+		n->ndocs = db->ndocs - n->kids[0]->ndocs;
+		break;
+	}
+}
+
+/*
+ * Build the tree for the query.  OR has a lower precedence than AND,
+ * which is implied between words, and NOT, or a dash, negates the
+ * term that follows it.  Parentheses group terms, up to MAX_DEPTH
+ * levels.  If sc is not NULL the words that are not negated are added
+ * to it too.
+ */
+static int
+parse_query(struct db *db, struct fts_ctx *ctx, struct scorers *sc,
+    const char *query, struct node **np)
+{
+	struct parser ps;
+	const char *tok;
+	size_t len;
+	int r;
+
+	memset(&ps, 0, sizeof(ps));
+	ps.db = db;
+	ps.ctx = ctx;
+	ps.sc = sc;
+	ps.p = query;
+
+	r = parse_or(&ps, np);
+	free(ps.word);
+	if (r == -1)
+		return -1;
 
+	/* unbalanced parentheses */
+	if (lex(&ps, &tok, &len) != T_END) {
+		node_free(*np);
+		*np = NULL;
+		return -1;
+	}
+
+	if (*np != NULL)
+		node_cost(db, *np);
+	return 0;
+}
+
+/*
+ * Check whether the phrase is in the document, which contains all its
+ * words.  Returns 1 if it is, 0 if not or -1 on error.
+ */
+static int
+phrase_match(struct phrase *ph, uint32_t docid)
+{
+	struct phrase_word *w;
+	uint32_t p, tf;
+	size_t i, k;
+	void *t;
+
+	for (i = 0; i < ph->len; ++i) {
+		w = &ph->ws[i];
+		if (db_cursor_seek(&w->c, docid) != 1 || w->c.docid != docid)
+			return -1;
+
+		tf = w->c.tfs[w->c.i - 1];
+		if (tf > w->cap) {
+			t = reallocarray(w->pos, tf, sizeof(*w->pos));
+			if (t == NULL)
+				return -1;
+			w->pos = t;
+			w->cap = tf;
+		}
+		if (db_cursor_positions(&w->c, w->pos) == -1)
+			return -1;
+		w->npos = tf;
+		w->j = 0;
+	}
+
+	/* look for a position p of the first word with word i at p+i */
+	for (k = 0; k < ph->ws[0].npos; ++k) {
+		p = ph->ws[0].pos[k];
+		for (i = 1; i < ph->len; ++i) {
+			w = &ph->ws[i];
+			while (w->j < w->npos && w->pos[w->j] < p + i)
+				w->j++;
+			if (w->j == w->npos)
+				return 0;
+			if (w->pos[w->j] != p + i)
+				break;
+		}
+		if (i == ph->len)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int	eval(struct db *, struct node *, const uint32_t *, size_t,
+		    uint32_t **, size_t *);
+
+static inline int
+is_dense(struct db *db, struct node *n)
+{
+	return n->type == N_WORD && n->ndocs >= DB_BLOCKLEN &&
+	    n->ndocs >= db->ndocs / DENSE_RATIO;
+}
+
+/* the documents of a leaf as a bitmap */
+static uint32_t *
+leaf_bitmap(struct db *db, struct node *n)
+{
+	uint32_t *bits;
+
+	if ((bits = ids_alloc((db->ndocs + 31) / 32)) == NULL)
+		return NULL;
+	if (db_cursor_bitmap(&n->c, bits) == -1) {
+		free(bits);
+		return NULL;
+	}
+	return bits;
+}
+
+/*
+ * The documents of a leaf that are also in cand.  The lists much
+ * longer than cand are probed, the others decoded and merged.
+ */
+static int
+eval_leaf(struct db *db, struct node *n, const uint32_t *cand,
+    size_t ncand, uint32_t **out, size_t *len)
+{
+	uint32_t *res, *tmp, *bits;
+	size_t i, m, cap;
+
+	if (n->ndocs == 0 || (cand != NULL && ncand == 0))
+		return 0;
+
+	if (cand == NULL) {
+		if ((res = ids_alloc(n->ndocs)) == NULL)
+			return -1;
+		if (n->type == N_IDS)
+			memcpy(res, n->ids, n->ndocs * sizeof(*res));
+		else if (db_cursor_readall(&n->c, res) == -1) {
+			free(res);
+			return -1;
+		}
+		*out = res;
+		*len = n->ndocs;
+		return 0;
+	}
+
+	if (n->ndocs / ncand >= MERGE_RATIO) {
+		if ((res = ids_alloc(ncand)) == NULL)
+			return -1;
+		memcpy(res, cand, ncand * sizeof(*res));
+		*len = ncand;
+		if (n->type == N_IDS)
+			gallop_ids(n->ids, n->ndocs, res, len);
+		else if (gallop(&n->c, res, len) == -1) {
+			free(res);
+			return -1;
+		}
+		*out = res;
+		return 0;
+	}
+
+	if (is_dense(db, n)) {
+		if ((res = ids_alloc(ncand)) == NULL)
+			return -1;
+		if ((bits = leaf_bitmap(db, n)) == NULL) {
+			free(res);
+			return -1;
+		}
+		for (i = 0, m = 0; i < ncand; ++i)
+			if (cand[i] < db->ndocs &&
+			    bits[cand[i] / 32] & (1U << (cand[i] % 32)))
+				res[m++] = cand[i];
+		free(bits);
+		*out = res;
+		*len = m;
+		return 0;
+	}
+
+	cap = ncand > n->ndocs ? ncand : n->ndocs;
+	if ((res = ids_alloc(cap)) == NULL)
+		return -1;
+	if (n->type == N_IDS)
+		*len = intersect(res, cand, ncand, n->ids, n->ndocs);
+	else {
+		if ((tmp = ids_alloc(n->ndocs)) == NULL ||
+		    db_cursor_readall(&n->c, tmp) == -1) {
+			free(tmp);
+			free(res);
+			return -1;
+		}
+		*len = intersect(res, cand, ncand, tmp, n->ndocs);
+		free(tmp);
+	}
+	*out = res;
+	return 0;
+}
+
+/*
+ * AND the bitmaps of the dense words at the start of the kids, and
+ * return the documents left and how many kids were consumed.
+ */
+static int
+and_dense(struct db *db, struct node *n, uint32_t **out, size_t *len,
+    size_t *used)
+{
+	uint32_t *acc, *bits, *res, w;
+	size_t i, j, nw, m;
+
+	nw = (db->ndocs + 31) / 32;
+	if ((acc = leaf_bitmap(db, n->kids[0])) == NULL)
+		return -1;
+	for (i = 1; i < n->nkids && is_dense(db, n->kids[i]); ++i) {
+		if ((bits = leaf_bitmap(db, n->kids[i])) == NULL) {
+			free(acc);
+			return -1;
+		}
+		for (j = 0; j < nw; ++j)
+			acc[j] &= bits[j];
+		free(bits);
+	}
+	*used = i;
+
+	for (m = 0, j = 0; j < nw; ++j)
+		m += __builtin_popcount(acc[j]);
+	if ((res = ids_alloc(m)) == NULL) {
+		free(acc);
+		return -1;
+	}
+	for (m = 0, j = 0; j < nw; ++j)
+		for (w = acc[j]; w != 0; w &= w - 1)
+			res[m++] = j * 32 + ffs(w) - 1;
+
+	free(acc);
+	*out = res;
+	*len = m;
+	return 0;
+}
+
+/*
+ * Without candidates, the documents matched by none of the terms of
+ * the NOTs, in one pass over a bitmap of all of them.
+ */
+static int
+eval_nots(struct db *db, struct node **nots, size_t nnots, uint32_t **out,
+    size_t *len)
+{
+	struct node *kid;
+	uint32_t *bits, *x, *res, w, id;
+	size_t i, j, nw, m, nx;
+
+	nw = (db->ndocs + 31) / 32;
+	if ((bits = ids_alloc(nw)) == NULL)
+		return -1;
+
+	for (i = 0; i < nnots; ++i) {
+		kid = nots[i]->kids[0];
+		if (is_dense(db, kid)) {
+			if ((x = leaf_bitmap(db, kid)) == NULL)
+				goto err;
+			for (j = 0; j < nw; ++j)
+				bits[j] |= x[j];
+			free(x);
+			continue;
+		}
+
+		if (eval(db, kid, NULL, 0, &x, &nx) == -1)
+			goto err;
+		for (j = 0; j < nx && x[j] < db->ndocs; ++j)
+			bits[x[j] / 32] |= 1U << (x[j] % 32);
+		free(x);
+	}
+
+	for (m = 0, j = 0; j < nw; ++j)
+		m += __builtin_popcount(~bits[j]);
+	if ((res = ids_alloc(m)) == NULL)
+		goto err;
+	for (m = 0, j = 0; j < nw; ++j) {
+		for (w = ~bits[j]; w != 0; w &= w - 1) {
+			id = j * 32 + ffs(w) - 1;
+			if (id < db->ndocs)
+				res[m++] = id;
+		}
+	}
+
+	free(bits);
+	*out = res;
+	*len = m;
+	return 0;
+
+err:
+	free(bits);
+	return -1;
+}
+
+/*
+ * Start from the shortest term, then restrict the candidates with the
+ * next ones.  The NOTs come last, when there are the fewest documents
+ * left to check.  If the shortest terms are all dense they're
+ * intersected as bitmaps first.
+ */
+static int
+eval_and(struct db *db, struct node *n, const uint32_t *cand,
+    size_t ncand, uint32_t **out, size_t *len)
+{
+	uint32_t *res, *cur = NULL;
+	size_t i = 0, nres;
+
+	qsort(n->kids, n->nkids, sizeof(*n->kids), node_cmp);
+
+	if (cand == NULL && n->kids[0]->type == N_NOT)
+		return eval_nots(db, n->kids, n->nkids, out, len);
+
+	if (cand == NULL && n->nkids > 1 && is_dense(db, n->kids[0]) &&
+	    is_dense(db, n->kids[1])) {
+		if (and_dense(db, n, &cur, &ncand, &i) == -1)
+			return -1;
+		cand = cur;
+		if (ncand == 0)
+			i = n->nkids;
+	}
+
+	for (; i < n->nkids; ++i) {
+		if (eval(db, n->kids[i], cand, ncand, &res, &nres) == -1) {
+			free(cur);
+			return -1;
+		}
+
+		free(cur);
+		cand = cur = res;
+		ncand = nres;
+		if (nres == 0)
+			break;
+	}
+
+	*out = cur;
+	*len = ncand;
+	return 0;
+}
+
+static int
+eval_phrase(struct db *db, struct node *n, const uint32_t *cand,
+    size_t ncand, uint32_t **out, size_t *len)
+{
+	size_t i, m;
+	int r;
+
+	if (eval_and(db, n, cand, ncand, out, len) == -1)
+		return -1;
+	if (*len == 0)
+		return 0;
+
+	/* only the documents left need to be checked */
+	if (!(db->flags & DB_POSITIONS)) {
+		free(*out);
+		*out = NULL;
+		return -1;
+	}
+
+	for (i = 0, m = 0; i < *len; ++i) {
+		if ((r = phrase_match(&n->ph, (*out)[i])) == -1) {
+			free(*out);
+			*out = NULL;
+			return -1;
+		}
+		if (r)
+			(*out)[m++] = (*out)[i];
+	}
+	*len = m;
+	return 0;
+}
+
+/* a sorted list of ids and the position of its current one */
+struct idlist {
+	uint32_t	*ids;
+	size_t		 len;
+	size_t		 i;
+};
+
+static void
+idlist_down(struct idlist **h, size_t n, size_t i)
+{
+	struct idlist *t;
+	size_t c;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && h[c + 1]->ids[h[c + 1]->i] <
+		    h[c]->ids[h[c]->i])
+			c++;
+		if (h[i]->ids[h[i]->i] <= h[c]->ids[h[c]->i])
+			break;
+		t = h[i];
+		h[i] = h[c];
+		h[c] = t;
+	}
+}
+
+/* merge the non-empty lists with a min-heap of their current ids */
+static int
+ids_union_heap(struct idlist *ls, size_t nls, uint32_t *out, size_t cap,
+    size_t *len)
+{
+	struct idlist **h, *l;
+	size_t i, n;
+	uint32_t d;
+	int ret = -1;
+
+	if ((h = calloc(nls, sizeof(*h))) == NULL)
+		return -1;
+
+	for (n = 0; n < nls; ++n)
+		h[n] = &ls[n];
+	for (i = n / 2; i > 0; --i)
+		idlist_down(h, n, i - 1);
+
+	*len = 0;
+	while (n > 0) {
+		l = h[0];
+		d = l->ids[l->i];
+		if (*len == 0 || out[*len - 1] != d) {
+			if (*len == cap)
+				goto done;
+			out[(*len)++] = d;
+		}
+
+		if (++l->i == l->len)
+			h[0] = h[--n];
+		idlist_down(h, n, 0);
+	}
+	ret = 0;
+
+done:
+	free(h);
+	return ret;
+}
+
+/* set the ids of the lists in a bitmap of all the documents */
+static int
+ids_union_bitmap(struct db *db, struct idlist *ls, size_t nls,
+    uint32_t *out, size_t *len)
+{
+	uint32_t *bits, w;
+	size_t i, j, nbits;
+
+	nbits = (db->ndocs + 31) / 32;
+	if ((bits = calloc(nbits, sizeof(*bits))) == NULL)
+		return -1;
+
+	for (i = 0; i < nls; ++i) {
+		for (j = 0; j < ls[i].len; ++j) {
+			if (ls[i].ids[j] >= db->ndocs) {
+				free(bits);
+				return -1;
+			}
+			bits[ls[i].ids[j] / 32] |= 1U << (ls[i].ids[j] % 32);
+		}
+	}
+
+	*len = 0;
+	for (i = 0; i < nbits; ++i)
+		for (w = bits[i]; w != 0; w &= w - 1)
+			out[(*len)++] = i * 32 + ffs(w) - 1;
+	free(bits);
+	return 0;
+}
+
+/*
+ * The documents of any of the nodes among the candidates.  Their
+ * results are merged in one pass: with a heap if they're too short to
+ * make it worth to scan a bitmap of all the documents, otherwise with
+ * the bitmap, as they're already decoded.
+ */
+static int
+eval_union(struct db *db, struct node **kids, size_t nkids,
+    const uint32_t *cand, size_t ncand, uint32_t **out, size_t *len)
+{
+	struct idlist *ls;
+	uint32_t *res = NULL;
+	size_t i, n = 0, cap, total = 0;
+	int r = -1;
+
+	if ((ls = calloc(nkids, sizeof(*ls))) == NULL)
+		return -1;
+
+	for (i = 0; i < nkids; ++i) {
+		if (eval(db, kids[i], cand, ncand, &ls[n].ids,
+		    &ls[n].len) == -1)
+			goto done;
+		if (ls[n].len == 0) {
+			free(ls[n].ids);
+			continue;
+		}
+		total += ls[n++].len;
+	}
+
+	if (n <= 1) {
+		if (n == 1) {
+			*out = ls[0].ids;
+			*len = ls[0].len;
+			ls[0].ids = NULL;
+		}
+		r = 0;
+		goto done;
+	}
+
+	cap = total < db->ndocs ? total : db->ndocs;
+	if ((res = ids_alloc(cap)) == NULL)
+		goto done;
+	if (total < db->ndocs / 32)
+		r = ids_union_heap(ls, n, res, cap, len);
+	else
+		r = ids_union_bitmap(db, ls, n, res, len);
+	if (r == 0) {
+		*out = res;
+		res = NULL;
+	}
+
+done:
+	for (i = 0; i < n; ++i)
+		free(ls[i].ids);
+	free(ls);
+	free(res);
+	return r;
+}
+
+static int
+eval_or(struct db *db, struct node *n, const uint32_t *cand,
+    size_t ncand, uint32_t **out, size_t *len)
+{
+	return eval_union(db, n->kids, n->nkids, cand, ncand, out, len);
+}
+
+/*
+ * The candidates without the documents of the term, which is only
+ * evaluated on them: a long posting list is probed with skips instead
+ * of being decoded.
+ */
+static int
+eval_not(struct db *db, struct node *n, const uint32_t *cand,
+    size_t ncand, uint32_t **out, size_t *len)
+{
+	uint32_t *res = NULL, *x = NULL;
+	size_t i, j, m, nx = 0;
+
+	if (cand == NULL)
+		return eval_nots(db, &n, 1, out, len);
+
+	if (eval(db, n->kids[0], cand, ncand, &x, &nx) == -1)
+		return -1;
+	if ((res = ids_alloc(ncand)) == NULL) {
+		free(x);
+		return -1;
+	}
+	for (i = 0, j = 0, m = 0; i < ncand; ++i) {
+		while (j < nx && x[j] < cand[i])
+			j++;
+		if (j == nx || x[j] != cand[i])
+			res[m++] = cand[i];
+	}
+
+	free(x);
+	*out = res;
+	*len = m;
+	return 0;
+}
+
+/*
+ * Compute the documents matching the node among the candidates, or
+ * among all the documents if cand is NULL, in a newly allocated array.
+ * Passing the result of the cheaper terms down to the others evaluates
+ * the ANDs before the ORs below them.
+ */
+static int
+eval(struct db *db, struct node *n, const uint32_t *cand, size_t ncand,
+    uint32_t **out, size_t *len)
+{
+	*out = NULL;
+	*len = 0;
+
+	switch (n->type) {
+	case N_WORD:
+	case N_IDS:
+		return eval_leaf(db, n, cand, ncand, out, len);
+	case N_PHRASE:
+		return eval_phrase(db, n, cand, ncand, out, len);
+	case N_AND:
+		return eval_and(db, n, cand, ncand, out, len);
+	case N_OR:
+		return eval_or(db, n, cand, ncand, out, len);
+	case N_NOT:
+		return eval_not(db, n, cand, ncand, out, len);
+	}
+
+	return -1;
+}
+
+/* the ids of the documents matching the query */
+static int
+query_ids(struct db *db, struct fts_ctx *ctx, const char *query,
+    uint32_t **res, size_t *len)
+{
+	struct node *root;
+	size_t i, n;
+	int r = 0;
+
+	*res = NULL;
+	*len = 0;
+
+	if (parse_query(db, ctx, NULL, query, &root) == -1)
+		return -1;
+	if (root != NULL)
+		r = eval(db, root, NULL, 0, res, len);
+	node_free(root);
+
+	/* drop the deleted documents from the result, it's the shortest */
+	if (r == 0 && db->deleted != NULL) {
+		for (n = 0, i = 0; i < *len; ++i)
+			if (!db_is_deleted(db, (*res)[i]))
+				(*res)[n++] = (*res)[i];
+		*len = n;
+	}
+	return r;
+}
+
+static int
+emit(struct db *db, const uint32_t *ids, size_t len, db_hit_cb cb,
+    void *data)
+{
+	struct db_entry e;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		if (db_doc_by_id(db, ids[i], &e) == -1)
+			return -1;
+		if (cb(db, &e, data) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+count_word(const char *word, size_t len, void *data)
+{
+	size_t *n = data;
+
+	if (++*n > DB_FIELDGAP)
+		return -1;
+	return 0;
+}
+
+/*
+ * Check the syntax of the query.  Returns 0 if the query can be run,
+ * otherwise -1 and errstr is set to a message telling why not.
+ */
+int
+fts_check(const char *query, const char **errstr)
+{
+	struct parser ps;
+	const char *tok, *end;
+	size_t len, n;
+	int t, depth = 0;
+
+	*errstr = NULL;
+	memset(&ps, 0, sizeof(ps));
+	ps.p = query;
+	while ((t = lex(&ps, &tok, &len)) != T_END) {
+		ps.p = tok + len;
+		if (t == T_LPAREN && ++depth > MAX_DEPTH) {
+			*errstr = "parentheses nested too deep";
+			return -1;
+		}
+		if (t == T_RPAREN && --depth < 0)
+			break;
+		if (t != T_QUOTE)
+			continue;
+
+		if ((end = strchr(ps.p, '"')) == NULL)
+			end = ps.p + strlen(ps.p);
+		if (memchr(ps.p, '*', end - ps.p) != NULL) {
+			*errstr = "prefixes aren't allowed in phrases";
+			return -1;
+		}
+		n = 0;
+		if (tokenize(ps.p, end - ps.p, count_word, &n) == -1) {
+			*errstr = "phrase too long";
+			return -1;
+		}
+		ps.p = *end == '"' ? end + 1 : end;
+	}
+
+	if (depth != 0) {
+		*errstr = "unbalanced parentheses";
+		return -1;
+	}
+	return 0;
+}
+
+int
+fts(struct db *db, const char *query, db_hit_cb cb, void *data)
+{
+	uint32_t *res;
+	size_t len;
+	int r;
+
+	if (query_ids(db, NULL, query, &res, &len) == -1)
+		return -1;
+	r = emit(db, res, len, cb, data);
+	free(res);
+	return r;
+}
+
+/*
+ * A context caches the lists of the words and the results of the
+ * queries for a database, using up to maxmem bytes split between the
+ * two.  It can be shared between threads.
+ */
+struct fts_ctx *
+fts_ctx_new(struct db *db, size_t maxmem)
+{
+	struct fts_ctx *ctx;
+
+	if ((ctx = calloc(1, sizeof(*ctx))) == NULL)
+		return NULL;
+	ctx->db = db;
+	if (cache_init(&ctx->terms, maxmem / 2) == -1) {
+		free(ctx);
+		return NULL;
+	}
+	if (cache_init(&ctx->results, maxmem / 2) == -1) {
+		cache_free(&ctx->terms);
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/* the query without the leading, trailing and repeated blanks */
+static char *
+normalize(const char *query)
+{
+	const char *p;
+	char *key, *k;
+	size_t len;
+
+	if ((key = malloc(strlen(query) + 1)) == NULL)
+		return NULL;
+
+	k = key;
+	p = query + strspn(query, " \t\n");
+	while (*p != '\0') {
+		len = strcspn(p, " \t\n");
+		memcpy(k, p, len);
+		k += len;
+		p += len;
+		p += strspn(p, " \t\n");
+		if (*p != '\0')
+			*k++ = ' ';
+	}
+	*k = '\0';
+	return key;
+}
+
+/* like fts(), but through the caches of ctx */
+int
+fts_ctx_query(struct fts_ctx *ctx, const char *query, db_hit_cb cb,
+    void *data)
+{
+	struct cache_entry *e;
+	uint32_t *res;
+	size_t len;
+	char *key;
+	int r;
+
+	if ((key = normalize(query)) == NULL)
+		return -1;
+
+	if ((e = cache_get(&ctx->results, key)) == NULL) {
+		if (query_ids(ctx->db, ctx, query, &res, &len) == -1 ||
+		    (e = cache_put(&ctx->results, key, res, len)) == NULL) {
+			free(key);
+			return -1;
+		}
+	}
+	free(key);
+
+	r = emit(ctx->db, e->ids, e->len, cb, data);
+	cache_release(&ctx->results, e);
+	return r;
+}
+
+void
+fts_ctx_stats(struct fts_ctx *ctx, struct fts_stats *st)
+{
+	pthread_mutex_lock(&ctx->results.mtx);
+	st->hits = ctx->results.hits;
+	st->misses = ctx->results.misses;
+	st->mem = ctx->results.mem;
+	pthread_mutex_unlock(&ctx->results.mtx);
+
+	pthread_mutex_lock(&ctx->terms.mtx);
+	st->term_hits = ctx->terms.hits;
+	st->term_misses = ctx->terms.misses;
+	st->mem += ctx->terms.mem;
+	pthread_mutex_unlock(&ctx->terms.mtx);
+}
+
+/* no query may be running */
+void
+fts_ctx_free(struct fts_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+	cache_free(&ctx->terms);
+	cache_free(&ctx->results);
+	free(ctx);
+}
+
+/*
+ * The statistics of a collection for BM25: how many documents are not
+ * deleted, their length and how many have each word of the query.
+ * The last ones are those stored in the lists, with the deleted
+ * documents too until their segments are rewritten, as going through
+ * the lists to skip them would take as long as the lists are.
+ */
+struct bm25 {
+	double		  ndocs;
+	uint64_t	  total;
+	char		**words;
+	double		 *dfs;
+	size_t		  len;
+	size_t		  cap;
+};
+
+struct scorer {
+	struct db_cursor	 c;
+	double			 idf;
+	double			 bw;		/* weight of the bounds */
+	double			 ub;		/* upper bound of the term */
+};
+
+struct scorers {
+	struct db	*db;
+	const struct bm25 *st;
+	float		 avgdl;
+	struct scorer	*ss;
+	size_t		 len;
+	size_t		 cap;
+};
+
+struct hit {
+	double		 score;
+	uint32_t	 docid;
+};
+
+static int
+bm25_word(const char *word, size_t len, void *data)
+{
+	struct bm25 *st = data;
+	size_t i, newcap;
+	void *t;
+
+	for (i = 0; i < st->len; ++i)
+		if (!strcmp(st->words[i], word))
+			return 0;
+
+	if (st->len == st->cap) {
+		newcap = st->cap == 0 ? 4 : st->cap * 2;
+		t = reallocarray(st->words, newcap, sizeof(*st->words));
+		if (t == NULL)
+			return -1;
+		st->words = t;
+		t = reallocarray(st->dfs, newcap, sizeof(*st->dfs));
+		if (t == NULL)
+			return -1;
+		st->dfs = t;
+		st->cap = newcap;
+	}
+
+	if ((st->words[st->len] = strdup(word)) == NULL)
+		return -1;
+	st->dfs[st->len++] = 0;
+	return 0;
+}
+
+static void
+bm25_free(struct bm25 *st)
+{
+	size_t i;
+
+	for (i = 0; i < st->len; ++i)
+		free(st->words[i]);
+	free(st->words);
+	free(st->dfs);
+}
+
+/* collect the words of the query, with no document counted yet */
+static int
+bm25_init(struct bm25 *st, const char *query)
+{
+	memset(st, 0, sizeof(*st));
+	if (tokenize(query, strlen(query), bm25_word, st) == -1) {
+		bm25_free(st);
+		return -1;
+	}
+	return 0;
+}
+
+/* add the documents of db to the statistics */
+static void
+bm25_add(struct bm25 *st, struct db *db)
+{
+	struct db_cursor c;
+	size_t i;
+
+	st->ndocs += db->ndocs - db->ndeleted;
+	st->total += db->total - db->deltotal;
+
+	for (i = 0; i < st->len; ++i)
+		if (db_word_docs(db, st->words[i], &c) == 0)
+			st->dfs[i] += c.ndocs;
+}
+
+/* like the average length of a database */
+static float
+bm25_avgdl(const struct bm25 *st)
+{
+	if (st->ndocs == 0 || st->total == 0)
+		return 1;
+	return st->total / st->ndocs;
+}
+
+/* unlike add_term() the words not in the index are just ignored */
+static int
+add_scorer(const char *word, size_t len, void *data)
+{
+	struct scorers *sc = data;
+	struct scorer *s;
+	double n, df;
+	size_t i, newcap;
+	void *t;
+
+	if (sc->len == sc->cap) {
+		newcap = sc->cap * 1.5;
+		if (newcap == 0)
+			newcap = 4;
+		t = recallocarray(sc->ss, sc->cap, newcap, sizeof(*sc->ss));
+		if (t == NULL)
+			return -1;
+		sc->ss = t;
+		sc->cap = newcap;
+	}
+
+	s = &sc->ss[sc->len];
+	if (db_word_docs(sc->db, word, &s->c) == -1 || s->c.ndocs == 0)
+		return 0;
+
+	n = sc->st->ndocs;
+	df = s->c.ndocs;
+	for (i = 0; i < sc->st->len; ++i)
+		if (!strcmp(sc->st->words[i], word))
+			df = sc->st->dfs[i];
+	if (df > n)
+		df = n;
+	s->idf = log(1 + (n - df + 0.5) / (df + 0.5));
+
+	/*
+	 * The maxima in the lists are computed with the average length
+	 * of the database.  With a longer one a score grows by at most
+	 * their ratio, plus some room for the rounding of the floats.
+	 */
+	s->bw = s->idf;
+	if (sc->avgdl > sc->db->avgdl)
+		s->bw *= sc->avgdl / sc->db->avgdl * (1 + 16 * FLT_EPSILON);
+	s->ub = s->bw * s->c.max;
+	s->c.withtf = 1;
+	sc->len++;
+	return 0;
+}
+
+static inline int
+hit_lt(const struct hit *a, const struct hit *b)
+{
+	if (a->score != b->score)
+		return a->score < b->score;
+	return a->docid > b->docid;
+}
+
+static int
+hit_cmp(const void *a, const void *b)
+{
+	const struct hit *x = a, *y = b;
+
+	if (hit_lt(x, y))
+		return 1;
+	if (hit_lt(y, x))
+		return -1;
+	return 0;
+}
+
+/* keep the best k hits in a min-heap */
+static void
+topk_add(struct hit *heap, size_t *len, size_t k, double score,
+    uint32_t docid)
+{
+	struct hit h, t;
+	size_t i, c;
+
+	h.score = score;
+	h.docid = docid;
+
+	if (*len < k) {
+		i = (*len)++;
+		heap[i] = h;
+		while (i > 0 && hit_lt(&heap[i], &heap[(i - 1) / 2])) {
+			t = heap[i];
+			heap[i] = heap[(i - 1) / 2];
+			heap[(i - 1) / 2] = t;
+			i = (i - 1) / 2;
+		}
+		return;
+	}
+
+	if (!hit_lt(&heap[0], &h))
+		return;
+
+	heap[0] = h;
+	for (i = 0; (c = 2 * i + 1) < *len; i = c) {
+		if (c + 1 < *len && hit_lt(&heap[c + 1], &heap[c]))
+			c++;
+		if (!hit_lt(&heap[c], &heap[i]))
+			break;
+		t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+	}
+}
+
+/* whether a comes after b: ties in query order, so the sums are too */
+static inline int
+scorer_gt(const struct scorer *a, const struct scorer *b)
+{
+	if (a->c.docid != b->c.docid)
+		return a->c.docid > b->c.docid;
+	return a > b;
+}
+
+/* sort the terms by their current document, dropping the exhausted ones */
+static size_t
+scorers_sort(struct scorer **ts, size_t n, const int *alive)
+{
+	struct scorer *t;
+	size_t i, j, len = 0;
+
+	for (i = 0; i < n; ++i)
+		if (alive[i])
+			ts[len++] = ts[i];
+
+	for (i = 1; i < len; ++i) {
+		t = ts[i];
+		for (j = i; j > 0 && scorer_gt(ts[j - 1], t); --j)
+			ts[j] = ts[j - 1];
+		ts[j] = t;
+	}
+	return len;
+}
+
+/* call cb on the hits in the heap, best first */
+static int
+topk_emit(struct db *db, struct hit *heap, size_t len, fts_rank_cb cb,
+    void *data)
+{
+	struct db_entry e;
+	size_t i;
+
+	qsort(heap, len, sizeof(*heap), hit_cmp);
+	for (i = 0; i < len; ++i) {
+		if (db_doc_by_id(db, heap[i].docid, &e) == -1)
+			return -1;
+		if (cb(db, &e, heap[i].score, data) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/* whether the query is only words, which fts_topk() joins by OR */
+static int
+plain_query(const char *query)
+{
+	struct parser ps;
+	const char *tok;
+	size_t len;
+	int t;
+
+	memset(&ps, 0, sizeof(ps));
+	ps.p = query;
+	while ((t = lex(&ps, &tok, &len)) != T_END) {
+		if (t != T_WORDS || memchr(tok, '*', len) != NULL)
+			return 0;
+		ps.p = tok + len;
+	}
+	return 1;
+}
+
+/*
+ * Rank the documents matching a query with operators by the words
+ * that are not negated.  The prefixes only select the documents.
+ */
+static int
+topk_bool(struct db *db, const struct bm25 *st, const char *query, size_t k,
+    fts_rank_cb cb, void *data)
+{
+	struct scorers sc;
+	struct scorer *s;
+	struct node *root;
+	struct hit *heap = NULL;
+	uint32_t *ids = NULL, d;
+	size_t i, j, nids = 0, len = 0;
+	double score;
+	int r, ret = -1;
+
+	memset(&sc, 0, sizeof(sc));
+	sc.db = db;
+	sc.st = st;
+	sc.avgdl = bm25_avgdl(st);
+
+	if (parse_query(db, NULL, &sc, query, &root) == -1)
+		goto done;
+	r = 0;
+	if (root != NULL)
+		r = eval(db, root, NULL, 0, &ids, &nids);
+	node_free(root);
+	if (r == -1)
+		goto done;
+
+	if (k > nids)
+		k = nids;
+	if (k == 0) {
+		ret = 0;
+		goto done;
+	}
+	if ((heap = calloc(k, sizeof(*heap))) == NULL)
+		goto done;
+	for (j = 0; j < sc.len; ++j)
+		if (db_cursor_next(&sc.ss[j].c) != 1)
+			goto done;
+
+	for (i = 0; i < nids; ++i) {
+		d = ids[i];
+		if (d >= db->ndocs)
+			goto done;
+		if (db_is_deleted(db, d))
+			continue;
+
+		for (score = 0, j = 0; j < sc.len; ++j) {
+			s = &sc.ss[j];
+			if ((r = db_cursor_seek(&s->c, d)) == -1)
+				goto done;
+			if (r == 1 && s->c.docid == d)
+				score += s->idf * db_bm25_tf(
+				    s->c.tfs[s->c.i - 1], db_doc_len(db, d),
+				    sc.avgdl);
+		}
+		topk_add(heap, &len, k, score, d);
+	}
+
+	ret = topk_emit(db, heap, len, cb, data);
+
+done:
+	free(sc.ss);
+	free(ids);
+	free(heap);
+	return ret;
+}
+
+/*
+ * Call cb on the k documents of db with the highest BM25 score for the
+ * words in the query, best first, with the statistics of the whole
+ * collection in st.  A document needs to match only one word.  A query
+ * with operators, phrases or prefixes is evaluated like fts() does
+ * instead, and its documents are ranked by the words that are not
+ * negated.
+ *
+ * The terms are kept sorted by their current document and the first
+ * one where the sum of the upper bounds of the terms before it exceeds
+ * the score of the k-th hit is the pivot: no document before it can
+ * enter the results.  The bounds of the part of the blocks that would
+ * hold the pivot are checked too, and while they're not enough the
+ * following parts are checked from the skip tables, so the documents
+ * that can't make it are skipped without decoding them (block-max
+ * WAND.)
+ */
+static int
+topk(struct db *db, const struct bm25 *st, const char *query, size_t k,
+    fts_rank_cb cb, void *data)
+{
+	struct scorers sc;
+	struct scorer **ts = NULL;
+	struct hit *heap = NULL;
+	double acc, bm, theta, score;
+	uint32_t pd, d, lim, next, last;
+	size_t i, p, n, len = 0;
+	int *alive = NULL, r, ret = -1;
+	float m;
+
+	if (!plain_query(query))
+		return topk_bool(db, st, query, k, cb, data);
+
+	memset(&sc, 0, sizeof(sc));
+	sc.db = db;
+	sc.st = st;
+	sc.avgdl = bm25_avgdl(st);
+
+	if (tokenize(query, strlen(query), add_scorer, &sc) == -1)
+		goto done;
+	if (k == 0 || sc.len == 0) {
+		ret = 0;
+		goto done;
+	}
+
+	if (k > db->ndocs)
+		k = db->ndocs;
+	if ((heap = calloc(k, sizeof(*heap))) == NULL ||
+	    (ts = calloc(sc.len, sizeof(*ts))) == NULL ||
+	    (alive = calloc(sc.len, sizeof(*alive))) == NULL)
+		goto done;
+
+	for (n = 0; n < sc.len; ++n) {
+		ts[n] = &sc.ss[n];
+		if (db_cursor_next(&ts[n]->c) != 1)
+			goto done;
+		alive[n] = 1;
+	}
+	n = scorers_sort(ts, n, alive);
+
+	for (;;) {
+		theta = len == k ? heap[0].score : 0;
+
+		for (acc = 0, p = 0; p < n; ++p)
+			if ((acc += ts[p]->ub) > theta)
+				break;
+		if (p == n)
+			break;
+		pd = ts[p]->c.docid;
+		while (p + 1 < n && ts[p + 1]->c.docid == pd)
+			p++;
+
+		next = UINT32_MAX;
+		for (bm = 0, i = 0; i <= p; ++i) {
+			m = db_cursor_blockmax(&ts[i]->c, pd, &last);
+			bm += ts[i]->bw * m;
+			if (last < next)
+				next = last;
+		}
+
+		for (i = 0; i < n; ++i)
+			alive[i] = 1;
+
+		if (bm > theta && ts[0]->c.docid == pd) {
+			if (pd >= db->ndocs)
+				goto done;
+			for (score = 0, i = 0; i <= p; ++i) {
+				m = db_bm25_tf(ts[i]->c.tfs[ts[i]->c.i - 1],
+				    db_doc_len(db, pd), sc.avgdl);
+				score += ts[i]->idf * m;
+			}
+			if (!db_is_deleted(db, pd))
+				topk_add(heap, &len, k, score, pd);
+
+			for (i = 0; i <= p; ++i) {
+				if ((r = db_cursor_next(&ts[i]->c)) == -1)
+					goto done;
+				alive[i] = r;
+			}
+		} else if (bm > theta) {
+			/* the terms before the pivot have to catch up */
+			for (i = 0; i < p && ts[i]->c.docid < pd; ++i) {
+				r = db_cursor_seek(&ts[i]->c, pd);
+				if (r == -1)
+					goto done;
+				alive[i] = r;
+			}
+		} else {
+			/*
+			 * Nothing up to the end of the part can make it:
+			 * check the following ones in the skip tables,
+			 * up to where the next term is.
+			 */
+			lim = p + 1 < n ? ts[p + 1]->c.docid : UINT32_MAX;
+			do {
+				if (next == UINT32_MAX || next + 1 >= lim) {
+					d = lim;
+					break;
+				}
+				d = next + 1;
+				next = UINT32_MAX;
+				for (bm = 0, i = 0; i <= p; ++i) {
+					m = db_cursor_blockmax(&ts[i]->c, d,
+					    &last);
+					bm += ts[i]->bw * m;
+					if (last < next)
+						next = last;
+				}
+			} while (bm <= theta);
+			if (d == UINT32_MAX)
+				break;
+			for (i = 0; i <= p; ++i) {
+				r = db_cursor_seek(&ts[i]->c, d);
+				if (r == -1)
+					goto done;
+				alive[i] = r;
+			}
+		}
+
+		n = scorers_sort(ts, n, alive);
+	}
+
+	ret = topk_emit(db, heap, len, cb, data);
+
+done:
+	free(sc.ss);
+	free(ts);
+	free(heap);
+	free(alive);
+	return ret;
+}
+
+/*
+ * Call cb on the k documents with the highest BM25 score for the words
+ * in the query, best first.  See topk().
+ */
+int
+fts_topk(struct db *db, const char *query, size_t k, fts_rank_cb cb,
+    void *data)
+{
+	struct bm25 st;
+	int ret;
+
+	if (bm25_init(&st, query) == -1)
+		return -1;
+	bm25_add(&st, db);
+	ret = topk(db, &st, query, k, cb, data);
+	bm25_free(&st);
+	return ret;
+}
+
+/*
+ * Run the query on every segment, through their contexts if ctxs is
+ * not NULL.  The results come in order of document id.
+ */
+int
+fts_segments(struct segments *segs, struct fts_ctx **ctxs,
+    const char *query, db_hit_cb cb, void *data)
+{
+	size_t i;
+	int r;
+
+	for (i = 0; i < segs->len; ++i) {
+		if (ctxs != NULL)
+			r = fts_ctx_query(ctxs[i], query, cb, data);
+		else
+			r = fts(&segs->dbs[i], query, cb, data);
+		if (r == -1)
+			return -1;
+	}
+	return 0;
+}
+
+struct seg_hit {
+	double		 score;
+	size_t		 seg;
+	size_t		 n;		/* rank in its segment */
+	struct db_entry	 e;
+};
+
+struct seg_hits {
+	struct seg_hit	*hits;
+	size_t		 len;
+	size_t		 seg;
+	size_t		 n;
+};
+
+static int
+add_seg_hit(struct db *db, struct db_entry *e, double score, void *data)
+{
+	struct seg_hits *sh = data;
+	struct seg_hit *h;
+
+	h = &sh->hits[sh->len++];
+	h->score = score;
+	h->seg = sh->seg;
+	h->n = sh->n++;
+	h->e = *e;
+	return 0;
+}
+
+static int
+seg_hit_cmp(const void *a, const void *b)
+{
+	const struct seg_hit *x = a, *y = b;
+
+	if (x->score != y->score)
+		return x->score < y->score ? 1 : -1;
+	if (x->seg != y->seg)
+		return x->seg < y->seg ? -1 : 1;
+	return x->n < y->n ? -1 : x->n > y->n;
+}
+
+/*
+ * The best k results of every segment, merged.  The segments score
+ * their documents with the statistics in st, so that the scores are
+ * the ones of a single database with the same documents.
+ */
+static int
+segs_topk(struct segments *segs, const struct bm25 *st, const char *query,
+    size_t k, fts_rank_cb cb, void *data)
+{
+	struct seg_hits sh;
+	size_t i, n = 0;
+	int ret = -1;
+
+	memset(&sh, 0, sizeof(sh));
+	for (i = 0; i < segs->len; ++i)
+		n += k < segs->dbs[i].ndocs ? k : segs->dbs[i].ndocs;
+	if (n == 0)
+		return 0;
+	if ((sh.hits = calloc(n, sizeof(*sh.hits))) == NULL)
+		return -1;
+
+	for (i = 0; i < segs->len; ++i) {
+		sh.seg = i;
+		sh.n = 0;
+		if (topk(&segs->dbs[i], st, query, k, add_seg_hit,
+		    &sh) == -1)
+			goto done;
+	}
+
+	qsort(sh.hits, sh.len, sizeof(*sh.hits), seg_hit_cmp);
+	for (i = 0; i < sh.len && i < k; ++i) {
+		if (cb(&segs->dbs[sh.hits[i].seg], &sh.hits[i].e,
+		    sh.hits[i].score, data) == -1)
+			goto done;
+	}
+	ret = 0;
+
+done:
+	free(sh.hits);
+	return ret;
+}
+
+/* the best k results of all the segments together */
+int
+fts_segments_topk(struct segments *segs, const char *query, size_t k,
+    fts_rank_cb cb, void *data)
+{
+	struct bm25 st;
+	size_t i;
+	int ret;
+
+	if (bm25_init(&st, query) == -1)
+		return -1;
+	for (i = 0; i < segs->len; ++i)
+		bm25_add(&st, &segs->dbs[i]);
+	ret = segs_topk(segs, &st, query, k, cb, data);
+	bm25_free(&st);
+	return ret;
+}
+
+struct shard_hit {
+	double		 score;
+	struct db	*db;
+	struct db_entry	 e;
+};
+
+struct shard_run {
+	pthread_t	 tid;
+	struct fts_shard *shard;
+	const struct bm25 *st;
+	const char	*query;
+	size_t		 k;
+	struct shard_hit *hits;
+	size_t		 len;
+	size_t		 cap;
+	size_t		 next;		/* to merge */
+	int		 ret;
+};
+
+static int
+add_shard_hit(struct db *db, struct db_entry *e, double score, void *data)
+{
+	struct shard_run *r = data;
+	struct shard_hit *h;
+	size_t cap;
+
+	if (r->len == r->cap) {
+		cap = r->cap == 0 ? 64 : r->cap * 2;
+		if ((h = reallocarray(r->hits, cap, sizeof(*h))) == NULL)
+			return -1;
+		r->hits = h;
+		r->cap = cap;
+	}
+
+	h = &r->hits[r->len++];
+	h->score = score;
+	h->db = db;
+	h->e = *e;
+	return 0;
+}
+
+static int
+add_shard_doc(struct db *db, struct db_entry *e, void *data)
+{
+	return add_shard_hit(db, e, 0, data);
+}
+
+static void *
+shard_run(void *arg)
+{
+	struct shard_run *r = arg;
+	struct fts_shard *sh = r->shard;
+
+	if (r->k != 0)
+		r->ret = segs_topk(sh->segs, r->st, r->query, r->k,
+		    add_shard_hit, r);
+	else
+		r->ret = fts_segments(sh->segs, sh->ctxs, r->query,
+		    add_shard_doc, r);
+	return NULL;
+}
+
+/*
+ * Run the query on the n shards at the same time, one thread each,
+ * and call cb with the index of the shard for every result.  The
+ * results are those of fts(), the first shard first, or those of
+ * fts_topk() if k is not zero, scored as if all the shards were one
+ * database and merged by score and then by shard.
+ * The entries point into the databases and stay valid while they're
+ * open.
+ */
+int
+fts_shards(struct fts_shard *shards, size_t n, const char *query, size_t k,
+    fts_shard_cb cb, void *data)
+{
+	struct shard_run *rs;
+	struct bm25 st;
+	size_t i, j, best, out;
+	int ret = -1;
+
+	if (n == 0)
+		return 0;
+	if (bm25_init(&st, query) == -1)
+		return -1;
+	if ((rs = calloc(n, sizeof(*rs))) == NULL) {
+		bm25_free(&st);
+		return -1;
+	}
+
+	/* the shards score with the statistics of all of them */
+	for (i = 0; k != 0 && i < n; ++i)
+		for (j = 0; j < shards[i].segs->len; ++j)
+			bm25_add(&st, &shards[i].segs->dbs[j]);
+
+	for (i = 0; i < n; ++i) {
+		rs[i].shard = &shards[i];
+		rs[i].st = &st;
+		rs[i].query = query;
+		rs[i].k = k;
+	}
+
+	/* the first runs here, the others wherever a thread can be made */
+	for (i = 1; i < n; ++i)
+		if (pthread_create(&rs[i].tid, NULL, shard_run, &rs[i]) != 0)
+			break;
+	for (j = i; j < n; ++j)
+		shard_run(&rs[j]);
+	shard_run(&rs[0]);
+	while (--i > 0)
+		pthread_join(rs[i].tid, NULL);
+
+	for (i = 0; i < n; ++i)
+		if (rs[i].ret == -1)
+			goto done;
+
+	if (k == 0) {
+		for (i = 0; i < n; ++i)
+			for (j = 0; j < rs[i].len; ++j)
+				if (cb(i, rs[i].hits[j].db, &rs[i].hits[j].e,
+				    0, data) == -1)
+					goto done;
+		ret = 0;
+		goto done;
+	}
+
+	/* the hits of every shard are sorted already */
+	for (out = 0; out < k; ++out) {
+		best = n;
+		for (i = 0; i < n; ++i) {
+			if (rs[i].next == rs[i].len)
+				continue;
+			if (best == n || rs[i].hits[rs[i].next].score >
+			    rs[best].hits[rs[best].next].score)
+				best = i;
+		}
+		if (best == n)
+			break;
+		j = rs[best].next++;
+		if (cb(best, rs[best].hits[j].db, &rs[best].hits[j].e,
+		    rs[best].hits[j].score, data) == -1)
+			goto done;
+	}
+	ret = 0;
+
+done:
+	for (i = 0; i < n; ++i)
+		free(rs[i].hits);
+	free(rs);
+	bm25_free(&st);
 	return ret;
 }
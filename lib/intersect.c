@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__amd64__) || defined(__x86_64__))
+#define X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include "intersect.h"
+
+static size_t
+intersect_scalar(uint32_t *out, const uint32_t *a, size_t na,
+    const uint32_t *b, size_t nb)
+{
+	size_t i = 0, j = 0, k = 0;
+
+	while (i < na && j < nb) {
+		if (a[i] < b[j])
+			i++;
+		else if (a[i] > b[j])
+			j++;
+		else {
+			out[k++] = a[i];
+			i++;
+			j++;
+		}
+	}
+
+	return k;
+}
+
+#ifdef X86_SIMD
+
+/* pshufb masks to move the lanes set in the index to the front */
+static const uint8_t shuf4[16][16] = {
+	{ 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x00, 0x01, 0x02, 0x03, 0x80, 0x80, 0x80, 0x80,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x04, 0x05, 0x06, 0x07, 0x80, 0x80, 0x80, 0x80,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x08, 0x09, 0x0a, 0x0b, 0x80, 0x80, 0x80, 0x80,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x00, 0x01, 0x02, 0x03, 0x08, 0x09, 0x0a, 0x0b,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	  0x08, 0x09, 0x0a, 0x0b, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x0c, 0x0d, 0x0e, 0x0f, 0x80, 0x80, 0x80, 0x80,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x00, 0x01, 0x02, 0x03, 0x0c, 0x0d, 0x0e, 0x0f,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x04, 0x05, 0x06, 0x07, 0x0c, 0x0d, 0x0e, 0x0f,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	  0x0c, 0x0d, 0x0e, 0x0f, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+	  0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x00, 0x01, 0x02, 0x03, 0x08, 0x09, 0x0a, 0x0b,
+	  0x0c, 0x0d, 0x0e, 0x0f, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b,
+	  0x0c, 0x0d, 0x0e, 0x0f, 0x80, 0x80, 0x80, 0x80 },
+	{ 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f },
+};
+
+/*
+ * Compare a block of four ids from a against all the rotations of a
+ * block of b, then compact the matching ones in out.  The block with
+ * the smallest maximum is advanced.
+ */
+__attribute__((target("ssse3")))
+static size_t
+intersect_ssse3(uint32_t *out, const uint32_t *a, size_t na,
+    const uint32_t *b, size_t nb)
+{
+	__m128i va, vb, cmp;
+	size_t i = 0, j = 0, k = 0;
+	uint32_t amax, bmax;
+	int m;
+
+	while (i + 4 <= na && j + 4 <= nb) {
+		va = _mm_loadu_si128((const __m128i *)(a + i));
+		vb = _mm_loadu_si128((const __m128i *)(b + j));
+
+		cmp = _mm_cmpeq_epi32(va, vb);
+		vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+		cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, vb));
+		vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+		cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, vb));
+		vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+		cmp = _mm_or_si128(cmp, _mm_cmpeq_epi32(va, vb));
+
+		m = _mm_movemask_ps(_mm_castsi128_ps(cmp));
+		va = _mm_shuffle_epi8(va,
+		    _mm_loadu_si128((const __m128i *)shuf4[m]));
+		_mm_storeu_si128((__m128i *)(out + k), va);
+		k += __builtin_popcount(m);
+
+		amax = a[i + 3];
+		bmax = b[j + 3];
+		if (amax <= bmax)
+			i += 4;
+		if (bmax <= amax)
+			j += 4;
+	}
+
+	return k + intersect_scalar(out + k, a + i, na - i, b + j, nb - j);
+}
+
+/*
+ * Same as intersect_ssse3 but eight ids at a time.  The permutation
+ * that compacts the matching lanes is computed from the mask with
+ * pdep/pext instead of a table.
+ */
+__attribute__((target("avx2,bmi2")))
+static size_t
+intersect_avx2(uint32_t *out, const uint32_t *a, size_t na,
+    const uint32_t *b, size_t nb)
+{
+	__m256i va, vb, cmp, rot, perm;
+	size_t i = 0, j = 0, k = 0;
+	uint64_t sel, idx;
+	uint32_t amax, bmax;
+	int m, r;
+
+	rot = _mm256_set_epi32(0, 7, 6, 5, 4, 3, 2, 1);
+
+	while (i + 8 <= na && j + 8 <= nb) {
+		va = _mm256_loadu_si256((const __m256i *)(a + i));
+		vb = _mm256_loadu_si256((const __m256i *)(b + j));
+
+		cmp = _mm256_cmpeq_epi32(va, vb);
+		for (r = 1; r < 8; ++r) {
+			vb = _mm256_permutevar8x32_epi32(vb, rot);
+			cmp = _mm256_or_si256(cmp, _mm256_cmpeq_epi32(va, vb));
+		}
+
+		m = _mm256_movemask_ps(_mm256_castsi256_ps(cmp));
+		sel = _pdep_u64(m, 0x0101010101010101ULL) * 0xff;
+		idx = _pext_u64(0x0706050403020100ULL, sel);
+		perm = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(idx));
+		_mm256_storeu_si256((__m256i *)(out + k),
+		    _mm256_permutevar8x32_epi32(va, perm));
+		k += __builtin_popcount(m);
+
+		amax = a[i + 7];
+		bmax = b[j + 7];
+		if (amax <= bmax)
+			i += 8;
+		if (bmax <= amax)
+			j += 8;
+	}
+
+	return k + intersect_scalar(out + k, a + i, na - i, b + j, nb - j);
+}
+
+#endif
+
+/*
+ * Intersect the sorted lists a and b into out, which must not overlap
+ * with them and must have room for the longest of the two.  Returns
+ * the number of ids written.
+ */
+size_t
+intersect(uint32_t *out, const uint32_t *a, size_t na, const uint32_t *b,
+    size_t nb)
+{
+#ifdef X86_SIMD
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2"))
+		return intersect_avx2(out, a, na, b, nb);
+	if (__builtin_cpu_supports("ssse3"))
+		return intersect_ssse3(out, a, na, b, nb);
+#endif
+	return intersect_scalar(out, a, na, b, nb);
+}
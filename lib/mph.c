@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mph.h"
+
+/* give up on a bucket after this many pilots */
+#define MAXPILOT	(1U << 30)
+
+static inline uint64_t
+mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/* FNV-1a: computed once per word, then mixed with the seed */
+uint64_t
+mph_hash(const char *s)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *s != '\0'; ++s) {
+		h ^= (unsigned char)*s;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+uint64_t
+mph_seed(uint64_t h, uint64_t seed)
+{
+	return mix(h ^ (seed * 0x9e3779b97f4a7c15ULL));
+}
+
+uint32_t
+mph_bucket(uint64_t h, uint32_t nbuckets)
+{
+	return ((h >> 32) * nbuckets) >> 32;
+}
+
+uint32_t
+mph_slot(uint64_t h, uint32_t pilot, uint32_t nslots)
+{
+	return mix(h + pilot * 0x9e3779b97f4a7c15ULL) % nslots;
+}
+
+uint32_t
+mph_fingerprint(uint64_t h)
+{
+	return mix(h + 1) >> 32;
+}
+
+/*
+ * Find a pilot for every one of the nbuckets buckets so that the n
+ * seeded hashes in hs are sent to distinct slots; the index of the key
+ * in every slot is stored in slots.  The buckets are placed from the
+ * biggest, when it's still easy to find room for them.  Returns -1 if
+ * a bucket can't be placed, usually because of two equal hashes.
+ */
+int
+mph_build(const uint64_t *hs, uint32_t n, uint32_t *pilots,
+    uint32_t nbuckets, uint32_t *slots)
+{
+	uint32_t *start = NULL, *keys = NULL, *order = NULL, *pos = NULL;
+	uint32_t *bysize = NULL;
+	uint8_t *taken = NULL;
+	uint32_t b, i, j, k, len, maxlen = 0, pilot;
+	int ret = -1;
+
+	start = calloc(nbuckets + 1, sizeof(*start));
+	keys = calloc(n, sizeof(*keys));
+	order = calloc(nbuckets, sizeof(*order));
+	taken = calloc(n / 8 + 1, 1);
+	if (start == NULL || keys == NULL || order == NULL || taken == NULL)
+		goto done;
+
+	/* group the keys by bucket */
+	for (i = 0; i < n; ++i)
+		start[mph_bucket(hs[i], nbuckets) + 1]++;
+	for (b = 0; b < nbuckets; ++b) {
+		if (start[b + 1] > maxlen)
+			maxlen = start[b + 1];
+		start[b + 1] += start[b];
+	}
+	if ((pos = calloc(maxlen + 1, sizeof(*pos))) == NULL ||
+	    (bysize = calloc(maxlen + 2, sizeof(*bysize))) == NULL)
+		goto done;
+	memcpy(order, start, nbuckets * sizeof(*order));
+	for (i = 0; i < n; ++i)
+		keys[order[mph_bucket(hs[i], nbuckets)]++] = i;
+
+	/* then sort the buckets by decreasing size */
+	for (b = 0; b < nbuckets; ++b)
+		bysize[maxlen - (start[b + 1] - start[b]) + 1]++;
+	for (k = 0; k <= maxlen; ++k)
+		bysize[k + 1] += bysize[k];
+	for (b = 0; b < nbuckets; ++b)
+		order[bysize[maxlen - (start[b + 1] - start[b])]++] = b;
+
+	for (k = 0; k < nbuckets; ++k) {
+		b = order[k];
+		len = start[b + 1] - start[b];
+		if (len == 0)
+			break;
+
+		for (pilot = 0; pilot < MAXPILOT; ++pilot) {
+			for (i = 0; i < len; ++i) {
+				pos[i] = mph_slot(hs[keys[start[b] + i]],
+				    pilot, n);
+				if (taken[pos[i] / 8] & (1 << (pos[i] % 8)))
+					break;
+				for (j = 0; j < i; ++j)
+					if (pos[j] == pos[i])
+						break;
+				if (j != i)
+					break;
+			}
+			if (i == len)
+				break;
+		}
+		if (pilot == MAXPILOT)
+			goto done;
+
+		pilots[b] = pilot;
+		for (i = 0; i < len; ++i) {
+			taken[pos[i] / 8] |= 1 << (pos[i] % 8);
+			slots[pos[i]] = keys[start[b] + i];
+		}
+	}
+
+	/* the remaining buckets are empty */
+	for (; k < nbuckets; ++k)
+		pilots[order[k]] = 0;
+	ret = 0;
+
+done:
+	free(start);
+	free(keys);
+	free(order);
+	free(pos);
+	free(bysize);
+	free(taken);
+	return ret;
+}
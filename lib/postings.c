@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "db.h"
+#include "postings.h"
+
+#define LANES	4
+#define ROWS	(DB_BLOCKLEN / LANES)
+
+static inline int
+bitwidth(uint32_t x)
+{
+	int n = 0;
+
+	while (x != 0) {
+		n++;
+		x >>= 1;
+	}
+	return n;
+}
+
+static void
+pack(uint8_t *out, const uint32_t *in, int bits)
+{
+	uint32_t w[DB_BLOCKLEN];
+	int l, r, k, sh, bit;
+
+	memset(w, 0, sizeof(w));
+	for (l = 0; l < LANES; ++l) {
+		bit = 0;
+		for (r = 0; r < ROWS; ++r) {
+			k = bit / 32;
+			sh = bit % 32;
+			w[LANES * k + l] |= in[LANES * r + l] << sh;
+			if (sh + bits > 32)
+				w[LANES * (k + 1) + l] |=
+				    in[LANES * r + l] >> (32 - sh);
+			bit += bits;
+		}
+	}
+
+	memcpy(out, w, LANES * sizeof(*w) * bits);
+}
+
+#ifdef __SSE2__
+
+/*
+ * Unpack DB_BLOCKLEN values, adding one.  If delta is set they are gaps
+ * from base, otherwise they're stored as they are.
+ */
+static void
+unpack(uint32_t *out, const uint8_t *in, int bits, uint32_t base, int delta)
+{
+	const __m128i *w = (const __m128i *)in;
+	__m128i cur, v, mask, prev, one;
+	int r, sh = 0;
+
+	mask = _mm_set1_epi32(bits == 32 ? 0xffffffff : (1U << bits) - 1);
+	prev = _mm_set1_epi32(base);
+	one = _mm_set1_epi32(1);
+
+	cur = bits != 0 ? _mm_loadu_si128(w++) : _mm_setzero_si128();
+	for (r = 0; r < ROWS; ++r) {
+		v = _mm_srl_epi32(cur, _mm_cvtsi32_si128(sh));
+		sh += bits;
+		if (sh > 32) {
+			cur = _mm_loadu_si128(w++);
+			sh -= 32;
+			v = _mm_or_si128(v,
+			    _mm_sll_epi32(cur, _mm_cvtsi32_si128(bits - sh)));
+		} else if (sh == 32 && r != ROWS - 1) {
+			cur = _mm_loadu_si128(w++);
+			sh = 0;
+		}
+
+		v = _mm_add_epi32(_mm_and_si128(v, mask), one);
+		if (delta) {
+			/* undo the deltas: prefix sum of the four lanes */
+			v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+			v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+			v = _mm_add_epi32(v, prev);
+			prev = _mm_shuffle_epi32(v, 0xff);
+		}
+		_mm_storeu_si128((__m128i *)out + r, v);
+	}
+}
+
+#else
+
+static void
+unpack(uint32_t *out, const uint8_t *in, int bits, uint32_t base, int delta)
+{
+	uint32_t w[DB_BLOCKLEN + LANES], mask, v;
+	int i, l, r, k, sh, bit;
+
+	mask = bits == 32 ? 0xffffffff : (1U << bits) - 1;
+	memset(w, 0, sizeof(w));
+	memcpy(w, in, LANES * sizeof(*w) * bits);
+
+	for (l = 0; l < LANES; ++l) {
+		bit = 0;
+		for (r = 0; r < ROWS; ++r) {
+			k = bit / 32;
+			sh = bit % 32;
+			v = w[LANES * k + l] >> sh;
+			if (sh + bits > 32)
+				v |= w[LANES * (k + 1) + l] << (32 - sh);
+			out[LANES * r + l] = v & mask;
+			bit += bits;
+		}
+	}
+
+	for (i = 0; i < DB_BLOCKLEN; ++i) {
+		if (delta)
+			base = out[i] = base + out[i] + 1;
+		else
+			out[i]++;
+	}
+}
+
+#endif
+
+static inline size_t
+vb_encode(uint8_t *out, uint32_t x)
+{
+	size_t n = 0;
+
+	while (x >= 0x80) {
+		out[n++] = (x & 0x7f) | 0x80;
+		x >>= 7;
+	}
+	out[n++] = x;
+	return n;
+}
+
+static inline const uint8_t *
+vb_decode(const uint8_t *p, const uint8_t *end, uint32_t *x)
+{
+	int sh;
+
+	*x = 0;
+	for (sh = 0; sh < 35 && p < end; sh += 7) {
+		*x |= (uint32_t)(*p & 0x7f) << sh;
+		if ((*p++ & 0x80) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+/*
+ * Encode n ids, with n at most DB_BLOCKLEN, in out; base is the last id
+ * of the previous block or UINT32_MAX.  The ids are overwritten.
+ * Returns the number of bytes written.
+ */
+size_t
+postings_encode(uint8_t *out, uint32_t *ids, size_t n, uint32_t base)
+{
+	uint32_t w[POSTINGS_MAXWORDS];
+	uint64_t span = 0, nw;
+	size_t i, len = 0;
+	uint32_t t;
+	int bits = 0;
+
+	for (i = 0; i < n; ++i) {
+		t = ids[i];
+		ids[i] = t - base - 1;
+		base = t;
+	}
+
+	if (n < DB_BLOCKLEN) {
+		for (i = 0; i < n; ++i)
+			len += vb_encode(out + len, ids[i]);
+		return len;
+	}
+
+	for (i = 0; i < n; ++i) {
+		if (bitwidth(ids[i]) > bits)
+			bits = bitwidth(ids[i]);
+		span += ids[i] + 1;
+	}
+
+	/* dense blocks take less space as a bitmap */
+	nw = (span + 31) / 32;
+	if (nw < LANES * (uint64_t)bits) {
+		memset(w, 0, nw * sizeof(*w));
+		for (t = 0, i = 0; i < n; ++i) {
+			t += ids[i] + 1;
+			w[(t - 1) / 32] |= 1U << ((t - 1) % 32);
+		}
+		*out++ = POSTINGS_BITMAP + nw;
+		memcpy(out, w, nw * sizeof(*w));
+		return 1 + nw * sizeof(*w);
+	}
+
+	*out++ = bits;
+	pack(out, ids, bits);
+	return 1 + LANES * sizeof(uint32_t) * bits;
+}
+
+/* the ids set in the nw words of the bitmap at p, after base */
+static const uint8_t *
+bitmap_decode(const uint8_t *p, const uint8_t *end, uint32_t *ids,
+    size_t n, uint32_t base, size_t nw)
+{
+	uint32_t w;
+	size_t i, k = 0;
+
+	if (nw * sizeof(w) > (size_t)(end - p))
+		return NULL;
+
+	for (i = 0; i < nw; ++i) {
+		memcpy(&w, p + i * sizeof(w), sizeof(w));
+		for (; w != 0; w &= w - 1) {
+			if (k == n)
+				return NULL;
+			ids[k++] = base + 1 + i * 32 + ffs(w) - 1;
+		}
+	}
+
+	if (k != n)
+		return NULL;
+	return p + nw * sizeof(w);
+}
+
+/*
+ * Decode a block of n ids starting at p.  Returns the pointer to the
+ * next block or NULL if the data is corrupted.
+ */
+const uint8_t *
+postings_decode(const uint8_t *p, const uint8_t *end, uint32_t *ids,
+    size_t n, uint32_t base)
+{
+	size_t i;
+	int bits;
+
+	if (n < DB_BLOCKLEN) {
+		for (i = 0; i < n; ++i) {
+			if ((p = vb_decode(p, end, &ids[i])) == NULL)
+				return NULL;
+			base = ids[i] = base + ids[i] + 1;
+		}
+		return p;
+	}
+
+	if (p >= end)
+		return NULL;
+	bits = *p++;
+	if (bits >= POSTINGS_BITMAP)
+		return bitmap_decode(p, end, ids, n, base,
+		    bits - POSTINGS_BITMAP);
+	if (bits > 32 || p + LANES * sizeof(uint32_t) * bits > end)
+		return NULL;
+
+	unpack(ids, p, bits, base, 1);
+	return p + LANES * sizeof(uint32_t) * bits;
+}
+
+/*
+ * Like postings_decode(), but set the bits of the ids in the bitmap at
+ * bits instead, failing if any is not less than nbits.  The blocks
+ * stored as bitmaps are copied a word at a time.  base is updated to
+ * the last id of the block.
+ */
+const uint8_t *
+postings_decode_bitmap(const uint8_t *p, const uint8_t *end, uint32_t *bits,
+    size_t nbits, size_t n, uint32_t *base)
+{
+	uint32_t ids[DB_BLOCKLEN], w;
+	uint64_t start, last = 0;
+	size_t i, nw, k, cnt = 0;
+	int sh;
+
+	if (n < DB_BLOCKLEN || p >= end || *p < POSTINGS_BITMAP) {
+		if ((p = postings_decode(p, end, ids, n, *base)) == NULL)
+			return NULL;
+		for (i = 0; i < n; ++i) {
+			if (ids[i] >= nbits)
+				return NULL;
+			bits[ids[i] / 32] |= 1U << (ids[i] % 32);
+		}
+		*base = ids[n - 1];
+		return p;
+	}
+
+	nw = *p++ - POSTINGS_BITMAP;
+	if (nw * sizeof(w) > (size_t)(end - p))
+		return NULL;
+
+	start = (uint32_t)(*base + 1);
+	sh = start % 32;
+	for (i = 0; i < nw; ++i) {
+		memcpy(&w, p + i * sizeof(w), sizeof(w));
+		if (w == 0)
+			continue;
+
+		cnt += __builtin_popcount(w);
+		last = start + i * 32 + 31 - __builtin_clz(w);
+		if (last >= nbits)
+			return NULL;
+
+		k = (start + i * 32) / 32;
+		bits[k] |= w << sh;
+		if (sh != 0 && (w >> (32 - sh)) != 0)
+			bits[k + 1] |= w >> (32 - sh);
+	}
+
+	if (cnt != n)
+		return NULL;
+	*base = last;
+	return p + nw * sizeof(w);
+}
+
+/*
+ * The term frequencies of a block follow its ids and are stored the
+ * same way, minus one but without the deltas.  The tfs are
+ * overwritten.
+ */
+size_t
+postings_encode_tf(uint8_t *out, uint32_t *tfs, size_t n)
+{
+	size_t i, len = 0;
+	int bits = 0;
+
+	for (i = 0; i < n; ++i)
+		tfs[i]--;
+
+	if (n < DB_BLOCKLEN) {
+		for (i = 0; i < n; ++i)
+			len += vb_encode(out + len, tfs[i]);
+		return len;
+	}
+
+	for (i = 0; i < n; ++i)
+		if (bitwidth(tfs[i]) > bits)
+			bits = bitwidth(tfs[i]);
+
+	*out++ = bits;
+	pack(out, tfs, bits);
+	return 1 + LANES * sizeof(uint32_t) * bits;
+}
+
+/*
+ * Decode the n term frequencies at p, or just skip them if tfs is
+ * NULL.  Returns like postings_decode().
+ */
+const uint8_t *
+postings_decode_tf(const uint8_t *p, const uint8_t *end, uint32_t *tfs,
+    size_t n)
+{
+	size_t i;
+	uint32_t x;
+	int bits;
+
+	if (n < DB_BLOCKLEN) {
+		for (i = 0; i < n; ++i) {
+			if ((p = vb_decode(p, end, &x)) == NULL)
+				return NULL;
+			if (tfs != NULL)
+				tfs[i] = x + 1;
+		}
+		return p;
+	}
+
+	if (p >= end)
+		return NULL;
+	bits = *p++;
+	if (bits > 32 || p + LANES * sizeof(uint32_t) * bits > end)
+		return NULL;
+
+	if (tfs != NULL)
+		unpack(tfs, p, bits, 0, 0);
+	return p + LANES * sizeof(uint32_t) * bits;
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "proto.h"
+
+#define PROTO_BUFSIZ	(64 * 1024)
+
+void
+proto_init(struct proto *p, int fd)
+{
+	memset(p, 0, sizeof(*p));
+	p->fd = fd;
+}
+
+/* make sure there are at least n bytes available in the input buffer */
+static int
+proto_fill(struct proto *p, size_t n)
+{
+	size_t avail, newcap;
+	ssize_t r;
+	void *t;
+
+	avail = p->inlen - p->inpos;
+	if (avail >= n)
+		return 1;
+
+	if (p->inpos > 0) {
+		memmove(p->in, p->in + p->inpos, avail);
+		p->inlen = avail;
+		p->inpos = 0;
+	}
+
+	if (n > p->incap) {
+		newcap = n < PROTO_BUFSIZ ? PROTO_BUFSIZ : n;
+		if ((t = realloc(p->in, newcap)) == NULL)
+			return -1;
+		p->in = t;
+		p->incap = newcap;
+	}
+
+	while (p->inlen < n) {
+		r = read(p->fd, p->in + p->inlen, p->incap - p->inlen);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1)
+			return -1;
+		if (r == 0)
+			return 0;
+		p->inlen += r;
+	}
+
+	return 1;
+}
+
+/*
+ * Read the next frame.  On success data points to a NUL-terminated
+ * copy of its payload, valid until the next call.  Returns 1 on
+ * success, 0 at the end of file or -1 on error.  A PROTO_ERR frame
+ * has no payload.
+ */
+int
+proto_read(struct proto *p, char **data, uint32_t *len)
+{
+	uint32_t l;
+	void *t;
+	int r;
+
+	if ((r = proto_fill(p, sizeof(l))) != 1)
+		return r;
+	memcpy(&l, p->in + p->inpos, sizeof(l));
+	*len = l = ntohl(l);
+
+	if (l == PROTO_ERR) {
+		p->inpos += sizeof(l);
+		*data = NULL;
+		return 1;
+	}
+
+	if (l > PROTO_MAXLEN)
+		return -1;
+
+	if (proto_fill(p, sizeof(l) + l) != 1)
+		return -1;
+	p->inpos += sizeof(l);
+
+	if (l >= p->framecap) {
+		if ((t = realloc(p->frame, l + 1)) == NULL)
+			return -1;
+		p->frame = t;
+		p->framecap = l + 1;
+	}
+	memcpy(p->frame, p->in + p->inpos, l);
+	p->frame[l] = '\0';
+	p->inpos += l;
+
+	*data = p->frame;
+	return 1;
+}
+
+/* whether a whole frame has been read and waits for proto_read() */
+int
+proto_pending(struct proto *p)
+{
+	size_t avail;
+	uint32_t l;
+
+	avail = p->inlen - p->inpos;
+	if (avail < sizeof(l))
+		return 0;
+	memcpy(&l, p->in + p->inpos, sizeof(l));
+	l = ntohl(l);
+
+	/* let proto_read() deal with the bad ones */
+	if (l == PROTO_ERR || l > PROTO_MAXLEN)
+		return 1;
+	return avail - sizeof(l) >= l;
+}
+
+/*
+ * Read what's available without blocking.  Returns 1 if there's a
+ * whole frame for proto_read(), 0 if not yet, or -1 on error or at
+ * the end of file.
+ */
+int
+proto_poll(struct proto *p)
+{
+	size_t avail, newcap;
+	ssize_t r;
+	void *t;
+
+	if (proto_pending(p))
+		return 1;
+
+	avail = p->inlen - p->inpos;
+	if (p->inpos > 0) {
+		memmove(p->in, p->in + p->inpos, avail);
+		p->inlen = avail;
+		p->inpos = 0;
+	}
+
+	/* a frame can be up to the header plus PROTO_MAXLEN */
+	if (p->inlen == p->incap) {
+		newcap = p->incap == 0 ? PROTO_BUFSIZ : p->incap * 2;
+		if (newcap > sizeof(uint32_t) + PROTO_MAXLEN)
+			newcap = sizeof(uint32_t) + PROTO_MAXLEN;
+		if (newcap == p->incap)
+			return -1;
+		if ((t = realloc(p->in, newcap)) == NULL)
+			return -1;
+		p->in = t;
+		p->incap = newcap;
+	}
+
+	r = recv(p->fd, p->in + p->inlen, p->incap - p->inlen, MSG_DONTWAIT);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	if (r <= 0)
+		return -1;
+	p->inlen += r;
+	return proto_pending(p);
+}
+
+static int
+write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = write(fd, buf, len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1)
+			return -1;
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+int
+proto_flush(struct proto *p)
+{
+	if (write_all(p->fd, p->out, p->outlen) == -1)
+		return -1;
+	p->outlen = 0;
+	return 0;
+}
+
+/* queue len bytes; the output is sent once it gets big enough */
+int
+proto_add(struct proto *p, const void *data, size_t len)
+{
+	size_t newcap;
+	void *t;
+
+	if (p->outlen + len > p->outcap) {
+		if (p->outlen > 0 && proto_flush(p) == -1)
+			return -1;
+		if (len > PROTO_BUFSIZ)
+			return write_all(p->fd, data, len);
+		if (p->outcap < PROTO_BUFSIZ) {
+			newcap = PROTO_BUFSIZ;
+			if ((t = realloc(p->out, newcap)) == NULL)
+				return -1;
+			p->out = t;
+			p->outcap = newcap;
+		}
+	}
+
+	memcpy(p->out + p->outlen, data, len);
+	p->outlen += len;
+	return 0;
+}
+
+/* start a frame of len bytes, or an error frame */
+int
+proto_begin(struct proto *p, uint32_t len)
+{
+	if (len != PROTO_ERR && len > PROTO_MAXLEN)
+		return -1;
+	len = htonl(len);
+	return proto_add(p, &len, sizeof(len));
+}
+
+void
+proto_free(struct proto *p)
+{
+	free(p->in);
+	free(p->out);
+	free(p->frame);
+	memset(p, 0, sizeof(*p));
+}
@@ -0,0 +1,732 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "segments.h"
+
+/* times the manifest is read again if a segment is merged meanwhile */
+#define SEGS_RETRY	3
+
+/* a segment is rewritten when more than 1/SEGS_DELETED is deleted */
+#define SEGS_DELETED	4
+
+static const char *
+base_name(const char *path)
+{
+	const char *s;
+
+	if ((s = strrchr(path, '/')) != NULL)
+		return s + 1;
+	return path;
+}
+
+/* the path of the file name in the directory of the database */
+static int
+seg_path(char *buf, size_t size, const char *path, const char *name)
+{
+	int r;
+
+	r = snprintf(buf, size, "%.*s%s", (int)(base_name(path) - path),
+	    path, name);
+	if (r < 0 || (size_t)r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+suffix_path(char *buf, size_t size, const char *path, const char *suffix)
+{
+	int r;
+
+	r = snprintf(buf, size, "%s%s", path, suffix);
+	if (r < 0 || (size_t)r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+free_names(char **names, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i)
+		free(names[i]);
+	free(names);
+}
+
+static int
+add_name(char ***names, size_t *len, const char *name)
+{
+	char **t;
+
+	if ((t = reallocarray(*names, *len + 1, sizeof(*t))) == NULL)
+		return -1;
+	*names = t;
+	if ((t[*len] = strdup(name)) == NULL)
+		return -1;
+	(*len)++;
+	return 0;
+}
+
+/*
+ * Read the names of the segments.  Without a manifest the database is
+ * the only segment.
+ */
+static int
+read_names(const char *path, char ***names, size_t *len)
+{
+	FILE *fp;
+	char mpath[PATH_MAX], *line = NULL;
+	size_t linesize = 0;
+	ssize_t linelen;
+	int ret = -1;
+
+	*names = NULL;
+	*len = 0;
+
+	if (suffix_path(mpath, sizeof(mpath), path, SEGS_SUFFIX) == -1)
+		return -1;
+	if ((fp = fopen(mpath, "r")) == NULL) {
+		if (errno != ENOENT)
+			return -1;
+		return add_name(names, len, base_name(path));
+	}
+
+	while ((linelen = getline(&line, &linesize, fp)) != -1) {
+		if (linelen > 0 && line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen == 0)
+			continue;
+		if (strchr(line, '/') != NULL) {
+			errno = EINVAL;
+			goto done;
+		}
+		if (add_name(names, len, line) == -1)
+			goto done;
+	}
+	if (ferror(fp))
+		goto done;
+	if (*len == 0) {
+		errno = EINVAL;
+		goto done;
+	}
+	ret = 0;
+
+done:
+	if (ret == -1) {
+		free_names(*names, *len);
+		*names = NULL;
+		*len = 0;
+	}
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+/* create a temporary file next to path, with the usual permissions */
+int
+segments_tmpfile(const char *path, char *tmppath, size_t size)
+{
+	mode_t mask;
+	int r, fd;
+
+	r = snprintf(tmppath, size, "%s.XXXXXXXXXX", path);
+	if (r < 0 || (size_t)r >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if ((fd = mkstemp(tmppath)) == -1)
+		return -1;
+	mask = umask(0);
+	umask(mask);
+	if (fchmod(fd, 0666 & ~mask) == -1) {
+		unlink(tmppath);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* replace the manifest */
+static int
+write_names(const char *path, char **names, size_t len)
+{
+	FILE *fp;
+	char mpath[PATH_MAX], tmp[PATH_MAX];
+	size_t i;
+	int fd;
+
+	if (suffix_path(mpath, sizeof(mpath), path, SEGS_SUFFIX) == -1 ||
+	    (fd = segments_tmpfile(mpath, tmp, sizeof(tmp))) == -1)
+		return -1;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		unlink(tmp);
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < len; ++i)
+		if (fprintf(fp, "%s\n", names[i]) < 0)
+			break;
+	if (i != len || fflush(fp) == EOF || fsync(fd) == -1) {
+		unlink(tmp);
+		fclose(fp);
+		return -1;
+	}
+	if (fclose(fp) == EOF || rename(tmp, mpath) == -1) {
+		unlink(tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The changes to the manifest are serialized by a lock on a file of
+ * their own, and so are the merges by another one.
+ */
+static int
+lock(const char *path, const char *suffix)
+{
+	char lpath[PATH_MAX];
+	int fd;
+
+	if (suffix_path(lpath, sizeof(lpath), path, suffix) == -1)
+		return -1;
+	if ((fd = open(lpath, O_RDWR | O_CREAT, 0666)) == -1)
+		return -1;
+	if (flock(fd, LOCK_EX) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+open_names(struct segments *segs, const char *path, char **names,
+    size_t len)
+{
+	char spath[PATH_MAX];
+	uint64_t total = 0;
+	size_t i;
+	int fd, r, saved;
+
+	memset(segs, 0, sizeof(*segs));
+	segs->dbs = calloc(len, sizeof(*segs->dbs));
+	segs->bases = calloc(len, sizeof(*segs->bases));
+	if (segs->dbs == NULL || segs->bases == NULL)
+		goto err;
+
+	for (i = 0; i < len; ++i) {
+		if (seg_path(spath, sizeof(spath), path, names[i]) == -1 ||
+		    (fd = open(spath, O_RDONLY)) == -1)
+			goto err;
+		r = db_open(&segs->dbs[i], fd);
+		close(fd);
+		if (r == -1)
+			goto err;
+		segs->len++;
+
+		if (strlcat(spath, DB_DEL_SUFFIX, sizeof(spath)) >=
+		    sizeof(spath)) {
+			errno = ENAMETOOLONG;
+			goto err;
+		}
+		if ((fd = open(spath, O_RDONLY)) == -1) {
+			if (errno != ENOENT)
+				goto err;
+		} else {
+			r = db_open_deleted(&segs->dbs[i], fd);
+			close(fd);
+			if (r == -1)
+				goto err;
+		}
+
+		segs->bases[i] = total;
+		total += segs->dbs[i].ndocs;
+		if (total > INT32_MAX) {
+			errno = EFBIG;
+			goto err;
+		}
+	}
+
+	segs->names = names;
+	segs->ndocs = total;
+	return 0;
+
+err:
+	saved = errno;
+	segs->names = NULL;
+	segments_close(segs);
+	errno = saved;
+	return -1;
+}
+
+/*
+ * Open all the segments of the database at path.  A merge may replace
+ * some of them between the reading of the manifest and the opening of
+ * the files, in which case it's read again.
+ */
+int
+segments_open(struct segments *segs, const char *path)
+{
+	char **names;
+	size_t len;
+	int try;
+
+	for (try = 0; ; ++try) {
+		if (read_names(path, &names, &len) == -1)
+			return -1;
+		if (open_names(segs, path, names, len) == 0)
+			return 0;
+		free_names(names, len);
+		if (errno != ENOENT || try == SEGS_RETRY)
+			return -1;
+	}
+}
+
+int
+segments_listall(struct segments *segs, db_hit_cb cb, void *data)
+{
+	size_t i;
+
+	for (i = 0; i < segs->len; ++i)
+		if (db_listall(&segs->dbs[i], cb, data) == -1)
+			return -1;
+	return 0;
+}
+
+int
+segments_doc_by_id(struct segments *segs, uint32_t docid,
+    struct db_entry *e)
+{
+	size_t lo, hi, mid;
+
+	if (docid >= segs->ndocs)
+		return -1;
+
+	/* the last segment that starts before docid */
+	lo = 0;
+	hi = segs->len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (segs->bases[mid] <= docid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return db_doc_by_id(&segs->dbs[lo - 1], docid - segs->bases[lo - 1],
+	    e);
+}
+
+void
+segments_close(struct segments *segs)
+{
+	size_t i;
+
+	for (i = 0; i < segs->len; ++i)
+		db_close(&segs->dbs[i]);
+	free(segs->dbs);
+	free(segs->bases);
+	free_names(segs->names, segs->len);
+	memset(segs, 0, sizeof(*segs));
+}
+
+/* remove the segment name and its deleted documents */
+static void
+unlink_segment(const char *path, const char *name)
+{
+	char spath[PATH_MAX];
+
+	if (seg_path(spath, sizeof(spath), path, name) == -1)
+		return;
+	unlink(spath);
+	if (strlcat(spath, DB_DEL_SUFFIX, sizeof(spath)) < sizeof(spath))
+		unlink(spath);
+}
+
+/* add the file made by segments_tmpfile() as the newest segment */
+int
+segments_add(const char *path, const char *file)
+{
+	char **names;
+	size_t len;
+	int fd, r = -1;
+
+	if ((fd = lock(path, SEGS_LOCK)) == -1)
+		return -1;
+	if (read_names(path, &names, &len) == 0) {
+		if (add_name(&names, &len, base_name(file)) == 0)
+			r = write_names(path, names, len);
+		free_names(names, len);
+	}
+	close(fd);
+	return r;
+}
+
+/*
+ * Put tmppath in place of the len segments names of the database at
+ * path, with the lock of the manifest held.  The manifest goes first,
+ * so the old segments are never paired with the new database.
+ */
+static int
+replace_all(const char *path, const char *tmppath, char **names,
+    size_t len)
+{
+	char mpath[PATH_MAX], dpath[PATH_MAX];
+	size_t i;
+
+	if (suffix_path(mpath, sizeof(mpath), path, SEGS_SUFFIX) == -1 ||
+	    suffix_path(dpath, sizeof(dpath), path, DB_DEL_SUFFIX) == -1 ||
+	    (unlink(mpath) == -1 && errno != ENOENT) ||
+	    (unlink(dpath) == -1 && errno != ENOENT) ||
+	    rename(tmppath, path) == -1)
+		return -1;
+
+	for (i = 0; i < len; ++i)
+		if (strcmp(names[i], base_name(path)))
+			unlink_segment(path, names[i]);
+	return 0;
+}
+
+/* replace the whole database at path with the one in tmppath */
+int
+segments_replace(const char *path, const char *tmppath)
+{
+	char **names;
+	size_t len;
+	int fd, r = -1;
+
+	if ((fd = lock(path, SEGS_LOCK)) == -1)
+		return -1;
+	if (read_names(path, &names, &len) == 0) {
+		r = replace_all(path, tmppath, names, len);
+		free_names(names, len);
+	}
+	close(fd);
+	return r;
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+	const char *const *x = a, *const *y = b;
+
+	return strcmp(*x, *y);
+}
+
+/* write the sidecar with the deleted documents of the segment name */
+static int
+write_deleted(const char *path, const char *name, const uint8_t *bits,
+    uint32_t ndocs)
+{
+	char dpath[PATH_MAX], tmp[PATH_MAX];
+	int fd;
+
+	if (seg_path(dpath, sizeof(dpath), path, name) == -1)
+		return -1;
+	if (strlcat(dpath, DB_DEL_SUFFIX, sizeof(dpath)) >= sizeof(dpath)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	if ((fd = segments_tmpfile(dpath, tmp, sizeof(tmp))) == -1)
+		return -1;
+	if (db_write_deleted(fd, bits, ndocs) == -1 || fsync(fd) == -1 ||
+	    rename(tmp, dpath) == -1) {
+		unlink(tmp);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Mark as deleted the documents with one of the n names, which are
+ * sorted in place, and store in ndel how many they were.  The merges
+ * are locked out too, so that none drops the new deletions.
+ */
+int
+segments_delete(const char *path, char **names, size_t n, size_t *ndel)
+{
+	struct segments segs;
+	struct db_entry e;
+	struct db *db;
+	uint8_t *bits;
+	char **snames;
+	size_t i, len, ndeleted;
+	uint32_t id;
+	int lfd, mfd, r = -1;
+
+	*ndel = 0;
+	qsort(names, n, sizeof(*names), name_cmp);
+
+	if ((mfd = lock(path, SEGS_MERGE_LOCK)) == -1)
+		return -1;
+	if ((lfd = lock(path, SEGS_LOCK)) == -1) {
+		close(mfd);
+		return -1;
+	}
+	if (read_names(path, &snames, &len) == -1)
+		goto done;
+	if (open_names(&segs, path, snames, len) == -1) {
+		free_names(snames, len);
+		goto done;
+	}
+
+	for (i = 0; i < segs.len; ++i) {
+		db = &segs.dbs[i];
+		if ((bits = calloc(1, (db->ndocs + 7) / 8 + 1)) == NULL)
+			break;
+		if (db->deleted != NULL)
+			memcpy(bits, db->deleted, (db->ndocs + 7) / 8);
+
+		for (ndeleted = 0, id = 0; id < db->ndocs; ++id) {
+			if (db_doc_by_id(db, id, &e) == -1)
+				continue;
+			if (bsearch(&e.name, names, n, sizeof(*names),
+			    name_cmp) == NULL)
+				continue;
+			bits[id >> 3] |= 1 << (id & 7);
+			ndeleted++;
+		}
+
+		if (ndeleted > 0 &&
+		    write_deleted(path, segs.names[i], bits, db->ndocs) == -1) {
+			free(bits);
+			break;
+		}
+		free(bits);
+		*ndel += ndeleted;
+	}
+	if (i == segs.len)
+		r = 0;
+	segments_close(&segs);
+
+done:
+	close(lfd);
+	close(mfd);
+	return r;
+}
+
+static inline uint32_t
+live(struct db *db)
+{
+	return db->ndocs - db->ndeleted;
+}
+
+struct collect {
+	struct db_entry	*entries;
+	size_t		 len;
+	size_t		 cap;
+};
+
+static int
+collect_doc(struct db *db, struct db_entry *e, void *data)
+{
+	struct collect *c = data;
+
+	if (c->len == c->cap)
+		return -1;
+	c->entries[c->len++] = *e;
+	return 0;
+}
+
+/* write the segments from start to end of segs to fd as one */
+static int
+merge_into(int fd, struct segments *segs, size_t start, size_t end)
+{
+	struct collect c;
+	FILE *spill;
+	int64_t *offs;
+	uint32_t flags, base;
+	size_t i, n;
+	int r = -1;
+
+	flags = segs->dbs[start].flags;
+	for (n = 0, i = start; i < end; ++i)
+		n += segs->dbs[i].ndocs - segs->dbs[i].ndeleted;
+
+	c.len = 0;
+	c.cap = n;
+	c.entries = calloc(n != 0 ? n : 1, sizeof(*c.entries));
+	offs = calloc(end - start + 1, sizeof(*offs));
+	if (c.entries == NULL || offs == NULL || (spill = tmpfile()) == NULL) {
+		free(c.entries);
+		free(offs);
+		return -1;
+	}
+
+	for (i = start; i < end; ++i) {
+		base = c.len;
+		if (segs->dbs[i].flags != flags ||
+		    db_listall(&segs->dbs[i], collect_doc, &c) == -1)
+			goto done;
+		if ((offs[i - start] = ftello(spill)) == -1 ||
+		    db_dump(spill, &segs->dbs[i], base) == -1)
+			goto done;
+	}
+	if ((offs[end - start] = ftello(spill)) == -1 || c.len != n)
+		goto done;
+
+	r = db_create_merge(fd, spill, offs, end - start, c.entries, n,
+	    flags & DB_POSITIONS);
+
+done:
+	fclose(spill);
+	free(c.entries);
+	free(offs);
+	return r;
+}
+
+/*
+ * Merge the newest segments while the one before them is no bigger
+ * than all of them together, so that every document is rewritten only
+ * O(log n) times, or all of them if all is set.  Without anything to
+ * merge, the segment with the highest share of deleted documents is
+ * rewritten if more than 1/SEGS_DELETED of them are, or if all is set
+ * and it has any.  The deleted documents are dropped and the ids of
+ * the others shift.  When every segment is merged the result takes the
+ * place of the database at path, without a manifest.  Only one merge
+ * runs at a time, but the other writers are locked out only while the
+ * manifest is read and replaced: the merged segments are looked up
+ * again at the end, since others may have been added meanwhile.
+ */
+int
+segments_merge(const char *path, int all)
+{
+	struct segments segs;
+	struct db *d;
+	char tmp[PATH_MAX], **names = NULL, **merged;
+	uint64_t sum;
+	size_t i, j, k, e, len, m;
+	int fd, lfd, mfd, single = 0, r = -1;
+
+	if ((mfd = lock(path, SEGS_MERGE_LOCK)) == -1)
+		return -1;
+	if ((lfd = lock(path, SEGS_LOCK)) == -1) {
+		close(mfd);
+		return -1;
+	}
+	if (read_names(path, &names, &len) == -1) {
+		close(lfd);
+		close(mfd);
+		return -1;
+	}
+	if (open_names(&segs, path, names, len) == -1) {
+		free_names(names, len);
+		close(lfd);
+		close(mfd);
+		return -1;
+	}
+	close(lfd);
+
+	e = segs.len;
+	k = e - 1;
+	sum = live(&segs.dbs[k]);
+	while (k > 0 && (all || live(&segs.dbs[k - 1]) <= sum))
+		sum += live(&segs.dbs[--k]);
+
+	/* otherwise rewrite the one with most deletions, if too many */
+	if (e - k < 2) {
+		for (k = segs.len, i = 0; i < segs.len; ++i) {
+			d = &segs.dbs[i];
+			if (d->ndeleted == 0 || (!all &&
+			    (uint64_t)d->ndeleted * SEGS_DELETED <= d->ndocs))
+				continue;
+			if (k == segs.len || (uint64_t)d->ndeleted *
+			    segs.dbs[k].ndocs > (uint64_t)segs.dbs[k].ndeleted *
+			    d->ndocs)
+				k = i;
+		}
+		if (k == segs.len) {
+			segments_close(&segs);
+			close(mfd);
+			return 0;
+		}
+		e = k + 1;
+	}
+	merged = segs.names + k;
+	m = e - k;
+
+	if ((fd = segments_tmpfile(path, tmp, sizeof(tmp))) == -1) {
+		segments_close(&segs);
+		close(mfd);
+		return -1;
+	}
+	if (merge_into(fd, &segs, k, e) == -1 || fsync(fd) == -1)
+		goto done;
+
+	if ((lfd = lock(path, SEGS_LOCK)) == -1)
+		goto done;
+	if (read_names(path, &names, &len) == -1) {
+		close(lfd);
+		goto done;
+	}
+	for (j = 0; j + m <= len; ++j) {
+		for (i = 0; i < m; ++i)
+			if (strcmp(names[j + i], merged[i]))
+				break;
+		if (i == m)
+			break;
+	}
+	if (j == 0 && m == len) {
+		/* all of them: back to a database of a single file */
+		single = 1;
+		r = replace_all(path, tmp, names, len);
+	} else if (j + m <= len) {
+		free(names[j]);
+		if ((names[j] = strdup(base_name(tmp))) != NULL) {
+			for (i = 1; i < m; ++i)
+				free(names[j + i]);
+			memmove(names + j + 1, names + j + m,
+			    (len - j - m) * sizeof(*names));
+			len -= m - 1;
+			r = write_names(path, names, len);
+		}
+	} else
+		errno = EAGAIN;
+	close(lfd);
+	free_names(names, len);
+
+	if (r == 0 && !single)
+		for (i = 0; i < m; ++i)
+			unlink_segment(path, merged[i]);
+
+done:
+	if (r == -1)
+		unlink(tmp);
+	close(fd);
+	segments_close(&segs);
+	close(mfd);
+	return r;
+}
@@ -14,9 +14,16 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <ctype.h>
-#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__GNUC__) && (defined(__amd64__) || defined(__x86_64__))
+#define X86_SIMD
+#include <immintrin.h>
+#endif
 
 #include "tokenize.h"
 
@@ -25,61 +32,252 @@
 #define WDELIMS " \t\n!\"#$%&'()*+,-./0123456789:;<=>?@[\\]^_`{|}~"
 #endif
 
-char **
-tokenize(const char *s)
+/*
+ * The character class tables are computed at compile time from
+ * WDELIMS, which can't be longer than 64 characters.
+ */
+#define NDELIMS		(sizeof(WDELIMS) - 1)
+typedef char wdelims_too_long[NDELIMS <= 64 ? 1 : -1];
+
+#define DELIM(i)	((unsigned char)WDELIMS[(i) < NDELIMS ? (i) : 0])
+#define D(c, i)		((i) < NDELIMS && DELIM(i) == (c))
+#define D4(c, i)	(D(c, i) || D(c, i+1) || D(c, i+2) || D(c, i+3))
+#define D16(c, i)	(D4(c, i) || D4(c, i+4) || D4(c, i+8) || D4(c, i+12))
+#define D64(c)		(D16(c, 0) || D16(c, 16) || D16(c, 32) || D16(c, 48))
+
+/* a lowercase byte is part of a word unless it's NUL or a delimiter */
+#define ISW(c)		((c) != 0 && !D64(c))
+#define LOWER(c)	((c) >= 'A' && (c) <= 'Z' ? (c) + 'a' - 'A' : (c))
+#define W(c)		(ISW(LOWER(c)) ? LOWER(c) : 0)
+
+#define W4(c)		W(c), W(c+1), W(c+2), W(c+3)
+#define W16(c)		W4(c), W4(c+4), W4(c+8), W4(c+12)
+#define W64(c)		W16(c), W16(c+16), W16(c+32), W16(c+48)
+
+/* the lowercase byte if it's part of a word, 0 otherwise */
+static const uint8_t wtab[256] = {
+	W64(0), W64(64), W64(128), W64(192),
+};
+
+static void
+classify_scalar(const uint8_t *s, size_t n, uint8_t *low, uint32_t *bits)
 {
-	char *d, *dup, *t, **tok = NULL;
-	void *newtok;
-	size_t cap = 0, len = 0, newcap;
-
-	if ((dup = strdup(s)) == NULL)
-		return NULL;
-	d = dup;
-
-	for (t = d; *t; ++t)
-		*t = tolower((unsigned char)*t);
-
-	while ((t = strsep(&d, WDELIMS)) != NULL) {
-		if (*t == '\0')
-			continue;
-
-		/* keep the space for a NULL terminator */
-		if (len+1 >= cap) {
-			newcap = cap * 1.5;
-			if (newcap == 0)
-				newcap = 8;
-			newtok = recallocarray(tok, cap, newcap,
-			    sizeof(char *));
-			if (newtok == NULL)
-				goto err;
-			tok = newtok;
-			cap = newcap;
-		}
+	size_t i;
 
-		if ((tok[len++] = strdup(t)) == NULL)
-			goto err;
+	memset(bits, 0, (n + 31) / 32 * sizeof(*bits));
+	for (i = 0; i < n; ++i) {
+		low[i] = wtab[s[i]];
+		if (low[i] != 0)
+			bits[i / 32] |= 1U << (i % 32);
 	}
+}
+
+#ifdef X86_SIMD
+
+/*
+ * The set of the word bytes as a 16x16 bitmap: bit h of row l tells
+ * whether (h << 4 | l) is part of a word.  pshufb can then look up 16
+ * bytes at a time.
+ */
+#define B(h, l)		(ISW((h) << 4 | (l)) << ((h) & 7))
+#define B8(h, l)	(B(h, l) | B(h+1, l) | B(h+2, l) | B(h+3, l) | \
+			    B(h+4, l) | B(h+5, l) | B(h+6, l) | B(h+7, l))
+#define ROWS(h)		B8(h, 0), B8(h, 1), B8(h, 2), B8(h, 3), \
+			    B8(h, 4), B8(h, 5), B8(h, 6), B8(h, 7), \
+			    B8(h, 8), B8(h, 9), B8(h, 10), B8(h, 11), \
+			    B8(h, 12), B8(h, 13), B8(h, 14), B8(h, 15)
+
+static const uint8_t rows_lo[16] = { ROWS(0) };
+static const uint8_t rows_hi[16] = { ROWS(8) };
+static const uint8_t hibit[16] = {
+	1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128,
+};
+
+/*
+ * Lowercase 16 bytes, then look them up in the bitmap.  Returns the
+ * mask of the bytes that are part of a word.
+ */
+__attribute__((target("ssse3")))
+static inline uint32_t
+classify16(const uint8_t *s, uint8_t *low)
+{
+	__m128i v, up, lo, hi, row, bit;
+
+	v = _mm_loadu_si128((const __m128i *)s);
+	up = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+	    _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+	v = _mm_add_epi8(v, _mm_and_si128(up, _mm_set1_epi8('a' - 'A')));
+	_mm_storeu_si128((__m128i *)low, v);
+
+	lo = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+	hi = _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
 
-	free(dup);
-	if (tok == NULL)
-		return calloc(1, sizeof(char *));
-	return tok;
+	row = _mm_or_si128(
+	    _mm_and_si128(_mm_cmplt_epi8(hi, _mm_set1_epi8(8)),
+		_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)rows_lo),
+		lo)),
+	    _mm_andnot_si128(_mm_cmplt_epi8(hi, _mm_set1_epi8(8)),
+		_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)rows_hi),
+		lo)));
+	bit = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)hibit), hi);
 
-err:
-	freetoks(tok);
-	free(dup);
-	return NULL;
+	return _mm_movemask_epi8(
+	    _mm_cmpeq_epi8(_mm_and_si128(row, bit), bit));
 }
 
-void
-freetoks(char **tok)
+__attribute__((target("ssse3")))
+static void
+classify_ssse3(const uint8_t *s, size_t n, uint8_t *low, uint32_t *bits)
 {
-	char **i;
+	size_t i;
+
+	for (i = 0; i + 32 <= n; i += 32)
+		bits[i / 32] = classify16(s + i, low + i) |
+		    classify16(s + i + 16, low + i + 16) << 16;
+	classify_scalar(s + i, n - i, low + i, bits + i / 32);
+}
+
+/* same as classify_ssse3, but 32 bytes at a time */
+__attribute__((target("avx2")))
+static void
+classify_avx2(const uint8_t *s, size_t n, uint8_t *low, uint32_t *bits)
+{
+	__m256i v, up, lo, hi, ishi, row, bit, rlo, rhi, hb, m0f;
+	size_t i;
+
+	rlo = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)rows_lo));
+	rhi = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)rows_hi));
+	hb = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)hibit));
+	m0f = _mm256_set1_epi8(0x0f);
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		up = _mm256_and_si256(
+		    _mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+		    _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+		v = _mm256_add_epi8(v,
+		    _mm256_and_si256(up, _mm256_set1_epi8('a' - 'A')));
+		_mm256_storeu_si256((__m256i *)(low + i), v);
+
+		lo = _mm256_and_si256(v, m0f);
+		hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), m0f);
+		ishi = _mm256_cmpgt_epi8(hi, _mm256_set1_epi8(7));
+
+		row = _mm256_blendv_epi8(_mm256_shuffle_epi8(rlo, lo),
+		    _mm256_shuffle_epi8(rhi, lo), ishi);
+		bit = _mm256_shuffle_epi8(hb, hi);
 
-	if (tok == NULL)
-		return;
+		bits[i / 32] = _mm256_movemask_epi8(
+		    _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit));
+	}
+	classify_scalar(s + i, n - i, low + i, bits + i / 32);
+}
+
+#endif
+
+/* index of the first bit equal to v at or after i, or n */
+static inline size_t
+nextbit(const uint32_t *bits, size_t i, size_t n, int v)
+{
+	uint32_t w;
+
+	while (i < n) {
+		w = v ? bits[i / 32] : ~bits[i / 32];
+		w &= ~0U << (i % 32);
+		if (w != 0) {
+			i = (i & ~(size_t)31) + ffs(w) - 1;
+			break;
+		}
+		i = (i & ~(size_t)31) + 32;
+	}
+
+	return i < n ? i : n;
+}
+
+/* a word that doesn't fit in the window */
+static int
+long_word(const char *s, size_t len, size_t *off, tokenize_cb cb,
+    void *data)
+{
+	size_t i, start = *off;
+	char *w;
+	int r;
+
+	while (*off < len && wtab[(unsigned char)s[*off]] != 0)
+		(*off)++;
+
+	if ((w = malloc(*off - start + 1)) == NULL)
+		return -1;
+	for (i = start; i < *off; ++i)
+		w[i - start] = wtab[(unsigned char)s[i]];
+	w[i - start] = '\0';
+
+	r = cb(w, i - start, data);
+	free(w);
+	return r;
+}
+
+#define WINDOW	4096
+
+/*
+ * Split the len bytes at s in words and call cb for each of them.  The
+ * words are lowercased and NUL-terminated in a scratch buffer which is
+ * reused, so they must be copied if needed after cb returns.  If cb
+ * returns -1 the tokenization is stopped and -1 returned.
+ *
+ * The input is processed in windows: every byte is lowercased and
+ * classified first, then the words are found by scanning the bitmap
+ * of the word bytes.
+ */
+int
+tokenize(const char *s, size_t len, tokenize_cb cb, void *data)
+{
+	void (*classify)(const uint8_t *, size_t, uint8_t *, uint32_t *);
+	uint8_t low[WINDOW + 1];
+	uint32_t bits[WINDOW / 32];
+	size_t off = 0, n, i, start, end;
+
+	classify = classify_scalar;
+#ifdef X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		classify = classify_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		classify = classify_ssse3;
+#endif
+
+	while (off < len) {
+		n = len - off;
+		if (n > WINDOW)
+			n = WINDOW;
+		classify((const uint8_t *)s + off, n, low, bits);
+
+		for (i = 0;;) {
+			if ((start = nextbit(bits, i, n, 1)) == n) {
+				off += n;
+				break;
+			}
+
+			end = nextbit(bits, start, n, 0);
+			if (end == n && off + n < len) {
+				/* the word may continue in the next window */
+				if (start == 0) {
+					if (long_word(s, len, &off, cb,
+					    data) == -1)
+						return -1;
+				} else
+					off += start;
+				break;
+			}
+
+			low[end] = '\0';
+			if (cb((char *)low + start, end - start, data) == -1)
+				return -1;
+			i = end;
+		}
+	}
 
-	for (i = tok; *i != NULL; ++i)
-		free(*i);
-	free(tok);
+	return 0;
 }
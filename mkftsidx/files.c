@@ -25,86 +25,87 @@
 
 #include "db.h"
 #include "dictionary.h"
-#include "tokenize.h"
 
 #include "mkftsidx.h"
 
 static int
-pfile(struct dictionary *dict, struct db_entry **entries, size_t *len,
-    size_t *cap, const char *path)
+pfile(struct dictionary *dict, size_t docid, void *data)
 {
-	char **toks;
+	struct db_entry *entries = data;
+	const char *path = entries[docid].name;
 	int fd;
 	off_t end;
 	void *m;
 
-	if (*len == *cap) {
-		size_t newcap;
-		void *t;
-
-		newcap = *cap * 1.5;
-		if (newcap == 0)
-			newcap = 8;
-		t = recallocarray(*entries, *cap, newcap, sizeof(**entries));
-		if (t == NULL)
-			err(1, "recallocarray");
-		*cap = newcap;
-		*entries = t;
-	}
-
 	if ((fd = open(path, O_RDONLY)) == -1) {
 		warnx("can't open %s", path);
-		return 0;
+		return -1;
 	}
 
 	if ((end = lseek(fd, 0, SEEK_END)) == -1)
 		err(1, "lseek %s", path);
 
-	end++;
+	if (end == 0) {
+		close(fd);
+		return 0;
+	}
+
 	m = mmap(NULL, end, PROT_READ, MAP_PRIVATE, fd, 0);
 	if (m == MAP_FAILED)
 		err(1, "can't mmap %s", path);
 
-	(*entries)[(*len)++].name = xstrdup(path);
-
-	if ((toks = tokenize(m)) == NULL)
-		err(1, "tokenize");
-	if (!dictionary_add_words(dict, toks, *len - 1))
+	if (!dictionary_add_words(dict, m, end, docid))
 		err(1, "dictionary_add_words");
-	freetoks(toks);
 	munmap(m, end);
 	close(fd);
-	return 1;
+	return 0;
+}
+
+static void
+add_path(struct db_entry **entries, size_t *len, size_t *cap,
+    const char *path)
+{
+	size_t newcap;
+	void *t;
+
+	if (*len == *cap) {
+		newcap = *cap * 1.5;
+		if (newcap == 0)
+			newcap = 8;
+		t = recallocarray(*entries, *cap, newcap, sizeof(**entries));
+		if (t == NULL)
+			err(1, "recallocarray");
+		*cap = newcap;
+		*entries = t;
+	}
+
+	(*entries)[(*len)++].name = xstrdup(path);
 }
 
 int
-idx_files(struct dictionary *dict, struct db_entry **entries, size_t *len,
-    int argc, char **argv)
+idx_files(struct dictionary *dict, int jobs, struct db_entry **entries,
+    size_t *len, int argc, char **argv)
 {
 	char *line = NULL;
 	size_t linesize = 0, cap = *len;
 	ssize_t linelen;
-	int r = 0;
 
 	if (argc > 0) {
 		while (*argv) {
-			if (!pfile(dict, entries, len, &cap, *argv))
-				r = 1;
+			add_path(entries, len, &cap, *argv);
 			argv++;
 		}
-		return r;
-	}
-
-	while ((linelen = getline(&line, &linesize, stdin)) != -1) {
-		if (linelen > 1 && line[linelen-1] == '\n')
-			line[linelen-1] = '\0';
+	} else {
+		while ((linelen = getline(&line, &linesize, stdin)) != -1) {
+			if (linelen > 1 && line[linelen-1] == '\n')
+				line[linelen-1] = '\0';
+			add_path(entries, len, &cap, line);
+		}
 
-		if (!pfile(dict, entries, len, &cap, line))
-			r = 1;
+		free(line);
+		if (ferror(stdin))
+			err(1, "getline");
 	}
 
-	free(line);
-	if (ferror(stdin))
-		err(1, "getline");
-	return r;
+	return index_docs(dict, jobs, 0, *len, pfile, *entries) == -1;
 }
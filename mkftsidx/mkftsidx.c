@@ -16,13 +16,17 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <util.h>
 
 #include "db.h"
 #include "dictionary.h"
+#include "segments.h"
 
 #include "mkftsidx.h"
 
@@ -32,6 +36,26 @@ enum {
 	MODE_WIKI,
 };
 
+struct worker {
+	pthread_t		 tid;
+	struct dictionary	 dict;
+	size_t			 start;
+	size_t			 end;
+	idx_fn			 fn;
+	void			*data;
+	int			 ret;
+};
+
+/* documents indexed by every thread between two memory checks */
+#define ROUND	4096
+
+static size_t	 membudget;
+static FILE	*spillfp;
+static int64_t	*runs;		/* offsets of the runs in spillfp */
+static size_t	 nruns;
+static uint32_t	*doclens;	/* words in every document */
+static size_t	 ndoclens;
+
 char *
 xstrdup(const char *s)
 {
@@ -45,11 +69,222 @@ xstrdup(const char *s)
 	return t;
 }
 
+/* index the document with fn and remember its length */
+static int
+index_doc(struct dictionary *dict, size_t docid, idx_fn fn, void *data)
+{
+	uint64_t n;
+	int r;
+
+	n = dict->ntokens;
+	r = fn(dict, docid, data);
+	n = dict->ntokens - n;
+	doclens[docid] = n > UINT32_MAX ? UINT32_MAX : n;
+	return r;
+}
+
+static void *
+worker_run(void *data)
+{
+	struct worker *w = data;
+	size_t i;
+
+	for (i = w->start; i < w->end; ++i)
+		if (index_doc(&w->dict, i, w->fn, w->data) == -1)
+			w->ret = -1;
+	return NULL;
+}
+
+/* save the postings collected so far in a new run and empty dict */
+static void
+spill(struct dictionary *dict)
+{
+	int64_t *t;
+	int positions;
+
+	if ((t = reallocarray(runs, nruns + 2, sizeof(*runs))) == NULL)
+		err(1, "reallocarray");
+	runs = t;
+
+	if (spillfp == NULL) {
+		if ((spillfp = tmpfile()) == NULL)
+			err(1, "tmpfile");
+		runs[0] = 0;
+	}
+
+	dictionary_sort(dict);
+	if (db_spill(spillfp, dict) == -1 ||
+	    (runs[nruns + 1] = ftello(spillfp)) == -1)
+		err(1, "db_spill");
+	nruns++;
+
+	positions = dict->positions;
+	dictionary_free(dict);
+	if (!dictionary_init(dict))
+		err(1, "dictionary_init");
+	dict->positions = positions;
+}
+
+static inline void
+check_mem(struct dictionary *dict)
+{
+	if (membudget != 0 && dict->mem > membudget)
+		spill(dict);
+}
+
+/*
+ * Call fn for every document in [start, end).  With more than one job
+ * the documents are processed in rounds: every thread indexes a
+ * contiguous range of documents in its own dictionary and they're
+ * appended to dict in order at the end of the round.  Returns -1 if fn
+ * failed for any document.
+ */
+int
+index_docs(struct dictionary *dict, int jobs, size_t start, size_t end,
+    idx_fn fn, void *data)
+{
+	struct worker *ws;
+	size_t i, n, per, last;
+	int r, ret = 0;
+	void *t;
+
+	if (end > ndoclens) {
+		t = recallocarray(doclens, ndoclens, end, sizeof(*doclens));
+		if (t == NULL)
+			err(1, "recallocarray");
+		doclens = t;
+		ndoclens = end;
+	}
+
+	if (jobs == 1 || end - start <= 1) {
+		for (i = start; i < end; ++i) {
+			if (index_doc(dict, i, fn, data) == -1)
+				ret = -1;
+			check_mem(dict);
+		}
+		return ret;
+	}
+
+	if ((ws = calloc(jobs, sizeof(*ws))) == NULL)
+		err(1, "calloc");
+
+	for (; start < end; start = last) {
+		last = end;
+		if (last - start > (size_t)jobs * ROUND)
+			last = start + (size_t)jobs * ROUND;
+
+		n = jobs;
+		if (n > last - start)
+			n = last - start;
+
+		per = (last - start + n - 1) / n;
+		for (i = 0; i < n; ++i) {
+			ws[i].start = start + i * per;
+			ws[i].end = ws[i].start + per;
+			if (ws[i].end > last)
+				ws[i].end = last;
+			ws[i].fn = fn;
+			ws[i].data = data;
+			if (!dictionary_init(&ws[i].dict))
+				err(1, "dictionary_init");
+			ws[i].dict.positions = dict->positions;
+
+			r = pthread_create(&ws[i].tid, NULL, worker_run,
+			    &ws[i]);
+			if (r != 0)
+				errc(1, r, "pthread_create");
+		}
+
+		for (i = 0; i < n; ++i) {
+			if ((r = pthread_join(ws[i].tid, NULL)) != 0)
+				errc(1, r, "pthread_join");
+			if (!dictionary_append(dict, &ws[i].dict))
+				err(1, "dictionary_append");
+			dictionary_free(&ws[i].dict);
+			if (ws[i].ret == -1)
+				ret = -1;
+		}
+
+		check_mem(dict);
+	}
+
+	free(ws);
+	return ret;
+}
+
+/* merge the segments without making the caller wait */
+static void
+merge_later(const char *dbpath)
+{
+	switch (fork()) {
+	case -1:
+		warn("fork");
+		break;
+	case 0:
+		if (segments_merge(dbpath, 0) == -1) {
+			warn("can't merge the segments of %s", dbpath);
+			_exit(1);
+		}
+		_exit(0);
+	}
+}
+
+/* delete the documents named in argv or, if empty, in stdin */
+static int
+remove_docs(const char *dbpath, int argc, char **argv)
+{
+	char **names = NULL, *line = NULL;
+	size_t i, n = 0, cap = 0, linesize = 0, ndel;
+	ssize_t linelen;
+	void *t;
+
+	if (argc == 0) {
+		while ((linelen = getline(&line, &linesize, stdin)) != -1) {
+			if (linelen > 0 && line[linelen - 1] == '\n')
+				line[--linelen] = '\0';
+			if (linelen == 0)
+				continue;
+			if (n == cap) {
+				cap = cap == 0 ? 64 : cap * 2;
+				t = reallocarray(names, cap, sizeof(*names));
+				if (t == NULL)
+					err(1, "reallocarray");
+				names = t;
+			}
+			names[n++] = xstrdup(line);
+		}
+		if (ferror(stdin))
+			err(1, "getline");
+		free(line);
+	} else {
+		if ((names = calloc(argc, sizeof(*names))) == NULL)
+			err(1, "calloc");
+		for (n = 0; n < (size_t)argc; ++n)
+			names[n] = xstrdup(argv[n]);
+	}
+
+	if (segments_delete(dbpath, names, n, &ndel) == -1)
+		err(1, "can't delete from %s", dbpath);
+	if (ndel == 0)
+		warnx("no documents deleted");
+	else
+		merge_later(dbpath);
+
+	for (i = 0; i < n; ++i)
+		free(names[i]);
+	free(names);
+	return 0;
+}
+
 __dead void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-o dbpath] [-m f|p|w] [file ...]\n",
-	    getprogname());
+	fprintf(stderr,
+	    "usage: %s [-a] [-j jobs] [-M size] [-o dbpath] [-m f|p|w] [-p]"
+	    " [file ...]\n"
+	    "       %s -c [-o dbpath]\n"
+	    "       %s -r [-o dbpath] [name ...]\n",
+	    getprogname(), getprogname(), getprogname());
 	exit(1);
 }
 
@@ -57,20 +292,42 @@ int
 main(int argc, char **argv)
 {
 	struct dictionary dict;
+	struct segments segs;
 	struct db_entry *entries = NULL;
-	const char *dbpath = NULL;
-	FILE *fp;
+	const char *dbpath = NULL, *errstr;
+	char tmppath[PATH_MAX];
+	long long size;
 	size_t i, len = 0;
-	int ch, r = 0, mode = MODE_SQLPORTS;
+	int ch, fd, r = 0, mode = MODE_SQLPORTS, positions = 0, jobs = 1;
+	int append = 0, compact = 0, delete = 0;
 
 #ifndef PROFILE
-	/* sqlite needs flock */
-	if (pledge("stdio rpath wpath cpath flock", NULL) == -1)
+	/* sqlite needs flock, the segments need it and proc too */
+	if (pledge("stdio rpath wpath cpath fattr flock proc", NULL) == -1)
 		err(1, "pledge");
 #endif
 
-	while ((ch = getopt(argc, argv, "m:o:")) != -1) {
+	while ((ch = getopt(argc, argv, "acj:M:m:o:pr")) != -1) {
 		switch (ch) {
+		case 'a':
+			append = 1;
+			break;
+		case 'c':
+			compact = 1;
+			break;
+		case 'j':
+			jobs = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "number of jobs is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'M':
+			if (scan_scaled(optarg, &size) == -1)
+				err(1, "invalid memory size: %s", optarg);
+			if (size <= 0)
+				errx(1, "invalid memory size: %s", optarg);
+			membudget = size;
+			break;
 		case 'm':
 			switch (*optarg) {
 			case 'f':
@@ -89,6 +346,12 @@ main(int argc, char **argv)
 		case 'o':
 			dbpath = optarg;
 			break;
+		case 'p':
+			positions = 1;
+			break;
+		case 'r':
+			delete = 1;
+			break;
 		default:
 			usage();
 		}
@@ -99,27 +362,84 @@ main(int argc, char **argv)
 	if (dbpath == NULL)
 		dbpath = "db";
 
+	if (compact) {
+		if (append || delete || argc != 0)
+			usage();
+		if (segments_merge(dbpath, 1) == -1)
+			err(1, "can't merge the segments of %s", dbpath);
+		return 0;
+	}
+
+	if (delete) {
+		if (append)
+			usage();
+		return remove_docs(dbpath, argc, argv);
+	}
+
+	/* the new segment has to match the others */
+	if (append) {
+		if (segments_open(&segs, dbpath) == -1)
+			err(1, "can't open %s", dbpath);
+		if (positions && !(segs.dbs[0].flags & DB_POSITIONS))
+			errx(1, "%s has no positions", dbpath);
+		positions = segs.dbs[0].flags & DB_POSITIONS;
+		segments_close(&segs);
+	}
+
 	if (!dictionary_init(&dict))
 		err(1, "dictionary_init");
+	dict.positions = positions;
 
 	if (mode == MODE_FILES)
-		r = idx_files(&dict, &entries, &len, argc, argv);
+		r = idx_files(&dict, jobs, &entries, &len, argc, argv);
 	else if (mode == MODE_SQLPORTS)
-		r = idx_ports(&dict, &entries, &len, argc, argv);
+		r = idx_ports(&dict, jobs, &entries, &len, argc, argv);
 	else
-		r = idx_wiki(&dict, &entries, &len, argc, argv);
+		r = idx_wiki(&dict, jobs, &entries, &len, argc, argv);
+
+	for (i = 0; i < len && i < ndoclens; ++i)
+		entries[i].len = doclens[i];
 
-	if (r == 0) {
-		if ((fp = fopen(dbpath, "w+")) == NULL)
+	if (r == 0 && !(append && len == 0)) {
+		/*
+		 * Write to a temporary file and rename it into place or,
+		 * when appending, add it as a segment.
+		 */
+		fd = segments_tmpfile(dbpath, tmppath, sizeof(tmppath));
+		if (fd == -1)
 			err(1, "can't open %s", dbpath);
-		if (db_create(fp, &dict, entries, len) == -1) {
+
+		if (nruns > 0) {
+			spill(&dict);
+			r = db_create_merge(fd, spillfp, runs, nruns,
+			    entries, len, positions);
+		} else {
+			dictionary_sort(&dict);
+			r = db_create(fd, &dict, entries, len, jobs);
+		}
+		if (r == -1)
 			warn("db_create");
-			unlink(dbpath);
+		else if (fsync(fd) == -1 || (append ?
+		    segments_add(dbpath, tmppath) :
+		    segments_replace(dbpath, tmppath)) == -1) {
+			warn("can't write %s", dbpath);
+			r = -1;
+		}
+		if (r == -1) {
+			unlink(tmppath);
 			r = 1;
 		}
-		fclose(fp);
+		close(fd);
+
+		if (r == 0 && append)
+			merge_later(dbpath);
 	}
 
+	if (spillfp != NULL)
+		fclose(spillfp);
+	free(runs);
+	free(doclens);
+
 	for (i = 0; i < len; ++i) {
 		free(entries[i].name);
 		free(entries[i].descr);
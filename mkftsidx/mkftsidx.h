@@ -14,18 +14,22 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+typedef int (*idx_fn)(struct dictionary *, size_t, void *);
+
 /* mkftsidx.c */
+int		 index_docs(struct dictionary *, int, size_t, size_t, idx_fn,
+		    void *);
 __dead void	 usage(void);
 char		*xstrdup(const char *);
 
 /* files.c */
-int idx_files(struct dictionary *, struct db_entry **, size_t *,
+int idx_files(struct dictionary *, int, struct db_entry **, size_t *,
     int, char **);
 
 /* ports.c */
-int idx_ports(struct dictionary *, struct db_entry **, size_t *,
+int idx_ports(struct dictionary *, int, struct db_entry **, size_t *,
     int, char **);
 
 /* wiki.c */
-int idx_wiki(struct dictionary *, struct db_entry **, size_t *,
+int idx_wiki(struct dictionary *, int, struct db_entry **, size_t *,
     int, char **);
@@ -17,12 +17,12 @@
 #include <err.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sqlite3.h>
 
 #include "db.h"
 #include "dictionary.h"
-#include "tokenize.h"
 
 #include "mkftsidx.h"
 
@@ -54,15 +54,42 @@ countports(sqlite3 *db)
 	return n;
 }
 
+struct ports {
+	struct db_entry	*entries;
+	char		**descrs;
+};
+
+static int
+add_words(struct dictionary *dict, const char *s, int docid)
+{
+	if (s == NULL)
+		return 1;
+	dictionary_field(dict, docid);
+	return dictionary_add_words(dict, s, strlen(s), docid);
+}
+
+static int
+pport(struct dictionary *dict, size_t i, void *data)
+{
+	struct ports *p = data;
+
+	if (!add_words(dict, p->entries[i].name, i) ||
+	    !add_words(dict, p->entries[i].descr, i) ||
+	    !add_words(dict, p->descrs[i], i))
+		err(1, "dictionary_add_words");
+	return 0;
+}
+
 int
-idx_ports(struct dictionary *dict, struct db_entry **entries, size_t *len,
-    int argc, char **argv)
+idx_ports(struct dictionary *dict, int jobs, struct db_entry **entries,
+    size_t *len, int argc, char **argv)
 {
+	struct ports p;
 	const char *dbpath;
 	sqlite3 *db;
 	sqlite3_stmt *stmt;
 	size_t i;
-	int r;
+	int r, ret = 0;
 
 	if (argc > 1)
 		usage();
@@ -82,6 +109,9 @@ idx_ports(struct dictionary *dict, struct db_entry **entries, size_t *len,
 
 	if ((*entries = calloc(*len, sizeof(**entries))) == NULL)
 		err(1, "calloc");
+	if ((p.descrs = calloc(*len, sizeof(*p.descrs))) == NULL)
+		err(1, "calloc");
+	p.entries = *entries;
 
 	r = sqlite3_prepare_v2(db, QALL, -1, &stmt, NULL);
 	if (r != SQLITE_OK)
@@ -89,7 +119,6 @@ idx_ports(struct dictionary *dict, struct db_entry **entries, size_t *len,
 
 	for (i = 0; i < *len; ++i) {
 		const char *pkgstem, *comment, *descr;
-		char *doc, **toks;
 
 		r = sqlite3_step(stmt);
 		if (r == SQLITE_DONE)
@@ -103,22 +132,20 @@ idx_ports(struct dictionary *dict, struct db_entry **entries, size_t *len,
 
 		(*entries)[i].name = xstrdup(pkgstem);
 		(*entries)[i].descr = xstrdup(comment);
-
-		r = asprintf(&doc, "%s %s %s", pkgstem,
-		    comment != NULL ? comment : "",
-		    descr != NULL ? descr : "");
-		if (r == -1)
-			err(1, "asprintf");
-
-		if ((toks = tokenize(doc)) == NULL)
-			err(1, "tokenize");
-		if (!dictionary_add_words(dict, toks, i))
-			err(1, "dictionary_add_words");
-		freetoks(toks);
-		free(doc);
+		p.descrs[i] = xstrdup(descr);
 	}
+	*len = i;
+
+	sqlite3_finalize(stmt);
+
+	if (index_docs(dict, jobs, 0, *len, pport, &p) == -1)
+		ret = 1;
+
+	for (i = 0; i < *len; ++i)
+		free(p.descrs[i]);
+	free(p.descrs);
 
 done:
 	sqlite3_close(db);
-	return 0;
+	return ret;
 }
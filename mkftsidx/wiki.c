@@ -22,7 +22,6 @@
 
 #include "db.h"
 #include "dictionary.h"
-#include "tokenize.h"
 
 #include "mkftsidx.h"
 
@@ -33,11 +32,18 @@ enum {
 	N_ABS,
 };
 
+/* index the documents in batches of this size */
+#define BATCH	65536
+
 struct mydata {
 	struct dictionary	*dict;
+	int			 jobs;
+	int			 ret;
 	struct db_entry		*entries;
+	char			**texts;
 	size_t			 len;
 	size_t			 cap;
+	size_t			 indexed;
 
 	int next;
 	char *title;
@@ -97,16 +103,46 @@ on_text(void *data, const char *s, int len)
 	}
 }
 
+static int
+pwiki(struct dictionary *dict, size_t i, void *data)
+{
+	struct mydata *d = data;
+	const char *title = d->entries[i].descr, *abstract = d->texts[i];
+
+	if (!dictionary_add_words(dict, title, strlen(title), i))
+		err(1, "dictionary_add_words");
+	if (abstract != NULL) {
+		dictionary_field(dict, i);
+		if (!dictionary_add_words(dict, abstract, strlen(abstract), i))
+			err(1, "dictionary_add_words");
+	}
+	return 0;
+}
+
+static void
+flush(struct mydata *d)
+{
+	size_t i;
+
+	if (index_docs(d->dict, d->jobs, d->indexed, d->len, pwiki, d) == -1)
+		d->ret = 1;
+
+	for (i = d->indexed; i < d->len; ++i) {
+		free(d->texts[i]);
+		d->texts[i] = NULL;
+	}
+	d->indexed = d->len;
+}
+
 static void
 el_end(void *data, const char *element)
 {
 	struct mydata *d = data;
 	struct db_entry *e;
 	size_t newcap;
-	const char *title, *abstract;
-	char *doc, **toks;
+	const char *title;
 	void *t;
-	int r, next;
+	int next;
 
 	next = d->next;
 	d->next = N_UNK;
@@ -125,6 +161,11 @@ el_end(void *data, const char *element)
 		if (t == NULL)
 			err(1, "recallocarray");
 		d->entries = t;
+		t = recallocarray(d->texts, d->cap, newcap,
+		    sizeof(*d->texts));
+		if (t == NULL)
+			err(1, "recallocarray");
+		d->texts = t;
 		d->cap = newcap;
 	}
 
@@ -132,30 +173,21 @@ el_end(void *data, const char *element)
 	if (!strncmp(title, "Wikipedia: ", 11))
 		title += 11;
 
-	if ((abstract = d->abstract) == NULL)
-		abstract = "";
-
-	e = &d->entries[d->len++];
+	e = &d->entries[d->len];
 	e->name = xstrdup(d->url);
 	e->descr = xstrdup(title);
 
+	/* the abstract is kept until the batch is indexed */
+	d->texts[d->len++] = d->abstract;
+
 	if (d->len % 1000 == 0)
 		printf("=> %zu\n", d->len);
 
-	r = asprintf(&doc, "%s %s", title, abstract);
-	if (r == -1)
-		err(1, "asprintf");
-
-	if ((toks = tokenize(doc)) == NULL)
-		err(1, "tokenize");
-	if (!dictionary_add_words(d->dict, toks, d->len-1))
-		err(1, "dictionary_add_words");
-	freetoks(toks);
-	free(doc);
+	if (d->len - d->indexed == BATCH)
+		flush(d);
 
 	free(d->title);
 	free(d->url);
-	free(d->abstract);
 
 	d->title = NULL;
 	d->url = NULL;
@@ -163,8 +195,8 @@ el_end(void *data, const char *element)
 }
 
 int
-idx_wiki(struct dictionary *dict, struct db_entry **entries, size_t *len,
-    int argc, char **argv)
+idx_wiki(struct dictionary *dict, int jobs, struct db_entry **entries,
+    size_t *len, int argc, char **argv)
 {
 	struct mydata d;
 	XML_Parser parser;
@@ -182,6 +214,7 @@ idx_wiki(struct dictionary *dict, struct db_entry **entries, size_t *len,
 
 	memset(&d, 0, sizeof(d));
 	d.dict = dict;
+	d.jobs = jobs;
 
 	if ((parser = XML_ParserCreate(NULL)) == NULL)
 		err(1, "XML_ParserCreate");
@@ -205,8 +238,11 @@ idx_wiki(struct dictionary *dict, struct db_entry **entries, size_t *len,
 	fclose(fp);
 	XML_ParserFree(parser);
 
+	flush(&d);
+	free(d.texts);
+
 	*len = d.len;
 	*entries = d.entries;
 
-	return 0;
+	return d.ret;
 }
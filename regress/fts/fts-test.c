@@ -0,0 +1,725 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Index a random collection the way mkftsidx does and check that
+ * fts_topk() returns the same documents, with the same scores, as
+ * scoring every document with BM25 and sorting them, that fts()
+ * matches the same documents as evaluating random queries on every
+ * document, and that the queries fts_check() rejects fail.  Then
+ * split it in segments and shards, with some documents deleted, and
+ * check that they rank like a single database without them, but for
+ * the df of the words.
+ */
+
+#include <err.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "db.h"
+#include "dictionary.h"
+#include "fts.h"
+#include "segments.h"
+#include "tokenize.h"
+
+#define NDOCS	30000
+#define NWORDS	300
+#define MAXLEN	80
+#define MAXHITS	100
+#define MAXEXPR	64
+#define NSEGS	3
+
+struct hit {
+	uint32_t	id;
+	double		score;
+};
+
+enum {
+	E_WORD,
+	E_PREFIX,
+	E_PHRASE,
+	E_AND,
+	E_OR,
+	E_NOT,
+};
+
+/* a query as a tree, to evaluate it on every document */
+struct expr {
+	int		 type;
+	size_t		 w[2];		/* words, or the prefix */
+	struct expr	*kids[3];
+	size_t		 nkids;
+};
+
+static uint32_t seed = 1;
+
+static struct db db;
+static double scores[NDOCS];
+static int matches[NDOCS];
+
+/* the segments, their first documents and the deleted ones */
+static struct db segdbs[NSEGS];
+static const size_t bases[NSEGS + 1] = {
+	0, NDOCS / 2, NDOCS * 5 / 6, NDOCS
+};
+static struct segments *segs;
+static int dead[NDOCS];
+
+/* the statistics of the documents not deleted */
+static double ndocs;
+static float avgdl;
+
+/* the words of every document, and their sets */
+static uint16_t *words;
+static size_t starts[NDOCS + 1];
+static uint32_t wordset[NDOCS][(NWORDS + 31) / 32];
+
+static struct expr exprs[MAXEXPR];
+static size_t nexprs;
+
+static struct hit got[MAXHITS];
+static size_t ngot;
+
+static uint32_t
+rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 1;
+}
+
+/* the n-th word of the vocabulary */
+static const char *
+word(size_t n)
+{
+	static char w[4];
+
+	w[0] = 'q';
+	w[1] = 'a' + n / 26;
+	w[2] = 'a' + n % 26;
+	w[3] = '\0';
+	return w;
+}
+
+/* a word, the first ones of the vocabulary far more often */
+static size_t
+rndidx(void)
+{
+	return rnd() % (rnd() % NWORDS + 1);
+}
+
+static const char *
+rndword(void)
+{
+	return word(rndidx());
+}
+
+/* make a database of the documents from the one at base to end */
+static void
+mkdb(struct db *d, size_t base, size_t end)
+{
+	struct dictionary dict;
+	struct db_entry *entries;
+	char path[] = "/tmp/fts-test.XXXXXXXXXX";
+	char doc[MAXLEN * 4 + 1], name[24];
+	uint64_t n;
+	size_t i, j;
+	int fd;
+
+	if ((entries = calloc(end - base, sizeof(*entries))) == NULL)
+		err(1, "calloc");
+	if (!dictionary_init(&dict))
+		err(1, "dictionary_init");
+	dict.positions = 1;
+
+	for (i = base; i < end; ++i) {
+		for (doc[0] = '\0', j = starts[i]; j < starts[i + 1]; ++j) {
+			strlcat(doc, word(words[j]), sizeof(doc));
+			strlcat(doc, " ", sizeof(doc));
+		}
+
+		n = dict.ntokens;
+		if (!dictionary_add_words(&dict, doc, strlen(doc), i - base))
+			err(1, "dictionary_add_words");
+		entries[i - base].len = dict.ntokens - n;
+
+		snprintf(name, sizeof(name), "%zu", i);
+		if ((entries[i - base].name = strdup(name)) == NULL)
+			err(1, "strdup");
+	}
+	dictionary_sort(&dict);
+
+	if ((fd = mkstemp(path)) == -1)
+		err(1, "mkstemp");
+	unlink(path);
+	if (db_create(fd, &dict, entries, end - base, 1) == -1)
+		err(1, "db_create");
+	if (db_open(d, fd) == -1)
+		err(1, "db_open");
+
+	dictionary_free(&dict);
+	for (i = 0; i < end - base; ++i)
+		free(entries[i].name);
+	free(entries);
+}
+
+static void
+build(void)
+{
+	size_t i, j, w, len;
+
+	if ((words = calloc(NDOCS, MAXLEN * sizeof(*words))) == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < NDOCS; ++i) {
+		/*
+		 * mostly short documents, some long but not in the last
+		 * segment, so that it's shorter than the average
+		 */
+		len = rnd() % 8 == 0 && i < bases[NSEGS - 1] ?
+		    MAXLEN : MAXLEN / 8;
+		len = 1 + rnd() % len;
+		starts[i + 1] = starts[i] + len;
+		for (j = 0; j < len; ++j) {
+			w = rndidx();
+			words[starts[i] + j] = w;
+			wordset[i][w / 32] |= 1U << (w % 32);
+		}
+	}
+
+	mkdb(&db, 0, NDOCS);
+	ndocs = db.ndocs;
+	avgdl = db.avgdl;
+}
+
+/* split the documents in segments and delete some of the first ones */
+static void
+split(void)
+{
+	static struct segments all;
+	uint8_t *bits;
+	char path[] = "/tmp/fts-test.XXXXXXXXXX";
+	uint64_t total = 0;
+	size_t i, j, len;
+	int fd;
+
+	for (i = 0; i < NSEGS; ++i) {
+		mkdb(&segdbs[i], bases[i], bases[i + 1]);
+		if (i == NSEGS - 1)
+			break;
+
+		len = bases[i + 1] - bases[i];
+		if ((bits = calloc(1, (len + 7) / 8)) == NULL)
+			err(1, "calloc");
+		for (j = 0; j < len; ++j) {
+			if (rnd() % 16 != 0)
+				continue;
+			dead[bases[i] + j] = 1;
+			bits[j / 8] |= 1 << (j % 8);
+		}
+
+		if ((fd = mkstemp(path)) == -1)
+			err(1, "mkstemp");
+		unlink(path);
+		if (db_write_deleted(fd, bits, len) == -1 ||
+		    db_open_deleted(&segdbs[i], fd) == -1)
+			err(1, "can't delete from segment %zu", i);
+		close(fd);
+		free(bits);
+		strlcpy(path, "/tmp/fts-test.XXXXXXXXXX", sizeof(path));
+	}
+
+	all.dbs = segdbs;
+	all.len = NSEGS;
+	segs = &all;
+
+	for (ndocs = 0, i = 0; i < NDOCS; ++i) {
+		if (dead[i])
+			continue;
+		ndocs++;
+		total += db_doc_len(&db, i);
+	}
+	avgdl = (double)total / ndocs;
+}
+
+static uint32_t
+docid(struct db_entry *e)
+{
+	return strtoul(e->name, NULL, 10);
+}
+
+/* add the BM25 score of the word to every document */
+static int
+score_word(const char *w, size_t len, void *data)
+{
+	struct db_cursor c;
+	double df, idf;
+
+	/* not in the index */
+	if (db_word_docs(&db, w, &c) == -1 || c.ndocs == 0)
+		return 0;
+
+	/* the deleted documents still count for the df */
+	df = c.ndocs < ndocs ? c.ndocs : ndocs;
+	idf = log(1 + (ndocs - df + 0.5) / (df + 0.5));
+	c.withtf = 1;
+	while (db_cursor_next(&c) == 1) {
+		scores[c.docid] += idf * db_bm25_tf(c.tfs[c.i - 1],
+		    db_doc_len(&db, c.docid), avgdl);
+		matches[c.docid] = 1;
+	}
+	return 0;
+}
+
+static int
+match_cb(struct db *d, struct db_entry *e, void *data)
+{
+	matches[docid(e)] = 1;
+	return 0;
+}
+
+static int
+topk_cb(struct db *d, struct db_entry *e, double score, void *data)
+{
+	if (ngot == MAXHITS)
+		errx(1, "too many hits");
+	got[ngot].id = docid(e);
+	got[ngot].score = score;
+	ngot++;
+	return 0;
+}
+
+static int
+shard_cb(size_t shard, struct db *d, struct db_entry *e, double score,
+    void *data)
+{
+	return topk_cb(d, e, score, data);
+}
+
+static int
+hit_cmp(const void *a, const void *b)
+{
+	const struct hit *x = a, *y = b;
+
+	if (x->score != y->score)
+		return x->score < y->score ? 1 : -1;
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static void
+cmp_hits(const char *query, size_t k, const char *what,
+    const struct hit *want, size_t n)
+{
+	size_t i;
+
+	if (ngot != n)
+		errx(1, "%s: %s k=%zu: %zu hits, want %zu", query, what, k,
+		    ngot, n);
+	for (i = 0; i < n; ++i)
+		if (got[i].id != want[i].id || got[i].score != want[i].score)
+			errx(1, "%s: %s k=%zu: hit #%zu is %u (%.17g), want"
+			    " %u (%.17g)", query, what, k, i, got[i].id,
+			    got[i].score, want[i].id, want[i].score);
+}
+
+/*
+ * Run the query and compare its top k with the documents that match,
+ * ranked by scores.  Once split, on the segments and on two shards,
+ * one with the first segment and one with the others.
+ */
+static void
+check(const char *query, size_t k)
+{
+	static struct hit want[NDOCS];
+	struct segments parts[2];
+	struct fts_shard shards[2];
+	size_t i, n = 0;
+
+	for (i = 0; i < NDOCS; ++i)
+		if (matches[i] && !dead[i])
+			want[n++] = (struct hit){ i, scores[i] };
+	qsort(want, n, sizeof(*want), hit_cmp);
+	if (n > k)
+		n = k;
+
+	ngot = 0;
+	if (segs == NULL) {
+		if (fts_topk(&db, query, k, topk_cb, NULL) == -1)
+			errx(1, "%s: fts_topk failed", query);
+		cmp_hits(query, k, "fts_topk", want, n);
+		return;
+	}
+
+	if (fts_segments_topk(segs, query, k, topk_cb, NULL) == -1)
+		errx(1, "%s: fts_segments_topk failed", query);
+	cmp_hits(query, k, "fts_segments_topk", want, n);
+
+	memset(parts, 0, sizeof(parts));
+	parts[0].dbs = segdbs;
+	parts[0].len = 1;
+	parts[1].dbs = segdbs + 1;
+	parts[1].len = NSEGS - 1;
+	shards[0].segs = &parts[0];
+	shards[0].ctxs = NULL;
+	shards[1].segs = &parts[1];
+	shards[1].ctxs = NULL;
+
+	ngot = 0;
+	if (fts_shards(shards, 2, query, k, shard_cb, NULL) == -1)
+		errx(1, "%s: fts_shards failed", query);
+	cmp_hits(query, k, "fts_shards", want, n);
+}
+
+/* a query of plain words: the documents with any of them */
+static void
+check_words(const char *query, size_t k)
+{
+	memset(scores, 0, sizeof(scores));
+	memset(matches, 0, sizeof(matches));
+	if (tokenize(query, strlen(query), score_word, NULL) == -1)
+		errx(1, "%s: tokenize failed", query);
+	check(query, k);
+}
+
+/* the documents matched by fts(), ranked by the words in rank */
+static void
+check_query(const char *query, const char *rank, size_t k)
+{
+	memset(scores, 0, sizeof(scores));
+	if (tokenize(rank, strlen(rank), score_word, NULL) == -1)
+		errx(1, "%s: tokenize failed", rank);
+	memset(matches, 0, sizeof(matches));
+	if (fts(&db, query, match_cb, NULL) == -1)
+		errx(1, "%s: fts failed", query);
+	check(query, k);
+}
+
+/* a new node */
+static struct expr *
+expr_new(int type)
+{
+	struct expr *e;
+
+	if (nexprs == MAXEXPR)
+		errx(1, "query too big");
+	e = &exprs[nexprs++];
+	memset(e, 0, sizeof(*e));
+	e->type = type;
+	return e;
+}
+
+/*
+ * A random word, prefix or phrase of two words in q.  The words that
+ * aren't negated are added to rank too.
+ */
+static struct expr *
+gen_leaf(int neg, char *q, size_t qsize, char *rank, size_t rsize)
+{
+	struct expr *e;
+	size_t i, j, r = rnd() % 100;
+	char buf[16];
+
+	if (r < 60) {
+		/* NWORDS is a word in no document */
+		e = expr_new(E_WORD);
+		e->w[0] = r < 5 ? NWORDS : rndidx();
+		strlcat(q, word(e->w[0]), qsize);
+		if (!neg) {
+			strlcat(rank, word(e->w[0]), rsize);
+			strlcat(rank, " ", rsize);
+		}
+		return e;
+	}
+
+	if (r < 75) {
+		/* the words starting with "q" and a letter, maybe none */
+		e = expr_new(E_PREFIX);
+		e->w[0] = rnd() % (NWORDS / 26 + 2);
+		snprintf(buf, sizeof(buf), "q%c*", (int)('a' + e->w[0]));
+		strlcat(q, buf, qsize);
+		return e;
+	}
+
+	/* two words that follow each other somewhere */
+	e = expr_new(E_PHRASE);
+	i = rnd() % NDOCS;
+	if (starts[i + 1] - starts[i] < 2) {
+		e->w[0] = rndidx();
+		e->w[1] = rndidx();
+	} else {
+		j = starts[i] + rnd() % (starts[i + 1] - starts[i] - 1);
+		e->w[0] = words[j];
+		e->w[1] = words[j + 1];
+	}
+	strlcat(q, "\"", qsize);
+	strlcat(q, word(e->w[0]), qsize);
+	strlcat(q, " ", qsize);
+	strlcat(q, word(e->w[1]), qsize);
+	strlcat(q, "\"", qsize);
+	if (!neg) {
+		strlcat(rank, word(e->w[0]), rsize);
+		strlcat(rank, " ", rsize);
+		strlcat(rank, word(e->w[1]), rsize);
+		strlcat(rank, " ", rsize);
+	}
+	return e;
+}
+
+/* a random query up to depth levels deep, as gen_leaf() does */
+static struct expr *
+gen(int depth, int neg, char *q, size_t qsize, char *rank, size_t rsize)
+{
+	struct expr *e;
+	const char *sep;
+	size_t i, r = rnd() % 100;
+
+	if (depth == 0 || r < 30)
+		return gen_leaf(neg, q, qsize, rank, rsize);
+
+	if (r >= 85) {
+		e = expr_new(E_NOT);
+		strlcat(q, rnd() % 2 ? "-(" : "NOT (", qsize);
+		e->kids[e->nkids++] = gen(depth - 1, !neg, q, qsize, rank,
+		    rsize);
+		strlcat(q, ")", qsize);
+		return e;
+	}
+
+	e = expr_new(r < 60 ? E_AND : E_OR);
+	if (e->type == E_OR)
+		sep = " OR ";
+	else
+		sep = rnd() % 2 ? " AND " : " ";
+	for (i = 0; i < 2 + rnd() % 2; ++i) {
+		if (i > 0)
+			strlcat(q, sep, qsize);
+		strlcat(q, "(", qsize);
+		e->kids[e->nkids++] = gen(depth - 1, neg, q, qsize, rank,
+		    rsize);
+		strlcat(q, ")", qsize);
+	}
+	return e;
+}
+
+/* whether the document matches the query */
+static int
+expr_match(struct expr *e, size_t doc)
+{
+	size_t i;
+
+	switch (e->type) {
+	case E_WORD:
+		return e->w[0] < NWORDS &&
+		    wordset[doc][e->w[0] / 32] & (1U << (e->w[0] % 32));
+	case E_PREFIX:
+		for (i = starts[doc]; i < starts[doc + 1]; ++i)
+			if (words[i] / 26 == e->w[0])
+				return 1;
+		return 0;
+	case E_PHRASE:
+		for (i = starts[doc]; i + 1 < starts[doc + 1]; ++i)
+			if (words[i] == e->w[0] && words[i + 1] == e->w[1])
+				return 1;
+		return 0;
+	case E_AND:
+		for (i = 0; i < e->nkids; ++i)
+			if (!expr_match(e->kids[i], doc))
+				return 0;
+		return 1;
+	case E_OR:
+		for (i = 0; i < e->nkids; ++i)
+			if (expr_match(e->kids[i], doc))
+				return 1;
+		return 0;
+	case E_NOT:
+		return !expr_match(e->kids[0], doc);
+	}
+	errx(1, "unknown node %d", e->type);
+}
+
+static int
+count_cb(struct db *d, struct db_entry *e, void *data)
+{
+	size_t *n = data;
+
+	if (!matches[docid(e)])
+		errx(1, "document %s shouldn't match", e->name);
+	(*n)++;
+	return 0;
+}
+
+/*
+ * Check that fts() matches the documents e does, and that fts_topk()
+ * ranks them by the words in rank.
+ */
+static void
+check_expr(const char *query, struct expr *e, const char *rank)
+{
+	static const size_t ks[] = { 1, 10, 100 };
+	size_t i, n = 0, want = 0;
+
+	memset(scores, 0, sizeof(scores));
+	if (tokenize(rank, strlen(rank), score_word, NULL) == -1)
+		errx(1, "%s: tokenize failed", rank);
+	for (i = 0; i < NDOCS; ++i) {
+		matches[i] = expr_match(e, i);
+		want += matches[i];
+	}
+
+	if (fts(&db, query, count_cb, &n) == -1)
+		errx(1, "%s: fts failed", query);
+	if (n != want)
+		errx(1, "%s: %zu documents, want %zu", query, n, want);
+
+	for (i = 0; i < sizeof(ks) / sizeof(*ks); ++i)
+		check(query, ks[i]);
+}
+
+/* a query nested n times in parentheses or NOTs */
+static char *
+nest(const char *open, const char *close, size_t n, const char *word)
+{
+	char *q, *p;
+	size_t i, lo = strlen(open), lc = strlen(close), lw = strlen(word);
+
+	if ((p = q = malloc(n * (lo + lc) + lw + 1)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < n; ++i, p += lo)
+		memcpy(p, open, lo);
+	memcpy(p, word, lw);
+	p += lw;
+	for (i = 0; i < n; ++i, p += lc)
+		memcpy(p, close, lc);
+	*p = '\0';
+	return q;
+}
+
+int
+main(void)
+{
+	static const size_t ks[] = { 1, 10, 100 };
+	static const struct {
+		const char	*query;
+		const char	*rank;
+	} qs[] = {
+		{ "qaa qab",			"qaa qab" },
+		{ "qaa OR qkz",			"qaa qkz" },
+		{ "qaa -qab",			"qaa" },
+		{ "qab NOT (qaa OR qac)",	"qab" },
+		{ "(qaa OR qad) qae",		"qaa qad qae" },
+		{ "qaf AND qag AND qah",	"qaf qag qah" },
+		{ "-qaa qab qac",		"qab qac" },
+		{ "qzz OR qaa",			"qaa" },
+	};
+	struct expr *e, *not;
+	const char *errstr;
+	char query[64], q[2048], rank[1024], *deep;
+	size_t i, j, n, w;
+
+	build();
+
+	for (i = 0; i < 300; ++i) {
+		n = 1 + rnd() % 4;
+		for (query[0] = '\0', w = 0; w < n; ++w) {
+			strlcat(query, rndword(), sizeof(query));
+			strlcat(query, " ", sizeof(query));
+		}
+		for (j = 0; j < sizeof(ks) / sizeof(*ks); ++j)
+			check_words(query, ks[j]);
+	}
+
+	/* a word not in the database and a repeated one */
+	check_words("qaa qzz", 10);
+	check_words("qab qab", 10);
+
+	for (i = 0; i < sizeof(qs) / sizeof(*qs); ++i)
+		for (j = 0; j < sizeof(ks) / sizeof(*ks); ++j)
+			check_query(qs[i].query, qs[i].rank, ks[j]);
+
+	/* prefixes can't be in phrases */
+	if (fts_check("qaa \"qab qa*\"", &errstr) != -1 || errstr == NULL)
+		errx(1, "prefix in a phrase accepted by fts_check");
+	if (fts(&db, "qaa \"qab qa*\"", match_cb, NULL) != -1)
+		errx(1, "prefix in a phrase accepted by fts");
+	if (fts_check("qa* \"qab qac\"", &errstr) == -1)
+		errx(1, "fts_check: %s", errstr);
+
+	for (i = 0; i < 500; ++i) {
+		q[0] = rank[0] = '\0';
+		nexprs = 0;
+		e = gen(3, 0, q, sizeof(q), rank, sizeof(rank));
+		check_expr(q, e, rank);
+	}
+
+	/* too deep: the parser has to give up before the stack does */
+	deep = nest("(", ")", 100000, "qaa");
+	if (fts_check(deep, &errstr) != -1)
+		errx(1, "100000 parentheses accepted by fts_check");
+	if (fts(&db, deep, match_cb, NULL) != -1)
+		errx(1, "100000 parentheses accepted by fts");
+	free(deep);
+
+	nexprs = 0;
+	e = expr_new(E_WORD);
+	e->w[0] = 0;
+	not = expr_new(E_NOT);
+	not->kids[not->nkids++] = e;
+
+	/* as deep as allowed */
+	deep = nest("(", ")", 64, "qaa");
+	if (fts_check(deep, &errstr) == -1)
+		errx(1, "64 parentheses: %s", errstr);
+	check_expr(deep, e, "qaa");
+	free(deep);
+
+	/* only the nesting counts */
+	q[0] = rank[0] = '\0';
+	for (i = 0; i < 100; ++i) {
+		strlcat(q, "(qaa) ", sizeof(q));
+		strlcat(rank, "qaa ", sizeof(rank));
+	}
+	check_expr(q, e, rank);
+
+	/* the NOTs cancel out in pairs */
+	deep = nest("NOT ", "", 250000, "qaa");
+	check_expr(deep, e, "qaa");
+	free(deep);
+	deep = nest("-", "", 250001, "qaa");
+	check_expr(deep, not, "");
+	free(deep);
+
+	split();
+	for (i = 0; i < 100; ++i) {
+		n = 1 + rnd() % 4;
+		for (query[0] = '\0', w = 0; w < n; ++w) {
+			strlcat(query, rndword(), sizeof(query));
+			strlcat(query, " ", sizeof(query));
+		}
+		for (j = 0; j < sizeof(ks) / sizeof(*ks); ++j)
+			check_words(query, ks[j]);
+	}
+	for (i = 0; i < sizeof(qs) / sizeof(*qs); ++i)
+		for (j = 0; j < sizeof(ks) / sizeof(*ks); ++j)
+			check_query(qs[i].query, qs[i].rank, ks[j]);
+
+	for (i = 0; i < NSEGS; ++i)
+		db_close(&segdbs[i]);
+	db_close(&db);
+	return 0;
+}
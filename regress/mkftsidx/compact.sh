@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+#
+# Permission to use, copy, modify, and distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+# WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+# MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+# ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+# WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+# ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+# OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+
+# Build a database in three segments, delete some documents, compact
+# it with -c and check that it's the same file as a fresh build of the
+# documents left, at the same path.
+
+set -e
+
+mkftsidx=${1:-mkftsidx}
+case $mkftsidx in
+/*)	;;
+*/*)	mkftsidx=$PWD/$mkftsidx ;;
+esac
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+# the names of the documents from $1 to $2 - 1
+docs() {
+	i=$1
+	while [ "$i" -lt "$2" ]; do
+		printf 'doc%03d\n' "$i"
+		i=$((i + 1))
+	done
+}
+
+i=0
+while [ "$i" -lt 300 ]; do
+	echo "document $i word$((i % 7)) word$((i % 13)) common" > \
+	    "$(printf 'doc%03d' "$i")"
+	i=$((i + 1))
+done
+
+# smaller and smaller, so that none is merged on its own
+"$mkftsidx" -p -m f -o db $(docs 0 150)
+"$mkftsidx" -a -m f -o db $(docs 150 250)
+"$mkftsidx" -a -m f -o db $(docs 250 300)
+[ "$(wc -l < db.segments)" -eq 3 ]
+
+"$mkftsidx" -r -o db doc010 doc160 doc299
+"$mkftsidx" -c -o db
+
+"$mkftsidx" -p -m f -o fresh $(docs 0 300 | grep -v -e doc010 -e doc160 \
+    -e doc299)
+
+if [ -e db.segments ] || [ -e db.del ]; then
+	echo "leftovers after the compaction:" db.* >&2
+	exit 1
+fi
+cmp db fresh
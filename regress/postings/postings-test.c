@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2022 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Encode lists of ids and term frequencies the way db_create() does,
+ * one block of DB_BLOCKLEN at a time, and check that they decode back
+ * to the same values, and that truncated blocks are rejected.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "db.h"
+#include "postings.h"
+
+#define MAXIDS	1024
+
+static uint32_t seed = 1;
+
+static uint32_t
+rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return seed >> 1;
+}
+
+/* ids with gaps up to maxgap, starting at first */
+static void
+fill(uint32_t *ids, size_t n, uint32_t first, uint32_t maxgap)
+{
+	size_t i;
+
+	ids[0] = first;
+	for (i = 1; i < n; ++i)
+		ids[i] = ids[i - 1] + 1 + (maxgap == 0 ? 0 : rnd() % maxgap);
+}
+
+static size_t
+encode(uint8_t *buf, const uint32_t *ids, const uint32_t *tfs, size_t n)
+{
+	uint32_t t[DB_BLOCKLEN], base = UINT32_MAX;
+	size_t i, m, len = 0;
+
+	for (i = 0; i < n; i += m) {
+		m = n - i < DB_BLOCKLEN ? n - i : DB_BLOCKLEN;
+		memcpy(t, ids + i, m * sizeof(*t));
+		len += postings_encode(buf + len, t, m, base);
+		base = ids[i + m - 1];
+		memcpy(t, tfs + i, m * sizeof(*t));
+		len += postings_encode_tf(buf + len, t, m);
+	}
+	return len;
+}
+
+/* decode the list, or return -1 if it's rejected as corrupted */
+static int
+decode(const uint8_t *buf, size_t len, uint32_t *ids, uint32_t *tfs,
+    size_t n)
+{
+	const uint8_t *p = buf, *end = buf + len;
+	uint32_t base = UINT32_MAX;
+	size_t i, m;
+
+	for (i = 0; i < n; i += m) {
+		m = n - i < DB_BLOCKLEN ? n - i : DB_BLOCKLEN;
+		if ((p = postings_decode(p, end, ids + i, m, base)) == NULL)
+			return -1;
+		base = ids[i + m - 1];
+		if ((p = postings_decode_tf(p, end, tfs + i, m)) == NULL)
+			return -1;
+	}
+	return p == end ? 0 : -1;
+}
+
+static void
+check_bitmap(const uint8_t *buf, size_t len, const uint32_t *ids, size_t n,
+    const char *what)
+{
+	const uint8_t *p = buf, *end = buf + len;
+	uint32_t *bits, base = UINT32_MAX;
+	size_t i, m, nbits;
+
+	nbits = ids[n - 1] + 1;
+	if ((bits = calloc((nbits + 31) / 32 + 1, sizeof(*bits))) == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < n; i += m) {
+		m = n - i < DB_BLOCKLEN ? n - i : DB_BLOCKLEN;
+		p = postings_decode_bitmap(p, end, bits, nbits, m, &base);
+		if (p == NULL)
+			errx(1, "%s: bitmap decoding failed", what);
+		if (base != ids[i + m - 1])
+			errx(1, "%s: bitmap base %u, want %u", what, base,
+			    ids[i + m - 1]);
+		if ((p = postings_decode_tf(p, end, NULL, m)) == NULL)
+			errx(1, "%s: skipping the tfs failed", what);
+	}
+
+	for (i = 0, m = 0; i < nbits; ++i) {
+		if (!(bits[i / 32] & (1U << (i % 32))))
+			continue;
+		if (m == n || ids[m] != i)
+			errx(1, "%s: bitmap has %zu", what, i);
+		m++;
+	}
+	if (m != n)
+		errx(1, "%s: bitmap has %zu ids, want %zu", what, m, n);
+	free(bits);
+}
+
+static void
+roundtrip(size_t n, uint32_t first, uint32_t maxgap, uint32_t maxtf)
+{
+	static uint8_t buf[MAXIDS * 2 * 5 + 64];
+	uint32_t ids[MAXIDS], tfs[MAXIDS], dids[MAXIDS], dtfs[MAXIDS];
+	char what[64];
+	size_t i, len;
+
+	snprintf(what, sizeof(what), "n=%zu first=%u gap=%u tf=%u",
+	    n, first, maxgap, maxtf);
+
+	fill(ids, n, first, maxgap);
+	for (i = 0; i < n; ++i)
+		tfs[i] = maxtf == 0 ? 1 : 1 + rnd() % maxtf;
+	if (maxtf != 0)
+		tfs[n - 1] = maxtf;
+
+	len = encode(buf, ids, tfs, n);
+	if (decode(buf, len, dids, dtfs, n) == -1)
+		errx(1, "%s: decoding failed", what);
+	for (i = 0; i < n; ++i) {
+		if (dids[i] != ids[i])
+			errx(1, "%s: id #%zu is %u, want %u", what, i,
+			    dids[i], ids[i]);
+		if (dtfs[i] != tfs[i])
+			errx(1, "%s: tf #%zu is %u, want %u", what, i,
+			    dtfs[i], tfs[i]);
+	}
+
+	/* every truncation must be caught */
+	for (i = 0; i < len; ++i)
+		if (decode(buf, i, dids, dtfs, n) != -1)
+			errx(1, "%s: truncated at %zu/%zu accepted", what,
+			    i, len);
+
+	if (ids[n - 1] < (1U << 24))
+		check_bitmap(buf, len, ids, n, what);
+}
+
+int
+main(void)
+{
+	static const size_t lens[] = {
+		1, 2, 3, 127, 128, 129, 255, 256, 257, 383, 384, 385, 1000,
+	};
+	static const uint32_t gaps[] = {
+		0, 1, 2, 7, 31, 127, 128, 16384, 1U << 21, 1U << 28,
+	};
+	static const uint32_t tfs[] = {
+		0, 1, 127, 128, 16383, 16384, 1U << 21, 1U << 28, UINT32_MAX,
+	};
+	size_t i, j, k;
+
+	for (i = 0; i < sizeof(lens) / sizeof(*lens); ++i) {
+		for (j = 0; j < sizeof(gaps) / sizeof(*gaps); ++j) {
+			for (k = 0; k < sizeof(tfs) / sizeof(*tfs); ++k) {
+				/* stay below UINT32_MAX */
+				if ((uint64_t)lens[i] * gaps[j] >= 1U << 31)
+					continue;
+				roundtrip(lens[i], 0, gaps[j], tfs[k]);
+				roundtrip(lens[i], 12345, gaps[j], tfs[k]);
+			}
+		}
+	}
+
+	/* the widest gaps, up to the largest id */
+	for (i = 0; i < sizeof(lens) / sizeof(*lens); ++i) {
+		roundtrip(lens[i], UINT32_MAX - 1 - lens[i], 0, 1);
+		if (lens[i] <= 3)
+			roundtrip(lens[i], 0, UINT32_MAX / 4, 1);
+	}
+
+	return 0;
+}